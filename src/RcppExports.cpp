@@ -8,8 +8,8 @@
 using namespace Rcpp;
 
 // inference_cpp
-mcmc_result_inference_t inference_cpp(std::vector<size_t> demography, std::vector<size_t> age_group_limits, Eigen::MatrixXi ili, Eigen::MatrixXi mon_pop, Eigen::MatrixXi n_pos, Eigen::MatrixXi n_samples, flu::vaccine::vaccine_t vaccine_calendar, Eigen::MatrixXi polymod_data, Eigen::VectorXd initial, Eigen::MatrixXd mapping, Eigen::VectorXd risk_ratios, Eigen::VectorXd epsilon_index, size_t psi_index, size_t transmissibility_index, Eigen::VectorXd susceptibility_index, size_t initial_infected_index, Rcpp::Function lprior, bool pass_prior, Rcpp::Function lpeak_prior, bool pass_peak, size_t no_age_groups, size_t no_risk_groups, bool uk_prior, size_t nburn, size_t nbatch, size_t blen);
-RcppExport SEXP _fluEvidenceSynthesis_inference_cpp(SEXP demographySEXP, SEXP age_group_limitsSEXP, SEXP iliSEXP, SEXP mon_popSEXP, SEXP n_posSEXP, SEXP n_samplesSEXP, SEXP vaccine_calendarSEXP, SEXP polymod_dataSEXP, SEXP initialSEXP, SEXP mappingSEXP, SEXP risk_ratiosSEXP, SEXP epsilon_indexSEXP, SEXP psi_indexSEXP, SEXP transmissibility_indexSEXP, SEXP susceptibility_indexSEXP, SEXP initial_infected_indexSEXP, SEXP lpriorSEXP, SEXP pass_priorSEXP, SEXP lpeak_priorSEXP, SEXP pass_peakSEXP, SEXP no_age_groupsSEXP, SEXP no_risk_groupsSEXP, SEXP uk_priorSEXP, SEXP nburnSEXP, SEXP nbatchSEXP, SEXP blenSEXP) {
+mcmc_result_inference_t inference_cpp(std::vector<size_t> demography, std::vector<size_t> age_group_limits, Eigen::MatrixXi ili, Eigen::MatrixXi mon_pop, Eigen::MatrixXi n_pos, Eigen::MatrixXi n_samples, flu::vaccine::vaccine_t vaccine_calendar, Eigen::MatrixXi polymod_data, Eigen::VectorXd initial, Eigen::MatrixXd mapping, Eigen::VectorXd risk_ratios, Eigen::VectorXd epsilon_index, size_t psi_index, size_t transmissibility_index, Eigen::VectorXd susceptibility_index, size_t initial_infected_index, Rcpp::Function lprior, bool pass_prior, Rcpp::Function lpeak_prior, bool pass_peak, size_t no_age_groups, size_t no_risk_groups, bool uk_prior, size_t nburn, size_t nbatch, size_t blen, std::string ode_method, double ode_tolerance, bool blocked, bool delayed_acceptance, bool early_rejection, size_t chains, size_t threads, size_t temperatures, size_t prefetch, size_t tries);
+RcppExport SEXP _fluEvidenceSynthesis_inference_cpp(SEXP demographySEXP, SEXP age_group_limitsSEXP, SEXP iliSEXP, SEXP mon_popSEXP, SEXP n_posSEXP, SEXP n_samplesSEXP, SEXP vaccine_calendarSEXP, SEXP polymod_dataSEXP, SEXP initialSEXP, SEXP mappingSEXP, SEXP risk_ratiosSEXP, SEXP epsilon_indexSEXP, SEXP psi_indexSEXP, SEXP transmissibility_indexSEXP, SEXP susceptibility_indexSEXP, SEXP initial_infected_indexSEXP, SEXP lpriorSEXP, SEXP pass_priorSEXP, SEXP lpeak_priorSEXP, SEXP pass_peakSEXP, SEXP no_age_groupsSEXP, SEXP no_risk_groupsSEXP, SEXP uk_priorSEXP, SEXP nburnSEXP, SEXP nbatchSEXP, SEXP blenSEXP, SEXP ode_methodSEXP, SEXP ode_toleranceSEXP, SEXP blockedSEXP, SEXP delayed_acceptanceSEXP, SEXP early_rejectionSEXP, SEXP chainsSEXP, SEXP threadsSEXP, SEXP temperaturesSEXP, SEXP prefetchSEXP, SEXP triesSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -39,7 +39,17 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< size_t >::type nburn(nburnSEXP);
     Rcpp::traits::input_parameter< size_t >::type nbatch(nbatchSEXP);
     Rcpp::traits::input_parameter< size_t >::type blen(blenSEXP);
-    rcpp_result_gen = Rcpp::wrap(inference_cpp(demography, age_group_limits, ili, mon_pop, n_pos, n_samples, vaccine_calendar, polymod_data, initial, mapping, risk_ratios, epsilon_index, psi_index, transmissibility_index, susceptibility_index, initial_infected_index, lprior, pass_prior, lpeak_prior, pass_peak, no_age_groups, no_risk_groups, uk_prior, nburn, nbatch, blen));
+    Rcpp::traits::input_parameter< std::string >::type ode_method(ode_methodSEXP);
+    Rcpp::traits::input_parameter< double >::type ode_tolerance(ode_toleranceSEXP);
+    Rcpp::traits::input_parameter< bool >::type blocked(blockedSEXP);
+    Rcpp::traits::input_parameter< bool >::type delayed_acceptance(delayed_acceptanceSEXP);
+    Rcpp::traits::input_parameter< bool >::type early_rejection(early_rejectionSEXP);
+    Rcpp::traits::input_parameter< size_t >::type chains(chainsSEXP);
+    Rcpp::traits::input_parameter< size_t >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< size_t >::type temperatures(temperaturesSEXP);
+    Rcpp::traits::input_parameter< size_t >::type prefetch(prefetchSEXP);
+    Rcpp::traits::input_parameter< size_t >::type tries(triesSEXP);
+    rcpp_result_gen = Rcpp::wrap(inference_cpp(demography, age_group_limits, ili, mon_pop, n_pos, n_samples, vaccine_calendar, polymod_data, initial, mapping, risk_ratios, epsilon_index, psi_index, transmissibility_index, susceptibility_index, initial_infected_index, lprior, pass_prior, lpeak_prior, pass_peak, no_age_groups, no_risk_groups, uk_prior, nburn, nbatch, blen, ode_method, ode_tolerance, blocked, delayed_acceptance, early_rejection, chains, threads, temperatures, prefetch, tries));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -58,8 +68,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // inference_multistrains
-mcmc_result_inference_t inference_multistrains(std::vector<size_t> demography, Eigen::MatrixXi ili, Eigen::MatrixXi mon_pop, Rcpp::List n_pos, Eigen::MatrixXi n_samples, Rcpp::List vaccine_calendar, Eigen::MatrixXi polymod_data, Eigen::VectorXd initial, size_t nburn, size_t nbatch, size_t blen);
-RcppExport SEXP _fluEvidenceSynthesis_inference_multistrains(SEXP demographySEXP, SEXP iliSEXP, SEXP mon_popSEXP, SEXP n_posSEXP, SEXP n_samplesSEXP, SEXP vaccine_calendarSEXP, SEXP polymod_dataSEXP, SEXP initialSEXP, SEXP nburnSEXP, SEXP nbatchSEXP, SEXP blenSEXP) {
+mcmc_result_inference_t inference_multistrains(std::vector<size_t> demography, Eigen::MatrixXi ili, Eigen::MatrixXi mon_pop, Rcpp::List n_pos, Eigen::MatrixXi n_samples, Rcpp::List vaccine_calendar, Eigen::MatrixXi polymod_data, Eigen::VectorXd initial, size_t nburn, size_t nbatch, size_t blen, size_t chains, size_t threads);
+RcppExport SEXP _fluEvidenceSynthesis_inference_multistrains(SEXP demographySEXP, SEXP iliSEXP, SEXP mon_popSEXP, SEXP n_posSEXP, SEXP n_samplesSEXP, SEXP vaccine_calendarSEXP, SEXP polymod_dataSEXP, SEXP initialSEXP, SEXP nburnSEXP, SEXP nbatchSEXP, SEXP blenSEXP, SEXP chainsSEXP, SEXP threadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -74,7 +84,9 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< size_t >::type nburn(nburnSEXP);
     Rcpp::traits::input_parameter< size_t >::type nbatch(nbatchSEXP);
     Rcpp::traits::input_parameter< size_t >::type blen(blenSEXP);
-    rcpp_result_gen = Rcpp::wrap(inference_multistrains(demography, ili, mon_pop, n_pos, n_samples, vaccine_calendar, polymod_data, initial, nburn, nbatch, blen));
+    Rcpp::traits::input_parameter< size_t >::type chains(chainsSEXP);
+    Rcpp::traits::input_parameter< size_t >::type threads(threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(inference_multistrains(demography, ili, mon_pop, n_pos, n_samples, vaccine_calendar, polymod_data, initial, nburn, nbatch, blen, chains, threads));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -105,6 +117,30 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// updateCholesky
+Rcpp::List updateCholesky(Eigen::MatrixXd samples, size_t refactorisation_interval);
+RcppExport SEXP _fluEvidenceSynthesis_updateCholesky(SEXP samplesSEXP, SEXP refactorisation_intervalSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< size_t >::type refactorisation_interval(refactorisation_intervalSEXP);
+    rcpp_result_gen = Rcpp::wrap(updateCholesky(samples, refactorisation_interval));
+    return rcpp_result_gen;
+END_RCPP
+}
+// counterUniform
+Eigen::MatrixXd counterUniform(size_t n, size_t no_streams);
+RcppExport SEXP _fluEvidenceSynthesis_counterUniform(SEXP nSEXP, SEXP no_streamsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< size_t >::type n(nSEXP);
+    Rcpp::traits::input_parameter< size_t >::type no_streams(no_streamsSEXP);
+    rcpp_result_gen = Rcpp::wrap(counterUniform(n, no_streams));
+    return rcpp_result_gen;
+END_RCPP
+}
 // getTimeFromWeekYear
 Rcpp::Datetime getTimeFromWeekYear(int week, int year);
 RcppExport SEXP _fluEvidenceSynthesis_getTimeFromWeekYear(SEXP weekSEXP, SEXP yearSEXP) {
@@ -136,8 +172,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // infectionODEs
-Rcpp::DataFrame infectionODEs(Rcpp::NumericVector population, Eigen::VectorXd initial_infected, flu::vaccine::vaccine_t vaccine_calendar, Eigen::MatrixXd contact_matrix, Eigen::VectorXd susceptibility, double transmissibility, Eigen::VectorXd infection_delays, Rcpp::DateVector dates);
-RcppExport SEXP _fluEvidenceSynthesis_infectionODEs(SEXP populationSEXP, SEXP initial_infectedSEXP, SEXP vaccine_calendarSEXP, SEXP contact_matrixSEXP, SEXP susceptibilitySEXP, SEXP transmissibilitySEXP, SEXP infection_delaysSEXP, SEXP datesSEXP) {
+Rcpp::DataFrame infectionODEs(Rcpp::NumericVector population, Eigen::VectorXd initial_infected, flu::vaccine::vaccine_t vaccine_calendar, Eigen::MatrixXd contact_matrix, Eigen::VectorXd susceptibility, double transmissibility, Eigen::VectorXd infection_delays, Rcpp::DateVector dates, std::string method, double tolerance);
+RcppExport SEXP _fluEvidenceSynthesis_infectionODEs(SEXP populationSEXP, SEXP initial_infectedSEXP, SEXP vaccine_calendarSEXP, SEXP contact_matrixSEXP, SEXP susceptibilitySEXP, SEXP transmissibilitySEXP, SEXP infection_delaysSEXP, SEXP datesSEXP, SEXP methodSEXP, SEXP toleranceSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -149,7 +185,29 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< double >::type transmissibility(transmissibilitySEXP);
     Rcpp::traits::input_parameter< Eigen::VectorXd >::type infection_delays(infection_delaysSEXP);
     Rcpp::traits::input_parameter< Rcpp::DateVector >::type dates(datesSEXP);
-    rcpp_result_gen = Rcpp::wrap(infectionODEs(population, initial_infected, vaccine_calendar, contact_matrix, susceptibility, transmissibility, infection_delays, dates));
+    Rcpp::traits::input_parameter< std::string >::type method(methodSEXP);
+    Rcpp::traits::input_parameter< double >::type tolerance(toleranceSEXP);
+    rcpp_result_gen = Rcpp::wrap(infectionODEs(population, initial_infected, vaccine_calendar, contact_matrix, susceptibility, transmissibility, infection_delays, dates, method, tolerance));
+    return rcpp_result_gen;
+END_RCPP
+}
+// infectionODEs_batch
+Rcpp::NumericVector infectionODEs_batch(Rcpp::NumericVector population, Eigen::MatrixXd initial_infected, flu::vaccine::vaccine_t vaccine_calendar, Rcpp::List contact_matrices, Eigen::MatrixXd susceptibility, Eigen::VectorXd transmissibility, Eigen::VectorXd infection_delays, Rcpp::DateVector dates, std::string method, double tolerance);
+RcppExport SEXP _fluEvidenceSynthesis_infectionODEs_batch(SEXP populationSEXP, SEXP initial_infectedSEXP, SEXP vaccine_calendarSEXP, SEXP contact_matricesSEXP, SEXP susceptibilitySEXP, SEXP transmissibilitySEXP, SEXP infection_delaysSEXP, SEXP datesSEXP, SEXP methodSEXP, SEXP toleranceSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type population(populationSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type initial_infected(initial_infectedSEXP);
+    Rcpp::traits::input_parameter< flu::vaccine::vaccine_t >::type vaccine_calendar(vaccine_calendarSEXP);
+    Rcpp::traits::input_parameter< Rcpp::List >::type contact_matrices(contact_matricesSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXd >::type susceptibility(susceptibilitySEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type transmissibility(transmissibilitySEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type infection_delays(infection_delaysSEXP);
+    Rcpp::traits::input_parameter< Rcpp::DateVector >::type dates(datesSEXP);
+    Rcpp::traits::input_parameter< std::string >::type method(methodSEXP);
+    Rcpp::traits::input_parameter< double >::type tolerance(toleranceSEXP);
+    rcpp_result_gen = Rcpp::wrap(infectionODEs_batch(population, initial_infected, vaccine_calendar, contact_matrices, susceptibility, transmissibility, infection_delays, dates, method, tolerance));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -171,6 +229,23 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// binomial_log_likelihood
+double binomial_log_likelihood(double epsilon, size_t predicted, double population_size, int ili_cases, int confirmed_positive, int confirmed_samples, double relative_threshold);
+RcppExport SEXP _fluEvidenceSynthesis_binomial_log_likelihood(SEXP epsilonSEXP, SEXP predictedSEXP, SEXP population_sizeSEXP, SEXP ili_casesSEXP, SEXP confirmed_positiveSEXP, SEXP confirmed_samplesSEXP, SEXP relative_thresholdSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< double >::type epsilon(epsilonSEXP);
+    Rcpp::traits::input_parameter< size_t >::type predicted(predictedSEXP);
+    Rcpp::traits::input_parameter< double >::type population_size(population_sizeSEXP);
+    Rcpp::traits::input_parameter< int >::type ili_cases(ili_casesSEXP);
+    Rcpp::traits::input_parameter< int >::type confirmed_positive(confirmed_positiveSEXP);
+    Rcpp::traits::input_parameter< int >::type confirmed_samples(confirmed_samplesSEXP);
+    Rcpp::traits::input_parameter< double >::type relative_threshold(relative_thresholdSEXP);
+    rcpp_result_gen = Rcpp::wrap(binomial_log_likelihood(epsilon, predicted, population_size, ili_cases, confirmed_positive, confirmed_samples, relative_threshold));
+    return rcpp_result_gen;
+END_RCPP
+}
 // total_log_likelihood
 double total_log_likelihood(Eigen::VectorXd epsilon, double psi, Eigen::MatrixXi predicted, Eigen::VectorXi population_size, Eigen::MatrixXi ili_cases, Eigen::MatrixXi ili_monitored, Eigen::MatrixXi confirmed_positive, Eigen::MatrixXi confirmed_samples, int depth);
 RcppExport SEXP _fluEvidenceSynthesis_total_log_likelihood(SEXP epsilonSEXP, SEXP psiSEXP, SEXP predictedSEXP, SEXP population_sizeSEXP, SEXP ili_casesSEXP, SEXP ili_monitoredSEXP, SEXP confirmed_positiveSEXP, SEXP confirmed_samplesSEXP, SEXP depthSEXP) {
@@ -190,6 +265,26 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// compiled_log_likelihood
+double compiled_log_likelihood(Eigen::VectorXd epsilon, double psi, Eigen::MatrixXi predicted, Eigen::VectorXi population_size, Eigen::MatrixXi ili_cases, Eigen::MatrixXi ili_monitored, Eigen::MatrixXi confirmed_positive, Eigen::MatrixXi confirmed_samples, int depth, std::string summation);
+RcppExport SEXP _fluEvidenceSynthesis_compiled_log_likelihood(SEXP epsilonSEXP, SEXP psiSEXP, SEXP predictedSEXP, SEXP population_sizeSEXP, SEXP ili_casesSEXP, SEXP ili_monitoredSEXP, SEXP confirmed_positiveSEXP, SEXP confirmed_samplesSEXP, SEXP depthSEXP, SEXP summationSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::VectorXd >::type epsilon(epsilonSEXP);
+    Rcpp::traits::input_parameter< double >::type psi(psiSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXi >::type predicted(predictedSEXP);
+    Rcpp::traits::input_parameter< Eigen::VectorXi >::type population_size(population_sizeSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXi >::type ili_cases(ili_casesSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXi >::type ili_monitored(ili_monitoredSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXi >::type confirmed_positive(confirmed_positiveSEXP);
+    Rcpp::traits::input_parameter< Eigen::MatrixXi >::type confirmed_samples(confirmed_samplesSEXP);
+    Rcpp::traits::input_parameter< int >::type depth(depthSEXP);
+    Rcpp::traits::input_parameter< std::string >::type summation(summationSEXP);
+    rcpp_result_gen = Rcpp::wrap(compiled_log_likelihood(epsilon, psi, predicted, population_size, ili_cases, ili_monitored, confirmed_positive, confirmed_samples, depth, summation));
+    return rcpp_result_gen;
+END_RCPP
+}
 // runPredatorPrey
 Eigen::MatrixXd runPredatorPrey(double step_size, double h_step);
 RcppExport SEXP _fluEvidenceSynthesis_runPredatorPrey(SEXP step_sizeSEXP, SEXP h_stepSEXP) {
@@ -215,8 +310,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // adaptiveMCMCR
-Rcpp::List adaptiveMCMCR(Rcpp::Function lprior, Rcpp::Function llikelihood, Rcpp::Function outfun, Rcpp::Function acceptfun, size_t nburn, Eigen::VectorXd initial, size_t nbatch, size_t blen, bool verbose);
-RcppExport SEXP _fluEvidenceSynthesis_adaptiveMCMCR(SEXP lpriorSEXP, SEXP llikelihoodSEXP, SEXP outfunSEXP, SEXP acceptfunSEXP, SEXP nburnSEXP, SEXP initialSEXP, SEXP nbatchSEXP, SEXP blenSEXP, SEXP verboseSEXP) {
+Rcpp::List adaptiveMCMCR(Rcpp::Function lprior, Rcpp::Function llikelihood, Rcpp::Function outfun, Rcpp::Function acceptfun, size_t nburn, Eigen::VectorXd initial, size_t nbatch, size_t blen, bool verbose, Rcpp::Nullable<Rcpp::Function> surrogate_llikelihood, size_t tries);
+RcppExport SEXP _fluEvidenceSynthesis_adaptiveMCMCR(SEXP lpriorSEXP, SEXP llikelihoodSEXP, SEXP outfunSEXP, SEXP acceptfunSEXP, SEXP nburnSEXP, SEXP initialSEXP, SEXP nbatchSEXP, SEXP blenSEXP, SEXP verboseSEXP, SEXP surrogate_llikelihoodSEXP, SEXP triesSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -229,7 +324,9 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< size_t >::type nbatch(nbatchSEXP);
     Rcpp::traits::input_parameter< size_t >::type blen(blenSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
-    rcpp_result_gen = Rcpp::wrap(adaptiveMCMCR(lprior, llikelihood, outfun, acceptfun, nburn, initial, nbatch, blen, verbose));
+    Rcpp::traits::input_parameter< Rcpp::Nullable<Rcpp::Function> >::type surrogate_llikelihood(surrogate_llikelihoodSEXP);
+    Rcpp::traits::input_parameter< size_t >::type tries(triesSEXP);
+    rcpp_result_gen = Rcpp::wrap(adaptiveMCMCR(lprior, llikelihood, outfun, acceptfun, nburn, initial, nbatch, blen, verbose, surrogate_llikelihood, tries));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -246,6 +343,21 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// bootstrap_contact_matrix
+Rcpp::List bootstrap_contact_matrix(Eigen::MatrixXi polymod_data, std::vector<size_t> demography, size_t no_steps, size_t no_swaps, Rcpp::NumericVector age_group_limits);
+RcppExport SEXP _fluEvidenceSynthesis_bootstrap_contact_matrix(SEXP polymod_dataSEXP, SEXP demographySEXP, SEXP no_stepsSEXP, SEXP no_swapsSEXP, SEXP age_group_limitsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< Eigen::MatrixXi >::type polymod_data(polymod_dataSEXP);
+    Rcpp::traits::input_parameter< std::vector<size_t> >::type demography(demographySEXP);
+    Rcpp::traits::input_parameter< size_t >::type no_steps(no_stepsSEXP);
+    Rcpp::traits::input_parameter< size_t >::type no_swaps(no_swapsSEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type age_group_limits(age_group_limitsSEXP);
+    rcpp_result_gen = Rcpp::wrap(bootstrap_contact_matrix(polymod_data, demography, no_steps, no_swaps, age_group_limits));
+    return rcpp_result_gen;
+END_RCPP
+}
 // age_group_levels
 Rcpp::CharacterVector age_group_levels(Rcpp::NumericVector limits);
 RcppExport SEXP _fluEvidenceSynthesis_age_group_levels(SEXP limitsSEXP) {
@@ -350,20 +462,26 @@ END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_fluEvidenceSynthesis_inference_cpp", (DL_FUNC) &_fluEvidenceSynthesis_inference_cpp, 26},
+    {"_fluEvidenceSynthesis_inference_cpp", (DL_FUNC) &_fluEvidenceSynthesis_inference_cpp, 36},
     {"_fluEvidenceSynthesis_dmultinomialCPP", (DL_FUNC) &_fluEvidenceSynthesis_dmultinomialCPP, 4},
-    {"_fluEvidenceSynthesis_inference_multistrains", (DL_FUNC) &_fluEvidenceSynthesis_inference_multistrains, 11},
+    {"_fluEvidenceSynthesis_inference_multistrains", (DL_FUNC) &_fluEvidenceSynthesis_inference_multistrains, 13},
     {"_fluEvidenceSynthesis_updateMeans", (DL_FUNC) &_fluEvidenceSynthesis_updateMeans, 3},
     {"_fluEvidenceSynthesis_updateCovariance", (DL_FUNC) &_fluEvidenceSynthesis_updateCovariance, 4},
+    {"_fluEvidenceSynthesis_updateCholesky", (DL_FUNC) &_fluEvidenceSynthesis_updateCholesky, 2},
+    {"_fluEvidenceSynthesis_counterUniform", (DL_FUNC) &_fluEvidenceSynthesis_counterUniform, 2},
     {"_fluEvidenceSynthesis_getTimeFromWeekYear", (DL_FUNC) &_fluEvidenceSynthesis_getTimeFromWeekYear, 2},
     {"_fluEvidenceSynthesis_runSEIRModel", (DL_FUNC) &_fluEvidenceSynthesis_runSEIRModel, 8},
-    {"_fluEvidenceSynthesis_infectionODEs", (DL_FUNC) &_fluEvidenceSynthesis_infectionODEs, 8},
+    {"_fluEvidenceSynthesis_infectionODEs", (DL_FUNC) &_fluEvidenceSynthesis_infectionODEs, 10},
+    {"_fluEvidenceSynthesis_infectionODEs_batch", (DL_FUNC) &_fluEvidenceSynthesis_infectionODEs_batch, 10},
     {"_fluEvidenceSynthesis_log_likelihood", (DL_FUNC) &_fluEvidenceSynthesis_log_likelihood, 8},
+    {"_fluEvidenceSynthesis_binomial_log_likelihood", (DL_FUNC) &_fluEvidenceSynthesis_binomial_log_likelihood, 7},
     {"_fluEvidenceSynthesis_total_log_likelihood", (DL_FUNC) &_fluEvidenceSynthesis_total_log_likelihood, 9},
+    {"_fluEvidenceSynthesis_compiled_log_likelihood", (DL_FUNC) &_fluEvidenceSynthesis_compiled_log_likelihood, 10},
     {"_fluEvidenceSynthesis_runPredatorPrey", (DL_FUNC) &_fluEvidenceSynthesis_runPredatorPrey, 2},
     {"_fluEvidenceSynthesis_runPredatorPreySimple", (DL_FUNC) &_fluEvidenceSynthesis_runPredatorPreySimple, 2},
-    {"_fluEvidenceSynthesis_adaptiveMCMCR", (DL_FUNC) &_fluEvidenceSynthesis_adaptiveMCMCR, 9},
+    {"_fluEvidenceSynthesis_adaptiveMCMCR", (DL_FUNC) &_fluEvidenceSynthesis_adaptiveMCMCR, 11},
     {"_fluEvidenceSynthesis_contact_matrix", (DL_FUNC) &_fluEvidenceSynthesis_contact_matrix, 3},
+    {"_fluEvidenceSynthesis_bootstrap_contact_matrix", (DL_FUNC) &_fluEvidenceSynthesis_bootstrap_contact_matrix, 5},
     {"_fluEvidenceSynthesis_age_group_levels", (DL_FUNC) &_fluEvidenceSynthesis_age_group_levels, 1},
     {"_fluEvidenceSynthesis_age_group_limits", (DL_FUNC) &_fluEvidenceSynthesis_age_group_limits, 1},
     {"_fluEvidenceSynthesis_as_age_group", (DL_FUNC) &_fluEvidenceSynthesis_as_age_group, 2},
@@ -0,0 +1,61 @@
+#ifndef FLU_CHAINS_HH
+#define FLU_CHAINS_HH
+
+#include<algorithm>
+#include<atomic>
+#include<exception>
+#include<thread>
+#include<vector>
+
+namespace flu {
+
+/**
+ * \brief Run independent chains on a pool of threads
+ *
+ * Calls run_chain( chain ) once for each chain and returns the results in
+ * chain order. Chains are handed out to no_threads worker threads as they
+ * become free. With a single thread all chains are run on the calling
+ * thread, which is required when a chain calls back into R. An exception
+ * thrown by a chain is rethrown on the calling thread.
+ */
+template<typename RESULT, typename Func>
+std::vector<RESULT> run_chains( size_t no_chains, size_t no_threads,
+        const Func &run_chain )
+{
+    std::vector<RESULT> results( no_chains );
+    if (no_threads <= 1 || no_chains <= 1)
+    {
+        for (size_t chain = 0; chain < no_chains; ++chain)
+            results[chain] = run_chain( chain );
+        return results;
+    }
+
+    std::atomic<size_t> next_chain( 0 );
+    std::vector<std::exception_ptr> errors( no_chains );
+    auto worker = [&]() {
+        for (size_t chain = next_chain++; chain < no_chains;
+                chain = next_chain++)
+        {
+            try {
+                results[chain] = run_chain( chain );
+            } catch (...) {
+                errors[chain] = std::current_exception();
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 0; i < std::min( no_threads, no_chains ); ++i)
+        pool.push_back( std::thread( worker ) );
+    for (auto &thread : pool)
+        thread.join();
+
+    for (auto &error : errors)
+    {
+        if (error)
+            std::rethrow_exception( error );
+    }
+    return results;
+}
+}
+#endif
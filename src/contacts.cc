@@ -10,24 +10,82 @@
 namespace flu
 {
     namespace contacts {
-        contacts_t bootstrap_contacts( contacts_t&& bootstrap,
-                const contacts_t &original,
-                size_t no )
+        void swap_journal_t::propose( const contacts_t &bootstrap,
+                const contacts_t &original, size_t no, rng::rng_t &rng )
         {
+            swaps.clear();
             for(size_t i=0;i<no;i++)
             {
-                auto alea1=(size_t) R::runif(0,bootstrap.contacts.size());
-                auto alea2=(size_t) R::runif(0,bootstrap.contacts.size());
+                auto alea1=(size_t) rng.uniform(0,bootstrap.size());
+                auto alea2=(size_t) rng.uniform(0,original.size());
+                swaps.push_back( std::make_pair( alea1, alea2 ) );
+            }
+        }
+
+        void swap_journal_t::apply( contact_matrix_t &matrix, 
+                const contacts_t &bootstrap, 
+                const contacts_t &original ) const
+        {
+            for (size_t i = 0; i < swaps.size(); ++i)
+            {
+                // The participant might have been swapped in earlier
+                auto outgoing_c = &bootstrap;
+                auto outgoing = swaps[i].first;
+                for (size_t j = 0; j < i; ++j)
+                {
+                    if (swaps[j].first == swaps[i].first)
+                    {
+                        outgoing_c = &original;
+                        outgoing = swaps[j].second;
+                    }
+                }
+                matrix.replace( *outgoing_c, outgoing, 
+                        original, swaps[i].second );
+            }
+        }
+
+        void swap_journal_t::commit( contacts_t &bootstrap,
+                const contacts_t &original )
+        {
+            for (auto &swap : swaps)
+            {
+                auto alea1 = swap.first;
+                auto alea2 = swap.second;
 
-                bootstrap.ni[bootstrap.contacts[alea1].age]--;
-                if(bootstrap.contacts[alea1].weekend) bootstrap.nwe--;
+                bootstrap.ni[bootstrap.age[alea1]]--;
+                if(bootstrap.weekend[alea1]) bootstrap.nwe--;
 
-                bootstrap.contacts[alea1]=original.contacts[alea2];
+                bootstrap.N.row(alea1)=original.N.row(alea2);
+                bootstrap.age[alea1]=original.age[alea2];
+                bootstrap.AG[alea1]=original.AG[alea2];
+                bootstrap.weekend[alea1]=original.weekend[alea2];
+                bootstrap.id[alea1]=original.id[alea2];
 
-                bootstrap.ni[bootstrap.contacts[alea1].age]++;
-                if(bootstrap.contacts[alea1].weekend) bootstrap.nwe++;
+                bootstrap.ni[bootstrap.age[alea1]]++;
+                if(bootstrap.weekend[alea1]) bootstrap.nwe++;
             }
-            return bootstrap;
+            swaps.clear();
+        }
+
+        contacts_t bootstrap_contacts( contacts_t&& bootstrap,
+                const contacts_t &original,
+                size_t no, rng::rng_t &rng )
+        {
+            swap_journal_t journal;
+            journal.propose( bootstrap, original, no, rng );
+            journal.commit( bootstrap, original );
+            return std::move(bootstrap);
+        }
+
+        contacts_t bootstrap_contacts( contacts_t&& bootstrap,
+                const contacts_t &original,
+                size_t no, contact_matrix_t &matrix, rng::rng_t &rng )
+        {
+            swap_journal_t journal;
+            journal.propose( bootstrap, original, no, rng );
+            journal.apply( matrix, bootstrap, original );
+            journal.commit( bootstrap, original );
+            return std::move(bootstrap);
         }
 
         contacts_t shuffle_by_id( const contacts_t &sorted_c, const std::vector<size_t> &ids )
@@ -35,50 +93,40 @@ namespace flu
             contacts_t shuffled_c;
 
             /*translate into an initial infected population*/
-            for(size_t i=0;i<150;i++)
-                shuffled_c.ni[i]=0;
+            shuffled_c.ni = std::vector<int>( sorted_c.ni.size(), 0 );
             shuffled_c.nwe=0;
-            for(size_t i=0; i<sorted_c.contacts.size(); i++)
+            shuffled_c.N.resize( sorted_c.N.rows(), sorted_c.N.cols() );
+            for(size_t i=0; i<sorted_c.size(); i++)
             {
                 if (ids[i] <= 0)
                     ::Rf_error("You are using old inference results with the newer package version. You might want to rerun the inference or add 1 to all the contact_ids values");
                 auto nc = ids[i]-1;
 
                 // Make sure that the ids are still the same
-                assert( sorted_c.contacts[nc].id == nc );
+                assert( sorted_c.id[nc] == ids[i] );
 
-                auto age_part=sorted_c.contacts[nc].age;
+                auto age_part=sorted_c.age[nc];
                 shuffled_c.ni[age_part]++;
-                if(sorted_c.contacts[nc].weekend) shuffled_c.nwe++;
+                if(sorted_c.weekend[nc]) shuffled_c.nwe++;
 
-                shuffled_c.contacts.push_back(sorted_c.contacts[nc]);
+                shuffled_c.N.row(i) = sorted_c.N.row(nc);
+                shuffled_c.age.push_back(age_part);
+                shuffled_c.AG.push_back(sorted_c.AG[nc]);
+                shuffled_c.weekend.push_back(sorted_c.weekend[nc]);
+                shuffled_c.id.push_back(sorted_c.id[nc]);
             }
 
             return shuffled_c;
         }
 
-        Eigen::MatrixXd to_symmetric_matrix( const contacts_t &c, 
-                const data::age_data_t &age_data )
+        /// Normalise the weighted contact sums and make them symmetric
+        static Eigen::MatrixXd normalised_symmetric_matrix( 
+                Eigen::MatrixXd mij, const Eigen::VectorXd &w_norm,
+                const Eigen::VectorXi &age_group_sizes )
         {
-            Eigen::VectorXd ww = Eigen::VectorXd( c.contacts.size() );
-            auto nag = age_data.age_group_sizes.size();
-            Eigen::MatrixXd mij = Eigen::MatrixXd::Zero(nag, nag);
-            Eigen::VectorXd w_norm = Eigen::VectorXd::Zero(nag);
+            auto nag = age_group_sizes.size();
             Eigen::MatrixXd cij(nag, nag);
 
-            for(size_t i=0; i<c.contacts.size(); i++)
-            {
-                int age_part=c.contacts[i].age;
-                int AG_part=c.contacts[i].AG;
-                if(!c.contacts[i].weekend)
-                    ww[i]=(double)age_data.age_sizes[age_part]/c.ni[age_part]*5/(c.contacts.size()-c.nwe);
-                else
-                    ww[i]=(double)age_data.age_sizes[age_part]/c.ni[age_part]*2/c.nwe;
-                w_norm[AG_part]+=ww[i];
-                for (size_t j=0; j<c.contacts[i].N.size(); ++j)
-                    mij(AG_part,j)+=c.contacts[i].N[j]*ww[i];
-            }
-
             /*Compute the contact matrix*/
             for(int i=0; i<mij.cols(); i++)
             {
@@ -86,7 +134,7 @@ namespace flu
                 {
                     if(w_norm[j]>0)
                         mij(j,i)/=w_norm[j];
-                    cij(j,i)=mij(j,i)/age_data.age_group_sizes[i];
+                    cij(j,i)=mij(j,i)/age_group_sizes[i];
                 }
 
             }
@@ -106,6 +154,110 @@ namespace flu
             return contact_regular;
         }
 
+        Eigen::MatrixXd to_symmetric_matrix( const contacts_t &c, 
+                const data::age_data_t &age_data )
+        {
+            Eigen::VectorXd ww = Eigen::VectorXd( c.size() );
+            auto nag = age_data.age_group_sizes.size();
+            Eigen::MatrixXd mij = Eigen::MatrixXd::Zero(nag, nag);
+            Eigen::VectorXd w_norm = Eigen::VectorXd::Zero(nag);
+
+            for(size_t i=0; i<c.size(); i++)
+            {
+                int age_part=c.age[i];
+                if(!c.weekend[i])
+                    ww[i]=(double)age_data.age_sizes[age_part]/c.ni[age_part]*5/(c.size()-c.nwe);
+                else
+                    ww[i]=(double)age_data.age_sizes[age_part]/c.ni[age_part]*2/c.nwe;
+            }
+
+            // Weighted sum of the contact rows, by age group
+            for(size_t i=0; i<c.size(); i++)
+            {
+                w_norm[c.AG[i]]+=ww[i];
+                mij.row(c.AG[i])+=ww[i]*c.N.row(i).cast<double>();
+            }
+
+            return normalised_symmetric_matrix( mij, w_norm, 
+                    age_data.age_group_sizes );
+        }
+
+        contact_matrix_t::contact_matrix_t( const contacts_t &c, 
+                const data::age_data_t &age_data )
+            : age_sizes( age_data.age_sizes ), 
+            age_group_sizes( age_data.age_group_sizes ),
+            age_groups( c.ni.size(), -1 ), ni( c.ni.size(), 0 )
+        {
+            auto nag = age_group_sizes.size();
+            for (size_t we = 0; we < 2; ++we)
+            {
+                counts[we] = Eigen::MatrixXi::Zero( ni.size(), nag );
+                no_participants[we] = std::vector<int>( ni.size(), 0 );
+                mij[we] = Eigen::MatrixXd::Zero( nag, nag );
+                w_norm[we] = Eigen::VectorXd::Zero( nag );
+            }
+
+            for (size_t i = 0; i < c.size(); ++i)
+                add( c, i, 1 );
+            for (size_t AG = 0; AG < nag; ++AG)
+                update_row( AG );
+        }
+
+        void contact_matrix_t::add( const contacts_t &c, size_t i, int sign )
+        {
+            const size_t we = c.weekend[i] ? 1 : 0;
+            const auto age = c.age[i];
+            age_groups[age] = c.AG[i];
+            counts[we].row(age) += sign*c.N.row(i);
+            no_participants[we][age] += sign;
+            ni[age] += sign;
+            if (c.weekend[i])
+                nwe += sign;
+            total += sign;
+        }
+
+        void contact_matrix_t::update_row( int AG )
+        {
+            for (size_t we = 0; we < 2; ++we)
+            {
+                mij[we].row(AG).setZero();
+                w_norm[we][AG] = 0;
+            }
+            for (size_t age = 0; age < age_groups.size(); ++age)
+            {
+                if (age_groups[age] != AG || ni[age] <= 0)
+                    continue;
+                const double weight = (double)age_sizes[age]/ni[age];
+                for (size_t we = 0; we < 2; ++we)
+                {
+                    w_norm[we][AG] += weight*no_participants[we][age];
+                    mij[we].row(AG) += 
+                        weight*counts[we].row(age).cast<double>();
+                }
+            }
+        }
+
+        void contact_matrix_t::replace( 
+                const contacts_t &outgoing_c, size_t outgoing,
+                const contacts_t &incoming_c, size_t incoming )
+        {
+            add( outgoing_c, outgoing, -1 );
+            add( incoming_c, incoming, 1 );
+            update_row( outgoing_c.AG[outgoing] );
+            if (incoming_c.AG[incoming] != outgoing_c.AG[outgoing])
+                update_row( incoming_c.AG[incoming] );
+        }
+
+        Eigen::MatrixXd contact_matrix_t::symmetric_matrix() const
+        {
+            // Weekday/weekend factors, which depend on the global nwe
+            const double weekday = (total > nwe) ? 5.0/(total - nwe) : 0;
+            const double weekend = (nwe > 0) ? 2.0/nwe : 0;
+            return normalised_symmetric_matrix( 
+                    weekday*mij[0] + weekend*mij[1],
+                    weekday*w_norm[0] + weekend*w_norm[1], age_group_sizes );
+        }
+
         contacts_t table_to_contacts(
                 const Eigen::MatrixXi &conMatrix,
                 const std::vector<size_t> &limits ) 
@@ -113,36 +265,33 @@ namespace flu
 
             contacts_t c;
 
-            for(size_t i=0; i<150; i++)
-                c.ni[i]=0;
+            c.ni = std::vector<int>( 
+                    (conMatrix.rows() > 0) ? conMatrix.col(0).maxCoeff() + 1 : 0,
+                    0 );
 
             c.nwe=0;
 
             /*Loading of the participants with their number of contacts from Polymod*/
+            c.N = conMatrix.rightCols(conMatrix.cols()-2);
             for(int i=0; i<conMatrix.rows(); i++)
             {
-                contact_t new_contact;
-                new_contact.age = conMatrix(i,0);
-                new_contact.weekend = conMatrix(i,1);
-                new_contact.N.resize(conMatrix.cols()-2);
-                for (size_t j = 0; j < new_contact.N.size(); ++j)
-                    new_contact.N[j] = conMatrix(i,j+2);
-                auto age_part=new_contact.age;
+                auto age_part = conMatrix(i,0);
+                c.age.push_back( age_part );
+                c.weekend.push_back( conMatrix(i,1) != 0 );
                 c.ni[age_part]++;
-                if(new_contact.weekend) c.nwe++;
+                if(c.weekend.back()) c.nwe++;
 
-                new_contact.AG=0;
+                int AG_part=0;
                 for (size_t j = 0; j < limits.size(); ++j)
                 {
                     if (age_part >= (int)limits[j])
-                        new_contact.AG++;
+                        AG_part++;
                     else
                         break;
                 }
+                c.AG.push_back( AG_part );
 
-                new_contact.id = i+1;
-
-                c.contacts.push_back( new_contact );
+                c.id.push_back( i+1 );
             }
 
             return c;
@@ -3,9 +3,11 @@
 
 #include<vector>
 #include<string>
+#include<utility>
 
 #include "state.h"
 #include "data.h"
+#include "rng.h"
 
 #include<Eigen/Core>
 
@@ -13,28 +15,132 @@ namespace flu {
 
     namespace contacts {
 
-        /// Create a contact, holding its age, and contacts (we, N1, N2, etc)..
-        struct contact_t
+        /**
+         * \brief Contact data of all participants and some metadata
+         *
+         * Stored as parallel arrays (one element or row per participant), 
+         * with the number of contacts in a single row major matrix, so that 
+         * copying and bootstrapping the data does not allocate per 
+         * participant.
+         */
+        struct contacts_t
         {
-            size_t id;
-            int age, AG;
+            /// Number of contacts with each age group
+            Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, 
+                Eigen::RowMajor> N;
 
-            std::vector<int> N;
+            std::vector<int> age, AG;
 
             /// Is this data from the weekend
-            bool weekend;
-        };
+            std::vector<char> weekend;
 
-        /// Struct to keep all contacts and some metadata
-        struct contacts_t
-        {
-            std::vector<contact_t> contacts;
+            /// Row of the participant in the polymod table (starting at 1)
+            std::vector<size_t> id;
 
-            /// Total number of participants of each age group
-            int ni[150];
+            /// Total number of participants of each age
+            std::vector<int> ni;
 
             /// Total amount of contact data for weekend
             size_t nwe;
+
+            /// Number of participants
+            size_t size() const
+            {
+                return age.size();
+            }
+        };
+
+        /**
+         * \brief Contact matrix that is updated incrementally when 
+         * participants are replaced
+         *
+         * The weight of a participant is age_sizes[age]/ni[age] times a 
+         * factor that depends on whether the data is from the weekend and on
+         * the global nwe. The weighted contacts (mij) and weights (w_norm) are
+         * therefore kept separately for weekday and weekend participants, 
+         * without that factor. Replacing a participant only changes the rows 
+         * of the age groups of the outgoing and incoming participant, while 
+         * a change in nwe is applied when the matrix is assembled.
+         *
+         * Gives the same matrix as to_symmetric_matrix (up to rounding).
+         */
+        class contact_matrix_t
+        {
+            public:
+                contact_matrix_t() {}
+
+                contact_matrix_t( const contacts_t &contacts, 
+                        const data::age_data_t &age_data );
+
+                /// Replace the outgoing participant by the incoming one
+                void replace( const contacts_t &outgoing_c, size_t outgoing,
+                        const contacts_t &incoming_c, size_t incoming );
+
+                /// Symmetric contact matrix, see to_symmetric_matrix
+                Eigen::MatrixXd symmetric_matrix() const;
+
+            private:
+                void add( const contacts_t &c, size_t i, int sign );
+                void update_row( int AG );
+
+                std::vector<size_t> age_sizes;
+                Eigen::VectorXi age_group_sizes;
+                /// Age group of each age (-1 if no participants of that age)
+                std::vector<int> age_groups;
+
+                /// Contacts and number of participants by age, for weekday 
+                /// (0) and weekend (1) data
+                Eigen::MatrixXi counts[2];
+                std::vector<int> no_participants[2];
+
+                /// Unnormalised contact sums and weights by age group
+                Eigen::MatrixXd mij[2];
+                Eigen::VectorXd w_norm[2];
+
+                std::vector<int> ni;
+                int nwe = 0;
+                int total = 0;
+        };
+
+        /**
+         * \brief Participants swapped by a bootstrap proposal
+         *
+         * Records the swaps (the position in the bootstrapped contacts and
+         * in the original data) without changing the contacts, so that a 
+         * proposal does not need its own copy of all contacts. The swaps are
+         * only applied to the contacts when the proposal is accepted 
+         * (commit), and are simply forgotten otherwise (rollback).
+         */
+        class swap_journal_t
+        {
+            public:
+                /// Draw the swaps (the same draws as bootstrap_contacts)
+                void propose( const contacts_t &bootstrap, 
+                        const contacts_t &original, 
+                        size_t no, rng::rng_t &rng = rng::default_rng() );
+
+                /// Apply the swaps to the contact matrix of the contacts
+                void apply( contact_matrix_t &matrix, 
+                        const contacts_t &bootstrap,
+                        const contacts_t &original ) const;
+
+                /// Apply the swaps to the contacts
+                void commit( contacts_t &bootstrap, 
+                        const contacts_t &original );
+
+                /// Forget the swaps
+                void rollback()
+                {
+                    swaps.clear();
+                }
+
+                bool empty() const
+                {
+                    return swaps.empty();
+                }
+
+            private:
+                std::vector<std::pair<size_t, size_t> > swaps;
         };
 
         /// Convert polymod table (matrix) to contacts_t struct
@@ -45,7 +151,13 @@ namespace flu {
         /// Bootstrap the given contacts, by shuffling back the given no of contacts from the original data
         contacts_t bootstrap_contacts( contacts_t&& bootstrap,
                 const contacts_t &original,
-                size_t no ); 
+                size_t no, rng::rng_t &rng = rng::default_rng() ); 
+
+        /// Bootstrap the given contacts and update their contact matrix
+        contacts_t bootstrap_contacts( contacts_t&& bootstrap,
+                const contacts_t &original,
+                size_t no, contact_matrix_t &matrix, 
+                rng::rng_t &rng = rng::default_rng() ); 
 
          /**
          * \brief Shuffle given contacts according to id. Assumes the given
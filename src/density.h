@@ -0,0 +1,235 @@
+#ifndef FLU_DENSITY_HH
+#define FLU_DENSITY_HH
+
+#include<cmath>
+#include<limits>
+
+namespace flu {
+
+/**
+ * \brief Probability densities that do not use R's C API
+ *
+ * The functions follow R's definitions (and argument order) of dbinom, dnorm,
+ * dlnorm and lgammafn, but are header only. They can be inlined and are safe
+ * to call from any thread. The binomial density uses Loader's saddle point
+ * expansion (as R does), which stays accurate for large counts.
+ */
+namespace density {
+
+    /// log(sqrt(2*pi))
+    const double log_sqrt_2pi = 0.918938533204672741780329736406;
+
+    /// log(2*pi)
+    const double log_2pi = 1.837877066409345483560659472811;
+
+    /// Log of the gamma function
+    inline double lgammafn( double x )
+    {
+        if (std::isnan( x ))
+            return x;
+        if (x <= 0 && x == std::floor( x ))
+            return std::numeric_limits<double>::infinity();
+        if (x < 0.5)
+        {
+            // Reflection formula
+            return log( M_PI/std::fabs( sin( M_PI*x ) ) ) - lgammafn( 1 - x );
+        }
+        if (x <= 20 && x == std::floor( x ))
+        {
+            // (x-1)! is exact in double precision
+            double factorial = 1;
+            for (int i = 2; i < x; ++i)
+                factorial *= i;
+            return log( factorial );
+        }
+        // Shift the argument until the Stirling series is accurate
+        double shift = 0;
+        if (x < 15)
+        {
+            double product = 1;
+            for (; x < 15; ++x)
+                product *= x;
+            shift = log( product );
+        }
+        const double x2 = x*x;
+        const double series = (1.0/12 - (1.0/360 - (1.0/1260 - (1.0/1680 -
+                            1.0/(1188*x2))/x2)/x2)/x2)/x;
+        return log_sqrt_2pi + (x - 0.5)*log( x ) - x + series - shift;
+    }
+
+    /**
+     * \brief Error of Stirling's approximation to log(n!)
+     *
+     * log(n!) - log(sqrt(2*pi*n)*(n/e)^n)
+     */
+    inline double stirling_error( double n )
+    {
+        // Exact values for n = 0, 0.5, 1, ..., 15
+        static const double halves[31] = {
+            0.0, // Not used
+            0.1534264097200273452913848,
+            0.0810614667953272582196702,
+            0.0548141210519176538961390,
+            0.0413406959554092940938221,
+            0.03316287351993628748511048,
+            0.02767792568499833914878929,
+            0.02374616365629749597132920,
+            0.02079067210376509311152277,
+            0.01848845053267318523077934,
+            0.01664469118982119216319487,
+            0.01513497322191737887351255,
+            0.01387612882307074799874573,
+            0.01281046524292022692424986,
+            0.01189670994589177009505572,
+            0.01110455975820691732662991,
+            0.010411265261972096497478567,
+            0.009799416126158803298389475,
+            0.009255462182712732917728637,
+            0.008768700134139385462952823,
+            0.008330563433362871256469318,
+            0.007934114564314020547248100,
+            0.007573675487951840794972024,
+            0.007244554301320383179543912,
+            0.006942840107209529865664152,
+            0.006665247032707682442354394,
+            0.006408994188004207068439631,
+            0.006171712263039457647532867,
+            0.005951370112758847735624416,
+            0.005746216513010115682023589,
+            0.005554733551962801371038690 };
+
+        if (n <= 15)
+        {
+            const double twice = n + n;
+            if (twice == std::floor( twice ) && twice > 0)
+                return halves[(int)twice];
+            return lgammafn( n + 1 ) - (n + 0.5)*log( n ) + n - log_sqrt_2pi;
+        }
+
+        const double n2 = n*n;
+        if (n > 500)
+            return (1.0/12 - 1.0/(360*n2))/n;
+        if (n > 80)
+            return (1.0/12 - (1.0/360 - 1.0/(1260*n2))/n2)/n;
+        if (n > 35)
+            return (1.0/12 - (1.0/360 - (1.0/1260 - 1.0/(1680*n2))/n2)/n2)/n;
+        return (1.0/12 - (1.0/360 - (1.0/1260 - (1.0/1680 -
+                            1.0/(1188*n2))/n2)/n2)/n2)/n;
+    }
+
+    /**
+     * \brief Deviance term x*log(x/np) + np - x
+     *
+     * Uses a series expansion when x is close to np, to avoid cancellation.
+     */
+    inline double binomial_deviance( double x, double np )
+    {
+        if (std::fabs( x - np ) < 0.1*(x + np))
+        {
+            double v = (x - np)/(x + np);
+            double s = (x - np)*v;
+            if (std::fabs( s ) < std::numeric_limits<double>::min())
+                return s;
+            double ej = 2*x*v;
+            v = v*v;
+            for (int j = 1; j < 1000; ++j)
+            {
+                ej *= v;
+                const double s1 = s + ej/(2*j + 1);
+                if (s1 == s)
+                    return s1;
+                s = s1;
+            }
+        }
+        return x*log( x/np ) + np - x;
+    }
+
+    /// Log of the binomial probability of x successes out of n, with p = 1 - q
+    inline double log_binomial_raw( double x, double n, double p, double q )
+    {
+        const double neg_inf = -std::numeric_limits<double>::infinity();
+        if (p == 0)
+            return (x == 0) ? 0 : neg_inf;
+        if (q == 0)
+            return (x == n) ? 0 : neg_inf;
+        if (x == 0)
+        {
+            if (n == 0)
+                return 0;
+            return (p < 0.1) ? -binomial_deviance( n, n*q ) - n*p :
+                n*log( q );
+        }
+        if (x == n)
+            return (q < 0.1) ? -binomial_deviance( n, n*p ) - n*q :
+                n*log( p );
+        if (x < 0 || x > n)
+            return neg_inf;
+        const double lc = stirling_error( n ) - stirling_error( x ) -
+            stirling_error( n - x ) - binomial_deviance( x, n*p ) -
+            binomial_deviance( n - x, n*q );
+        // log(2*pi*x*(n-x)/n)
+        const double lf = log_2pi + log( x ) + log1p( -x/n );
+        return lc - 0.5*lf;
+    }
+
+    /**
+     * \brief Binomial probability of x successes out of n trials
+     *
+     * Returns NaN for invalid parameters (as R does) and zero for non integer
+     * x.
+     */
+    inline double dbinom( double x, double n, double p, bool use_log )
+    {
+        if (std::isnan( x ) || std::isnan( n ) || std::isnan( p ) ||
+                p < 0 || p > 1 || n < 0 || n != std::floor( n ))
+            return std::numeric_limits<double>::quiet_NaN();
+        double lp = -std::numeric_limits<double>::infinity();
+        if (x >= 0 && x == std::floor( x ) && std::isfinite( x ))
+            lp = log_binomial_raw( x, n, p, 1 - p );
+        return use_log ? lp : exp( lp );
+    }
+
+    /// Normal density
+    inline double dnorm( double x, double mu, double sigma, bool use_log )
+    {
+        if (std::isnan( x ) || std::isnan( mu ) || std::isnan( sigma ) ||
+                sigma < 0)
+            return std::numeric_limits<double>::quiet_NaN();
+        double lp = -std::numeric_limits<double>::infinity();
+        if (sigma == 0)
+        {
+            if (x == mu)
+                lp = std::numeric_limits<double>::infinity();
+        } else {
+            const double z = (x - mu)/sigma;
+            if (std::isfinite( z ))
+                lp = -(log_sqrt_2pi + 0.5*z*z + log( sigma ));
+        }
+        return use_log ? lp : exp( lp );
+    }
+
+    /// Log normal density
+    inline double dlnorm( double x, double meanlog, double sdlog,
+            bool use_log )
+    {
+        if (std::isnan( x ) || std::isnan( meanlog ) || std::isnan( sdlog )
+                || sdlog < 0)
+            return std::numeric_limits<double>::quiet_NaN();
+        double lp = -std::numeric_limits<double>::infinity();
+        if (x > 0)
+        {
+            if (sdlog == 0)
+            {
+                if (log( x ) == meanlog)
+                    lp = std::numeric_limits<double>::infinity();
+            } else {
+                const double z = (log( x ) - meanlog)/sdlog;
+                if (std::isfinite( z ))
+                    lp = -(log_sqrt_2pi + 0.5*z*z + log( x*sdlog ));
+            }
+        }
+        return use_log ? lp : exp( lp );
+    }
+}
+}
+#endif
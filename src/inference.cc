@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include <iostream>
+#include <algorithm>
 
 #include "model.h"
 #include "state.h"
@@ -11,8 +12,11 @@
 #include "contacts.h"
 #include "vaccine.h"
 #include "proposal.h"
+#include "density.h"
 
 #include "mcmc.h"
+#include "chains.h"
+#include "tempering.h"
 
 #include "rcppwrap.h"
 #include<RcppEigen.h>
@@ -37,8 +41,18 @@ using namespace flu;
 //' @param nburn Number of iterations of burn in
 //' @param nbatch Number of batches to run (number of samples to return)
 //' @param blen Length of each batch
+//' @param ode_method Integration method used to run the model: "euler" (fixed step), "rkf45" or "dopri5" (adaptive step size)
+//' @param ode_tolerance Tolerance of the adaptive integration methods (allowed local error in number of people per day)
+//' @param blocked Update the observation parameters (epsilon and psi) separately from the other parameters, each with their own proposal distribution
+//' @param delayed_acceptance Screen proposals with a run of the model using a coarse adaptive solver, before running the full model (delayed acceptance)
+//' @param early_rejection Stop running the model for a proposal as soon as its likelihood can no longer be high enough for it to be accepted. Only used for proposals that keep the current observation parameters and without a peak prior, so mainly useful together with blocked. The samples are the same as without early rejection.
+//' @param chains Number of independent chains to run. Each chain has its own proposal distribution and random number stream, seeded from R. Multiple chains use a counter based random number generator, so the samples differ from a single chain run with the same seed
+//' @param threads Number of threads used to run the chains in parallel. Ignored (the chains are run one after the other) when passing a prior or peak prior function, because these call back into R
+//' @param temperatures Number of temperatures used for parallel tempering. With more than one temperature each chain runs a ladder of tempered chains (each on its own thread), which target the posterior with the likelihood raised to the power 1/temperature and regularly swap temperatures with their neighbours. The temperatures are adapted towards a swap rate of 0.234, and only the samples of the cold chain (temperature one) are returned. Can not be used with a prior or peak prior function
+//' @param prefetch Number of model runs made in parallel by each chain using speculative prefetching. The model is also run for the next proposals, assuming that the current ones are rejected (the most likely outcome), and a run is only used when the chain actually makes that proposal. The samples do not depend on the value, but with a value above one the counter based random number generator is used, as with multiple chains. Can not be used with a peak prior function or delayed acceptance, and replaces early rejection
+//' @param tries Number of candidates proposed at each step using multiple-try Metropolis (Liu, Liang and Wong 2000). One of the candidates is selected based on its posterior density, and the model runs for the candidates are made in parallel. The proposal scaling is adapted towards a higher acceptance rate that depends on the number of tries. Can not be used with prefetching or delayed acceptance, and a peak prior function makes the model runs sequential
 //' 
-//' @return Returns a list with the accepted samples and the corresponding llikelihood values and a matrix (contact.ids) containing the ids (row number) of the contacts data used to build the contact matrix.
+//' @return Returns a list with the accepted samples and the corresponding llikelihood values, a matrix (contact.ids) containing the ids (row number) of the contacts data used to build the contact matrix and the average number of integration steps per model run (ode.steps). With delayed acceptance it also contains the fraction of proposals rejected by the coarse model (stage1.rejection.rate) and the estimated speed up (speedup). With early rejection it also contains the fraction of model runs that were stopped early (early.rejection.rate). With multiple chains the samples of all chains are stacked, and chain gives the chain of each sample. With parallel tempering it also contains the final temperatures (temperatures) and the fraction of accepted swaps between neighbouring temperatures (swap.rates). With prefetching it also contains the fraction of the prefetched model runs that were used (prefetch.usage).
 //'
 // [[Rcpp::export(name=".inference_cpp")]]
 mcmc_result_inference_t inference_cpp( std::vector<size_t> demography,
@@ -63,18 +77,15 @@ mcmc_result_inference_t inference_cpp( std::vector<size_t> demography,
         size_t no_risk_groups,
         bool uk_prior,
         size_t nburn = 0,
-        size_t nbatch = 1000, size_t blen = 1 )
+        size_t nbatch = 1000, size_t blen = 1,
+        std::string ode_method = "euler", double ode_tolerance = 1.0,
+        bool blocked = false, bool delayed_acceptance = false,
+        bool early_rejection = false, size_t chains = 1, 
+        size_t threads = 1, size_t temperatures = 1, size_t prefetch = 1,
+        size_t tries = 1 )
 {
-    //Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor> mapping,
-    mcmc_result_inference_t results;
-    results.batch = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, initial.size() );
-    results.llikelihoods = Eigen::VectorXd( nbatch );
-    results.contact_ids = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, polymod_data.rows() );
-
-    int step_mat;
-    double prop_likelihood;
-
-    double my_acceptance_rate;
+    if (chains < 1 || threads < 1)
+        ::Rf_error("Need at least one chain and one thread");
 
     flu::data::age_data_t age_data;
     age_data.age_sizes = demography;
@@ -118,53 +129,54 @@ mcmc_result_inference_t inference_cpp( std::vector<size_t> demography,
     for (size_t i = 0; i < (size_t)polymod_data.rows(); ++i)
         contact_ids.push_back(i+1);
 
-    auto curr_parameters = initial;
-    Eigen::VectorXd curr_init_inf = flu::data::stratify_by_risk(
-            Eigen::VectorXd::Constant(no_age_groups, pow(10,curr_parameters[initial_infected_index]) ),
-            risk_ratios, no_risk_groups);
-
     if (no_risk_groups < 3)
     {
         pop_vec.conservativeResize(no_age_groups*3);
-        curr_init_inf.conservativeResize(no_age_groups*3);
         for( size_t i = no_age_groups*no_risk_groups; i<pop_vec.size(); ++i)
-        {
             pop_vec[i] = 0;
-            curr_init_inf[i] = 0;
-        }
     } else if (no_risk_groups > 3)
         ::Rf_error("Maximum of three risk groups supported");
 
+    // Initial infected population for the given parameters
+    auto pars_to_initial_infected = [&]( const Eigen::VectorXd &pars )
+    {
+        Eigen::VectorXd init_inf = flu::data::stratify_by_risk(
+                Eigen::VectorXd::Constant(no_age_groups, pow(10,pars[initial_infected_index]) ),
+                risk_ratios, no_risk_groups);
+        if (no_risk_groups < 3)
+        {
+            init_inf.conservativeResize(no_age_groups*3);
+            for( size_t i = no_age_groups*no_risk_groups; i<init_inf.size(); ++i)
+                init_inf[i] = 0;
+        }
+        return init_inf;
+    };
+
     auto polymod = flu::contacts::table_to_contacts( polymod_data, 
             age_group_limits ); 
 
-    auto curr_c = contacts::shuffle_by_id( polymod, 
+    const auto initial_c = contacts::shuffle_by_id( polymod, 
             contact_ids );
 
-    auto current_contact_regular = 
-        contacts::to_symmetric_matrix( curr_c, age_data );
+    const auto initial_contact_regular = 
+        contacts::to_symmetric_matrix( initial_c, age_data );
 
     auto time_latent = 0.8;
     auto time_infectious = 1.8;
 
-    auto result = infectionODE(pop_vec, 
-            curr_init_inf,
-            time_latent, time_infectious, 
-            pars_to_susceptibility(curr_parameters),
-            current_contact_regular, curr_parameters[transmissibility_index], 
-            vaccine_calendar, 7*24 );
+    // The output times and vaccination schedule are the same for every run
+    const auto ode_times = model_times( vaccine_calendar, 7*24, 
+            getTimeFromWeekYear( 35, 1970 ) );
+    const vaccine::schedule_t vaccine_schedule( vaccine_calendar, ode_times );
+
     /*curr_psi=0.00001;*/
     auto d_app = 3;
-    auto curr_llikelihood = log_likelihood_hyper_poisson(
-            pars_to_epsilon(curr_parameters),
-            curr_parameters[psi_index], 
-            days_to_weeks_5AG(result, mapping, pop_RCGP.size()), 
-            ili, mon_pop, n_pos, n_samples, pop_RCGP, d_app);
-
-    auto proposal_state = proposal::initialize( curr_parameters.size() );
+    // The data is the same for the whole run, so everything in the 
+    // likelihood that only depends on the data is computed once and shared
+    // by all chains
+    const compiled_likelihood_t log_likelihood_f( ili, mon_pop, n_pos, 
+            n_samples, pop_RCGP, d_app );
 
-    double curr_prior = 0;
-    double prop_prior = 0;
     auto Rlprior = [&lprior]( const Eigen::VectorXd &pars ) {
         PutRNGstate();
         double lPrior = Rcpp::as<double>(lprior( pars ));
@@ -182,189 +194,908 @@ mcmc_result_inference_t inference_cpp( std::vector<size_t> demography,
         return lPrior;
     };
 
-    if (pass_peak) {
-        size_t id;
-        auto value = result.cases.rowwise().sum().maxCoeff(&id);
-        curr_llikelihood += Rlpeak_prior(result.times[id], value);
-    }
+    // Run the model and return the weekly cases, also setting the log
+    // peak prior when used
+    auto run_model = [&]( const Eigen::VectorXd &init_inf,
+            const Eigen::VectorXd &pars, 
+            const Eigen::MatrixXd &contact_regular,
+            ode::workspace_t<Eigen::VectorXd> &workspace,
+            double &peak_lprior, 
+            const interval_callback_t &interval_done ) -> Eigen::MatrixXd {
+        auto result = infectionODE(pop_vec, 
+                init_inf, 
+                time_latent, time_infectious, 
+                pars_to_susceptibility(pars),
+                contact_regular, pars[transmissibility_index], 
+                vaccine_calendar, vaccine_schedule, ode_times, 
+                workspace, interval_done );
+        if (pass_peak) {
+          size_t id;
+          auto value = result.cases.rowwise().sum().maxCoeff(&id);
+          peak_lprior = Rlpeak_prior(result.times.time(id), value);
+        }
+        return days_to_weeks_5AG(result, mapping, pop_RCGP.size());
+    };
 
+    // With early rejection the uniform used to accept or reject is drawn 
+    // before running the model. After each week the likelihood so far plus
+    // an upper bound for the remaining weeks is compared to the threshold 
+    // implied by that uniform and the run is stopped when it can not be 
+    // reached. The bounds only depend on epsilon and psi and are cached, so
+    // this is used when the proposal keeps the current observation 
+    // parameters (e.g. with blocked updates)
+    const size_t no_weeks = ode_times.size() - 1;
+    const size_t no_groups = pop_RCGP.size();
+    const bool use_early_rejection = early_rejection && !pass_peak &&
+        prefetch <= 1 && tries <= 1 &&
+        no_weeks == (size_t)ili.rows();
+
+    auto same_dynamics = [transmissibility_index, &susceptibility_index,
+         initial_infected_index]( const Eigen::VectorXd &proposed, 
+                 const Eigen::VectorXd &current ) {
+        if (proposed[transmissibility_index] != 
+                current[transmissibility_index] ||
+                proposed[initial_infected_index] != 
+                current[initial_infected_index])
+            return false;
+        for (auto i = 0; i < susceptibility_index.size(); ++i) {
+            auto index = susceptibility_index[i];
+            if (proposed[index] != current[index])
+                return false;
+        }
+        return true;
+    };
 
+    auto same_observation = [&pars_to_epsilon, psi_index]( 
+            const Eigen::VectorXd &proposed, 
+            const Eigen::VectorXd &current ) {
+        return proposed[psi_index] == current[psi_index] &&
+            pars_to_epsilon(proposed) == pars_to_epsilon(current);
+    };
 
-    auto log_prior_ratio_f = [pass_prior, &Rlprior, &prop_prior, &curr_prior, uk_prior, &epsilon_index, psi_index, transmissibility_index, &susceptibility_index, 
-         initial_infected_index](const Eigen::VectorXd &proposed, const Eigen::VectorXd &current, bool susceptibility) {
-             if (uk_prior)
-                return log_prior(proposed, current, susceptibility);
-             else if (pass_prior) {
-                 prop_prior = Rlprior(proposed);
-                 return prop_prior - curr_prior;
-             } else {
-                 prop_prior = 0;
-                 // Use flat priors
-                 for (auto i = 0; i < epsilon_index.size(); ++i) {
-                     auto index = epsilon_index[i];
-                     if (proposed[index] < 0 || proposed[index] > 1) {
-                         prop_prior = log(0);
-                         break;
+    // Parameter blocks that are updated in turn. When blocked, the 
+    // observation parameters (epsilon and psi) get their own block, which 
+    // only needs the likelihood to be recomputed for the cached trajectory
+    std::vector<proposal::block_t> initial_blocks;
+    {
+        std::vector<size_t> observation_indices;
+        for (auto i = 0; i < epsilon_index.size(); ++i)
+            observation_indices.push_back( epsilon_index[i] );
+        observation_indices.push_back( psi_index );
+
+        std::vector<size_t> dynamic_indices, all_indices;
+        for (size_t i = 0; i < (size_t)initial.size(); ++i)
+        {
+            all_indices.push_back( i );
+            if (std::find( observation_indices.begin(), 
+                        observation_indices.end(), i ) == 
+                    observation_indices.end())
+                dynamic_indices.push_back( i );
+        }
+
+        if (blocked && dynamic_indices.size() > 0)
+        {
+            initial_blocks.push_back( proposal::initialize( dynamic_indices ) );
+            initial_blocks.push_back( 
+                    proposal::initialize( observation_indices ) );
+        } else {
+            initial_blocks.push_back( proposal::initialize( all_indices ) );
+        }
+
+        // The optimal acceptance rate of multiple-try Metropolis increases 
+        // with the number of tries
+        if (tries > 1)
+        {
+            for (auto &block : initial_blocks)
+                proposal::set_target_acceptance( block.state, 
+                        multiple_try_t::target_acceptance( tries ) );
+        }
+    }
+
+    // Each chain has its own state, proposal distribution and random 
+    // stream, but shares the data. A single chain draws from R's random 
+    // number generator, multiple chains (or rungs of a tempering ladder) use
+    // streams of the counter based generator seeded from R
+    const auto base_rng = (chains > 1 || temperatures > 1 || prefetch > 1) ? 
+        rng::rng_t( rng::seed_from_r(), 0 ) : rng::rng_t();
+    // Callbacks into R can only be made from the main thread
+    if (pass_prior || pass_peak || base_rng.uses_r())
+        threads = 1;
+    if (temperatures > 1 && (pass_prior || pass_peak))
+        ::Rf_error("Parallel tempering can not be used with a prior or peak prior function");
+    if (prefetch > 1 && (pass_peak || delayed_acceptance))
+        ::Rf_error("Prefetching can not be used with a peak prior function or delayed acceptance");
+    if (tries > 1 && (prefetch > 1 || delayed_acceptance))
+        ::Rf_error("Multiple-try Metropolis can not be used with prefetching or delayed acceptance");
+
+    typedef tempering_t<std::vector<proposal::block_t> > ladder_t;
+
+    // Run a single chain. With parallel tempering this is one rung of the 
+    // ladder, which targets the likelihood to the power beta. Its samples 
+    // are only stored while it is the cold chain, but the statistics of 
+    // the run are always stored in results
+    auto run_rung = [&]( rng::rng_t rng, ladder_t *ladder, size_t rung,
+            mcmc_result_inference_t &results, 
+            mcmc_result_inference_t &samples ) {
+        int step_mat;
+        double prop_likelihood;
+
+        double my_acceptance_rate;
+
+        auto curr_parameters = initial;
+        Eigen::VectorXd curr_init_inf = pars_to_initial_infected(curr_parameters);
+
+        auto curr_c = initial_c;
+        auto current_contact_regular = initial_contact_regular;
+        // Contact matrix of curr_c, updated incrementally by the bootstrap
+        contacts::contact_matrix_t curr_matrix( curr_c, age_data );
+        // Swaps of the proposed contacts, only applied to curr_c on accept
+        contacts::swap_journal_t prop_swaps;
+
+        // Solver settings and state, reused by all model runs
+        ode::workspace_t<Eigen::VectorXd> ode_workspace( 0.25 ); // 6 hours
+        ode_workspace.method = ode::as_method( ode_method );
+        ode_workspace.tolerance = ode_tolerance;
+        size_t ode_runs = 1;
+
+        auto result = infectionODE(pop_vec, 
+                curr_init_inf,
+                time_latent, time_infectious, 
+                pars_to_susceptibility(curr_parameters),
+                current_contact_regular, curr_parameters[transmissibility_index], 
+                vaccine_calendar, vaccine_schedule, ode_times, ode_workspace );
+
+        // The weekly cases (and peak prior) only depend on the parameters that
+        // change the dynamics and on the contacts. They are kept for the current 
+        // state, so that proposals which only change the observation parameters
+        // (epsilon and psi) do not need to run the model
+        Eigen::MatrixXd curr_weekly_cases = 
+            days_to_weeks_5AG(result, mapping, pop_RCGP.size());
+        double curr_peak_lprior = 0;
+
+        auto curr_llikelihood = log_likelihood_f(
+                pars_to_epsilon(curr_parameters),
+                curr_parameters[psi_index],
+                curr_weekly_cases);
+
+        double curr_prior = 0;
+        double prop_prior = 0;
+
+        if (pass_peak) {
+            size_t id;
+            auto value = result.cases.rowwise().sum().maxCoeff(&id);
+            curr_peak_lprior = Rlpeak_prior(result.times.time(id), value);
+            curr_llikelihood += curr_peak_lprior;
+        }
+
+        // With delayed acceptance proposals that change the dynamics are 
+        // first screened using a run of the model with a coarse adaptive 
+        // solver, and only run with the full solver if they pass
+        ode::workspace_t<Eigen::VectorXd> surrogate_workspace( 1.0 );
+        surrogate_workspace.method = ode::DOPRI5;
+        surrogate_workspace.tolerance = 100*ode_tolerance;
+        delayed_acceptance_t da;
+        Eigen::MatrixXd curr_surrogate_cases;
+        double curr_surrogate_peak_lprior = 0;
+        if (delayed_acceptance)
+            curr_surrogate_cases = run_model( curr_init_inf, curr_parameters,
+                    current_contact_regular, surrogate_workspace, 
+                    curr_surrogate_peak_lprior, interval_callback_t() );
+
+        // Cached upper bounds for early rejection
+        Eigen::VectorXd bound_epsilon;
+        double bound_psi = 0;
+        // Upper bound of the log likelihood of week w and all weeks after it
+        std::vector<long double> suffix_bounds;
+        auto update_bounds = [&]( const Eigen::VectorXd &pars ) {
+            auto eps = pars_to_epsilon(pars);
+            if (suffix_bounds.size() > 0 && eps == bound_epsilon &&
+                    pars[psi_index] == bound_psi)
+                return;
+            bound_epsilon = eps;
+            bound_psi = pars[psi_index];
+            suffix_bounds = std::vector<long double>( no_weeks + 1, 0 );
+            for (int week = no_weeks - 1; week >= 0; --week)
+            {
+                suffix_bounds[week] = suffix_bounds[week + 1];
+                for (size_t i = 0; i < no_groups; ++i)
+                    suffix_bounds[week] += log_likelihood_f.upper_bound( 
+                            week, i, eps[i], bound_psi );
+            }
+        };
+        size_t no_early_candidates = 0, no_early_rejected = 0;
+
+        auto log_prior_ratio_f = [pass_prior, &Rlprior, &prop_prior, &curr_prior, uk_prior, &epsilon_index, psi_index, transmissibility_index, &susceptibility_index, 
+             initial_infected_index](const Eigen::VectorXd &proposed, const Eigen::VectorXd &current, bool susceptibility) {
+                 if (uk_prior)
+                    return log_prior(proposed, current, susceptibility);
+                 else if (pass_prior) {
+                     prop_prior = Rlprior(proposed);
+                     return prop_prior - curr_prior;
+                 } else {
+                     prop_prior = 0;
+                     // Use flat priors
+                     for (auto i = 0; i < epsilon_index.size(); ++i) {
+                         auto index = epsilon_index[i];
+                         if (proposed[index] < 0 || proposed[index] > 1) {
+                             prop_prior = log(0);
+                             break;
+                         }
                      }
-                 }
-                 if (proposed[psi_index] < 0 || proposed[transmissibility_index] < 0)
-                     prop_prior = log(0);
-                 for (auto i = 0; i < susceptibility_index.size(); ++i) {
-                     auto index = susceptibility_index[i];
-                     if (!std::isfinite(prop_prior) || proposed[index] < 0 || proposed[index] > 1) {
+                     if (proposed[psi_index] < 0 || proposed[transmissibility_index] < 0)
                          prop_prior = log(0);
-                         break;
+                     for (auto i = 0; i < susceptibility_index.size(); ++i) {
+                         auto index = susceptibility_index[i];
+                         if (!std::isfinite(prop_prior) || proposed[index] < 0 || proposed[index] > 1) {
+                             prop_prior = log(0);
+                             break;
+                         }
                      }
+                     return prop_prior - curr_prior;
                  }
-                 return prop_prior - curr_prior;
-             }
-         };
+             };
 
-    /**************************************************************************************************************************************************************
-    Start of the MCMC
-    **************************************************************************************************************************************************************/
+        /**************************************************************************************************************************************************************
+        Start of the MCMC
+        **************************************************************************************************************************************************************/
 
-    step_mat=1;            /*number of contacts exchanged*/
-    double p_ac_mat=0.10;          /*prob to redraw matrices*/
+        step_mat=1;            /*number of contacts exchanged*/
+        double p_ac_mat=0.10;          /*prob to redraw matrices*/
 
-    size_t sampleCount = 0;
-    int k = 0;
+        // Proposal distributions of this chain (with parallel tempering the
+        // ones belonging to its current temperature are used instead)
+        auto own_blocks = initial_blocks;
 
-    while(sampleCount<nbatch)
-    {
-        ++k;
-
-        /*update of the variance-covariance matrix and the mean vector*/
-        proposal_state = proposal::update( std::move( proposal_state ),
-                curr_parameters, k );
-     
-        /*
-        if (k>=nburn)
+        // Model runs that are made in parallel, each with its own work space
+        struct model_run_t
         {
-          Rcpp::Rcout << "Adaptive scaling: " << proposal_state.adaptive_scaling << std::endl;
-          Rcpp::Rcout << "past_acceptance: " << proposal_state.past_acceptance << std::endl;
-          Rcpp::Rcout << "conv_scaling: " << proposal_state.conv_scaling << std::endl;
-          Rcpp::Rcout << "Acceptance: " << proposal_state.acceptance << std::endl;
-          Rcpp::Rcout << proposal_state.emp_cov_matrix << std::endl << std::endl;
-        }
-        */
-        /*
-        auto prop_parameters = proposal::haario_adapt_scale(
-                curr_parameters,
-                proposal_state.chol_emp_cov,
-                proposal_state.chol_ini,0.05, 
-                proposal_state.adaptive_scaling );*/
-
-        auto prop_parameters = proposal::sherlock( k,
-                curr_parameters,
-                proposal_state );
-
-        auto prior_ratio = 
-            log_prior_ratio_f(prop_parameters, curr_parameters, false );
-
-        if (!std::isfinite(prior_ratio))
+            Eigen::VectorXd parameters;
+            Eigen::MatrixXd contact_regular;
+            Eigen::MatrixXd weekly_cases;
+            double peak_lprior = 0;
+            /// Prefetched for a later proposal and not used yet
+            bool speculative = false;
+        };
+        std::vector<ode::workspace_t<Eigen::VectorXd> > run_workspaces;
+        auto run_models = [&]( std::vector<model_run_t> &runs, 
+                size_t no_threads ) {
+            // Each run starts from the current step size of the solver
+            if (run_workspaces.size() < runs.size())
+                run_workspaces.resize( runs.size() );
+            for (size_t i = 0; i < runs.size(); ++i)
+            {
+                static_cast<ode::solver_state_t&>( run_workspaces[i] ) = 
+                    ode_workspace;
+                run_workspaces[i].no_steps = 0;
+            }
+            run_chains<bool>( runs.size(), no_threads, [&]( size_t i ) {
+                    runs[i].weekly_cases = run_model( 
+                            pars_to_initial_infected( runs[i].parameters ), 
+                            runs[i].parameters, runs[i].contact_regular, 
+                            run_workspaces[i], runs[i].peak_lprior, 
+                            interval_callback_t() );
+                    return true;
+                } );
+            for (size_t i = 0; i < runs.size(); ++i)
+                ode_workspace.no_steps += run_workspaces[i].no_steps;
+            ode_runs += runs.size();
+        };
+
+        // With prefetching, the model is run in parallel for the current 
+        // proposal and for the proposals that the chain would make next if 
+        // these were all rejected (the most likely path). A run is only used
+        // when the chain actually makes a proposal with the same dynamics
+        // and contacts, so the chain is the same as without prefetching
+        std::vector<model_run_t> prefetched;
+        size_t no_prefetched = 0, no_prefetched_used = 0;
+
+        auto speculate = [&]( int k, size_t block_index, 
+                const Eigen::VectorXd &prop_parameters,
+                const Eigen::MatrixXd &prop_contact_regular,
+                rng::rng_t rng, std::vector<proposal::block_t> blocks ) {
+            std::vector<model_run_t> runs( 1 );
+            runs[0].parameters = prop_parameters;
+            runs[0].contact_regular = prop_contact_regular;
+
+            // Follow the path of rejections, making the same random draws as
+            // the chain itself. The prior ratio is evaluated again, so keep 
+            // the prior of the current proposal
+            const double current_prop_prior = prop_prior;
+            rng.uniform(); // Accept or reject the current proposal
+            blocks[block_index].state = proposal::accepted( 
+                    std::move(blocks[block_index].state), false, k );
+            for (size_t step = 0; runs.size() < prefetch && 
+                    step < 10*prefetch; ++step)
+            {
+                if (++block_index == blocks.size())
+                {
+                    block_index = 0;
+                    ++k;
+                }
+                auto &block = blocks[block_index];
+                block.state = proposal::update( std::move( block.state ),
+                        proposal::block_parameters( block, curr_parameters ), 
+                        k );
+                auto parameters = proposal::sherlock( k, curr_parameters, 
+                        block, rng );
+                block.state = proposal::accepted( std::move(block.state), 
+                        false, k );
+                if (!std::isfinite( log_prior_ratio_f( parameters, 
+                                curr_parameters, false ) ))
+                    continue;
+
+                bool contacts_changed = false;
+                auto contact_regular = current_contact_regular;
+                if (block_index == 0 && rng.uniform() < p_ac_mat)
+                {
+                    contacts::swap_journal_t swaps;
+                    swaps.propose( curr_c, polymod, step_mat, rng );
+                    auto matrix = curr_matrix;
+                    swaps.apply( matrix, curr_c, polymod );
+                    contact_regular = matrix.symmetric_matrix();
+                    contacts_changed = true;
+                }
+                rng.uniform(); // Accept or reject
+
+                if (contacts_changed || 
+                        !same_dynamics( parameters, curr_parameters ))
+                {
+                    model_run_t run;
+                    run.parameters = parameters;
+                    run.contact_regular = contact_regular;
+                    run.speculative = true;
+                    runs.push_back( run );
+                }
+            }
+            prop_prior = current_prop_prior;
+
+            run_models( runs, prefetch );
+            // The first run is for the current proposal itself
+            no_prefetched += runs.size() - 1;
+            return runs;
+        };
+
+        // Weekly cases of the proposal, prefetched if needed
+        auto prefetched_cases = [&]( int k, size_t block_index, 
+                const Eigen::VectorXd &prop_parameters,
+                const Eigen::MatrixXd &prop_contact_regular,
+                const rng::rng_t &rng, 
+                const std::vector<proposal::block_t> &blocks ) {
+            auto run = std::find_if( prefetched.begin(), prefetched.end(), 
+                    [&]( const model_run_t &run ) {
+                        return same_dynamics( run.parameters, 
+                                    prop_parameters ) &&
+                            run.contact_regular == prop_contact_regular; } );
+            if (run == prefetched.end())
+            {
+                prefetched = speculate( k, block_index, prop_parameters, 
+                        prop_contact_regular, rng, blocks );
+                run = prefetched.begin();
+            } else if (run->speculative) {
+                ++no_prefetched_used;
+                run->speculative = false;
+            }
+            return run->weekly_cases;
+        };
+
+        // Multiple-try Metropolis (see multiple_try_t), with the tempered 
+        // posterior density as weight. The model runs for each set of 
+        // candidates are made in parallel (unless the peak prior calls back 
+        // into R)
+        struct candidate_t
         {
-            //Rcpp::Rcout << "Invalid proposed par" << std::endl;
-            // TODO: code duplication with failure of acceptance
-            proposal_state = proposal::accepted( 
-                    std::move(proposal_state), 
-                    false, k );
-        } else {
-            /*translate into an initial infected population*/
-            
-            Eigen::VectorXd prop_init_inf = flu::data::stratify_by_risk(
-                    Eigen::VectorXd::Constant(no_age_groups, pow(10,prop_parameters[initial_infected_index]) ),
-                    risk_ratios, no_risk_groups);
-            if (no_risk_groups < 3)
+            model_run_t run;
+            contacts::contacts_t c;
+            contacts::contact_matrix_t matrix;
+            bool adaptive_step = false;
+            double prop_prior = 0;
+            double prior_ratio = 0;
+            double llikelihood = log(0);
+            double log_weight = log(0);
+        };
+        const size_t mtm_threads = pass_peak ? 1 : tries;
+
+        // Draw candidates around the given state and compute their weights
+        auto draw_candidates = [&]( size_t no_candidates, int k, 
+                proposal::block_t &block, bool resample_contacts, 
+                double beta, const candidate_t &from ) {
+            std::vector<candidate_t> candidates( no_candidates );
+            std::vector<model_run_t> runs;
+            std::vector<size_t> run_ids;
+            for (size_t i = 0; i < no_candidates; ++i)
             {
-                prop_init_inf.conservativeResize(no_age_groups*3);
-                for( size_t i = no_age_groups*no_risk_groups; i<prop_init_inf.size(); ++i)
+                auto &candidate = candidates[i];
+                candidate.run.parameters = proposal::sherlock( k, 
+                        from.run.parameters, block, rng );
+                candidate.adaptive_step = block.state.adaptive_step;
+                candidate.c = from.c;
+                candidate.matrix = from.matrix;
+                candidate.run.contact_regular = from.run.contact_regular;
+                bool contacts_changed = false;
+                if (resample_contacts && rng.uniform() < p_ac_mat)
                 {
-                    prop_init_inf[i] = 0;
+                    candidate.c = contacts::bootstrap_contacts( 
+                            contacts::contacts_t( from.c ), polymod, 
+                            step_mat, candidate.matrix, rng );
+                    candidate.run.contact_regular = 
+                        candidate.matrix.symmetric_matrix();
+                    contacts_changed = true;
+                }
+
+                candidate.prior_ratio = log_prior_ratio_f( 
+                        candidate.run.parameters, curr_parameters, false );
+                candidate.prop_prior = prop_prior;
+                if (!std::isfinite( candidate.prior_ratio ))
+                    continue;
+                if (!contacts_changed && 
+                        same_dynamics( candidate.run.parameters, 
+                            from.run.parameters ))
+                {
+                    candidate.run.weekly_cases = from.run.weekly_cases;
+                    candidate.run.peak_lprior = from.run.peak_lprior;
+                } else {
+                    runs.push_back( candidate.run );
+                    run_ids.push_back( i );
                 }
             }
-            auto prop_c = curr_c;
 
-            /*do swap of contacts step_mat times (reduce or increase to change 'distance' of new matrix from current)*/
-            // TODO/WARN Need to draw this before hand and pass it as data to
-            // likelihood function... Even when doing that we still need to know k,
-            // so might as well make the likelihood function increase k when called
-            
-            if(R::runif(0,1) < p_ac_mat)
-                prop_c = contacts::bootstrap_contacts( std::move(prop_c),
-                        polymod, step_mat );
+            run_models( runs, mtm_threads );
+            for (size_t i = 0; i < runs.size(); ++i)
+                candidates[run_ids[i]].run = runs[i];
 
-            auto prop_contact_regular = 
-                contacts::to_symmetric_matrix( prop_c, age_data );
+            for (auto &candidate : candidates)
+            {
+                if (!std::isfinite( candidate.prior_ratio ))
+                    continue;
+                candidate.llikelihood = candidate.run.peak_lprior + 
+                    log_likelihood_f(
+                            pars_to_epsilon( candidate.run.parameters ),
+                            candidate.run.parameters[psi_index],
+                            candidate.run.weekly_cases);
+                candidate.log_weight = beta*candidate.llikelihood + 
+                    candidate.prior_ratio;
+            }
+            return candidates;
+        };
+
+        auto mtm_step = [&]( int k, proposal::block_t &block, 
+                bool resample_contacts, double beta ) {
+            auto accept = [&]( const candidate_t &candidate ) {
+                block.state.adaptive_step = candidate.adaptive_step;
+                block.state = proposal::accepted( 
+                        std::move(block.state), true, k );
+                curr_prior = candidate.prop_prior;
+                curr_parameters = candidate.run.parameters;
+                curr_llikelihood = candidate.llikelihood;
+                curr_c = candidate.c;
+                curr_matrix = candidate.matrix;
+                current_contact_regular = candidate.run.contact_regular;
+                curr_weekly_cases = candidate.run.weekly_cases;
+                curr_peak_lprior = candidate.run.peak_lprior;
+            };
+
+            candidate_t current;
+            current.run.parameters = curr_parameters;
+            current.run.contact_regular = current_contact_regular;
+            current.run.weekly_cases = curr_weekly_cases;
+            current.run.peak_lprior = curr_peak_lprior;
+            current.c = curr_c;
+            current.matrix = curr_matrix;
+            current.log_weight = beta*curr_llikelihood;
+
+            auto candidates = draw_candidates( tries, k, block, 
+                    resample_contacts, beta, current );
+            std::vector<double> log_weights;
+            for (auto &candidate : candidates)
+                log_weights.push_back( candidate.log_weight );
+            const double log_total = 
+                multiple_try_t::log_sum_exp( log_weights );
+
+            if (!std::isfinite( log_total ))
+            {
+                // No candidate with a finite likelihood. As with a single
+                // proposal, use the prior to move towards finite likelihoods
+                auto &candidate = candidates.front();
+                if (!std::isfinite( curr_llikelihood ) && 
+                        std::isfinite( candidate.prior_ratio ) &&
+                        rng.uniform() < exp( candidate.prior_ratio ))
+                    accept( candidate );
+                else
+                    block.state = proposal::accepted( 
+                            std::move(block.state), false, k );
+                return;
+            }
 
-            result = infectionODE(pop_vec, 
-                    prop_init_inf, 
-                    time_latent, time_infectious, 
-                    pars_to_susceptibility(prop_parameters),
-                    prop_contact_regular, prop_parameters[transmissibility_index], 
-                    vaccine_calendar, 7*24 );
-            
-            prop_likelihood = 0;
-            if (pass_peak) {
-              size_t id;
-              auto value = result.cases.rowwise().sum().maxCoeff(&id);
-              prop_likelihood = Rlpeak_prior(result.times[id], value);
+            const auto candidate = candidates[
+                multiple_try_t::select( log_weights, log_total, rng )];
+
+            // Reference set: drawn around the selected candidate, plus the
+            // current state
+            auto references = draw_candidates( tries - 1, k, block, 
+                    resample_contacts, beta, candidate );
+            std::vector<double> reference_weights( 1, current.log_weight );
+            for (auto &reference : references)
+                reference_weights.push_back( reference.log_weight );
+
+            if (rng.uniform() < exp( multiple_try_t::log_acceptance( 
+                            log_total, reference_weights ) ))
+                accept( candidate );
+            else
+            {
+                block.state.adaptive_step = candidate.adaptive_step;
+                block.state = proposal::accepted( 
+                        std::move(block.state), false, k );
             }
+        };
+
+        size_t sampleCount = 0;
+        int k = 0;
+
+        while(sampleCount<nbatch)
+        {
+            ++k;
 
-            /*computes the associated likelihood with the proposed values*/
-            prop_likelihood += log_likelihood_hyper_poisson(
-                    pars_to_epsilon(prop_parameters), 
-                    prop_parameters[psi_index], 
-                    days_to_weeks_5AG(result, mapping, pop_RCGP.size()), 
-                    ili, mon_pop, n_pos, n_samples, pop_RCGP, d_app);
-
-            /*Acceptance rate include the likelihood and the prior but no correction for the proposal as we use a symmetrical RW*/
-            // Make sure accept works with -inf prior
-            // MCMC-R alternative prior?
-            if (std::isinf(prop_likelihood) && std::isinf(curr_llikelihood) )
-                my_acceptance_rate = exp(prior_ratio); // We want to explore and find a non infinite likelihood
-            else 
-                my_acceptance_rate=
-                    exp(prop_likelihood-curr_llikelihood+
-                    prior_ratio);
-
-            if(R::runif(0,1)<my_acceptance_rate) /*with prior*/
+            auto &blocks = ladder ? ladder->state( rung ) : own_blocks;
+            const double beta = ladder ? ladder->beta( rung ) : 1.0;
+
+            for (auto &block : blocks)
             {
-                /*update the acceptance rate*/
-                proposal_state = proposal::accepted( 
-                        std::move(proposal_state), true, k );
+                // Contacts are resampled together with the first block
+                const bool resample_contacts = (&block == &blocks.front());
 
-                curr_prior = prop_prior;
-                curr_parameters = prop_parameters;
+                /*update of the variance-covariance matrix and the mean vector*/
+                block.state = proposal::update( std::move( block.state ),
+                        proposal::block_parameters( block, curr_parameters ), k );
 
-                /*update current likelihood*/
-                curr_llikelihood=prop_likelihood;
+                if (tries > 1)
+                {
+                    // Multiple-try Metropolis replaces the single proposal
+                    mtm_step( k, block, resample_contacts, beta );
+                    continue;
+                }
+     
+                /*
+                if (k>=nburn)
+                {
+                  Rcpp::Rcout << "Adaptive scaling: " << proposal_state.adaptive_scaling << std::endl;
+                  Rcpp::Rcout << "past_acceptance: " << proposal_state.past_acceptance << std::endl;
+                  Rcpp::Rcout << "conv_scaling: " << proposal_state.conv_scaling << std::endl;
+                  Rcpp::Rcout << "Acceptance: " << proposal_state.acceptance << std::endl;
+                  Rcpp::Rcout << proposal_state.emp_cov_matrix << std::endl << std::endl;
+                }
+                */
+                /*
+                auto prop_parameters = proposal::haario_adapt_scale(
+                        curr_parameters,
+                        proposal_state.chol_emp_cov,
+                        proposal_state.chol_ini,0.05, 
+                        proposal_state.adaptive_scaling );*/
+
+                auto prop_parameters = proposal::sherlock( k,
+                        curr_parameters,
+                        block, rng );
+
+                auto prior_ratio = 
+                    log_prior_ratio_f(prop_parameters, curr_parameters, false );
+
+                if (!std::isfinite(prior_ratio))
+                {
+                    //Rcpp::Rcout << "Invalid proposed par" << std::endl;
+                    // TODO: code duplication with failure of acceptance
+                    block.state = proposal::accepted( 
+                            std::move(block.state), 
+                            false, k );
+                } else {
+                    /*do swap of contacts step_mat times (reduce or increase to change 'distance' of new matrix from current)*/
+                    // TODO/WARN Need to draw this before hand and pass it as data to
+                    // likelihood function... Even when doing that we still need to know k,
+                    // so might as well make the likelihood function increase k when called
+            
+                    bool contacts_changed = false;
+                    contacts::contact_matrix_t prop_matrix;
+                    prop_swaps.rollback();
+                    if(resample_contacts && rng.uniform() < p_ac_mat)
+                    {
+                        prop_swaps.propose( curr_c, polymod, step_mat, rng );
+                        prop_matrix = curr_matrix;
+                        prop_swaps.apply( prop_matrix, curr_c, polymod );
+                        contacts_changed = true;
+                    }
 
-                /*new proposed contact matrix*/
-                /*update*/
-                curr_c = prop_c;
-                current_contact_regular=prop_contact_regular;
+                    auto prop_contact_regular = current_contact_regular;
+                    Eigen::MatrixXd prop_weekly_cases, prop_surrogate_cases;
+                    double prop_peak_lprior = 0, prop_surrogate_peak_lprior = 0;
+                    // Log ratio already accounted for by the first stage of
+                    // delayed acceptance
+                    double stage1_log_ratio = 0;
+                    // Uniform drawn before the model run for early rejection
+                    bool uniform_drawn = false;
+                    double uniform = 0;
+                    // Log likelihood accumulated during the model run
+                    bool llikelihood_known = false;
+                    long double early_llikelihood = 0;
+                    if (!contacts_changed && 
+                            same_dynamics( prop_parameters, curr_parameters ))
+                    {
+                        // Only the observation parameters changed
+                        prop_weekly_cases = curr_weekly_cases;
+                        prop_peak_lprior = curr_peak_lprior;
+                    } else {
+                        /*translate into an initial infected population*/
+                        Eigen::VectorXd prop_init_inf = 
+                            pars_to_initial_infected(prop_parameters);
+
+                        if (contacts_changed)
+                            prop_contact_regular = 
+                                prop_matrix.symmetric_matrix();
+
+                        if (delayed_acceptance)
+                        {
+                            // First stage
+                            ++da.no_proposals;
+                            prop_surrogate_cases = da.timed( da.surrogate_time, 
+                                    [&]() { return run_model( prop_init_inf, 
+                                        prop_parameters, prop_contact_regular,
+                                        surrogate_workspace, 
+                                        prop_surrogate_peak_lprior,
+                                        interval_callback_t() ); } );
+                            auto prop_surrogate = prop_surrogate_peak_lprior +
+                                log_likelihood_f(
+                                    pars_to_epsilon(prop_parameters),
+                                    prop_parameters[psi_index],
+                                    prop_surrogate_cases);
+                            auto curr_surrogate = curr_surrogate_peak_lprior +
+                                log_likelihood_f(
+                                    pars_to_epsilon(curr_parameters),
+                                    curr_parameters[psi_index],
+                                    curr_surrogate_cases);
+                            stage1_log_ratio = beta*da.log_ratio( 
+                                    prop_surrogate, curr_surrogate ) + 
+                                prior_ratio;
+                            if (rng.uniform() >= exp(stage1_log_ratio))
+                            {
+                                ++da.no_stage1_rejected;
+                                block.state = proposal::accepted( 
+                                        std::move(block.state), false, k );
+                                continue;
+                            }
+                        }
+
+                        interval_callback_t interval_done;
+                        std::vector<long double> terms;
+                        bool stopped = false;
+                        if (use_early_rejection && 
+                                std::isfinite(curr_llikelihood) &&
+                                same_observation( prop_parameters, 
+                                    curr_parameters ))
+                        {
+                            // Same point in the random stream as the draw
+                            // used to accept or reject below
+                            uniform = rng.uniform();
+                            uniform_drawn = true;
+                            ++no_early_candidates;
+                            update_bounds( prop_parameters );
+
+                            // Leave some slack, so that rounding can never 
+                            // reject a proposal that would be accepted
+                            const double threshold = curr_llikelihood + 
+                                (stage1_log_ratio - prior_ratio + 
+                                 log(uniform))/beta - 1e-6;
+                            terms = std::vector<long double>( 
+                                    no_weeks*no_groups, 0 );
+                            interval_done = [&, threshold]( size_t week, 
+                                    const Eigen::MatrixXd &cases ) {
+                                Eigen::VectorXd by_group = 
+                                    Eigen::VectorXd::Zero( no_groups );
+                                for(size_t k = 0; k < mapping.rows(); ++k)
+                                    by_group((size_t) mapping(k,1)) += 
+                                        mapping(k,2)*cases(week,(size_t) mapping(k,0));
+                                for (size_t i = 0; i < no_groups; ++i)
+                                {
+                                    terms[i*no_weeks + week] = 
+                                        log_likelihood_f( week, i, 
+                                                bound_epsilon[i], bound_psi, 
+                                                by_group[i] );
+                                    early_llikelihood += terms[i*no_weeks + week];
+                                }
+                                stopped = early_llikelihood + 
+                                    suffix_bounds[week + 1] < threshold;
+                                return !stopped;
+                            };
+                        }
+
+                        if (prefetch > 1)
+                        {
+                            prop_weekly_cases = prefetched_cases( k,
+                                    &block - &blocks.front(), prop_parameters,
+                                    prop_contact_regular, rng, blocks );
+                        } else {
+                            prop_weekly_cases = da.timed( da.full_time, [&]() {
+                                    return run_model( prop_init_inf, 
+                                        prop_parameters, prop_contact_regular,
+                                        ode_workspace, prop_peak_lprior, 
+                                        interval_done ); } );
+                            ++ode_runs;
+                        }
+
+                        if (stopped)
+                        {
+                            ++no_early_rejected;
+                            block.state = proposal::accepted( 
+                                    std::move(block.state), false, k );
+                            continue;
+                        }
+
+                        if (uniform_drawn)
+                        {
+                            // Sum in the same order as 
+                            // log_likelihood_hyper_poisson
+                            early_llikelihood = 0;
+                            for (auto &term : terms)
+                                early_llikelihood += term;
+                            llikelihood_known = true;
+                        }
+                    }
+            
+                    prop_likelihood = prop_peak_lprior;
+
+                    /*computes the associated likelihood with the proposed values*/
+                    if (llikelihood_known)
+                        prop_likelihood += (double)early_llikelihood;
+                    else
+                        prop_likelihood += log_likelihood_f(
+                                pars_to_epsilon(prop_parameters),
+                                prop_parameters[psi_index],
+                                prop_weekly_cases);
+
+                    /*Acceptance rate include the likelihood and the prior but no correction for the proposal as we use a symmetrical RW*/
+                    // Make sure accept works with -inf prior
+                    // MCMC-R alternative prior?
+                    if (std::isinf(prop_likelihood) && std::isinf(curr_llikelihood) )
+                        my_acceptance_rate = exp(prior_ratio-stage1_log_ratio); // We want to explore and find a non infinite likelihood
+                    else 
+                        my_acceptance_rate=
+                            exp(beta*(prop_likelihood-curr_llikelihood)+
+                            prior_ratio-stage1_log_ratio);
+
+                    if (!uniform_drawn)
+                        uniform = rng.uniform();
+                    if(uniform<my_acceptance_rate) /*with prior*/
+                    {
+                        /*update the acceptance rate*/
+                        block.state = proposal::accepted( 
+                                std::move(block.state), true, k );
+
+                        curr_prior = prop_prior;
+                        curr_parameters = prop_parameters;
+
+                        /*update current likelihood*/
+                        curr_llikelihood=prop_likelihood;
+
+                        /*new proposed contact matrix*/
+                        /*update*/
+                        if (contacts_changed)
+                        {
+                            prop_swaps.commit( curr_c, polymod );
+                            curr_matrix = std::move(prop_matrix);
+                        }
+                        current_contact_regular=prop_contact_regular;
+                        curr_weekly_cases = prop_weekly_cases;
+                        curr_peak_lprior = prop_peak_lprior;
+                        if (delayed_acceptance && prop_surrogate_cases.size() > 0)
+                        {
+                            curr_surrogate_cases = prop_surrogate_cases;
+                            curr_surrogate_peak_lprior = prop_surrogate_peak_lprior;
+                        }
+                    }
+                    else /*if reject*/
+                    {
+                        block.state = proposal::accepted( 
+                                std::move(block.state), false, k );
+                    }
+                }
             }
-            else /*if reject*/
+
+            if(k%blen==0 && k>=(int)nburn)
             {
-                proposal_state = proposal::accepted( 
-                        std::move(proposal_state), false, k );
+                // Add results
+                if (!ladder || ladder->position( rung ) == 0)
+                {
+                    samples.llikelihoods[sampleCount] = curr_llikelihood;
+                    samples.batch.row( sampleCount ) = curr_parameters;
+                    for( size_t i = 0; i < curr_c.size(); ++i )
+                        samples.contact_ids( sampleCount, i ) =
+                            curr_c.id[i];
+                }
+
+                ++sampleCount;
             }
+
+            // All rungs stop at the same iteration, so they always meet here
+            if (ladder && k % ladder->swap_interval == 0 &&
+                    !ladder->synchronise( rung, curr_llikelihood ))
+                break;
         }
+        results.ode_steps = ((double)ode_workspace.no_steps)/ode_runs;
+        if (delayed_acceptance)
+        {
+            results.delayed_acceptance = true;
+            results.stage1_rejection_rate = da.stage1_rejection_rate();
+            results.speedup = da.speedup();
+        }
+        if (early_rejection)
+        {
+            results.early_rejection = true;
+            if (no_early_candidates > 0)
+                results.early_rejection_rate = 
+                    ((double)no_early_rejected)/no_early_candidates;
+        }
+        if (prefetch > 1)
+        {
+            results.prefetch = true;
+            if (no_prefetched > 0)
+                results.prefetch_usage = 
+                    ((double)no_prefetched_used)/no_prefetched;
+        }
+    };
 
-        if(k%blen==0 && k>=(int)nburn)
+    auto run_chain = [&]( size_t chain ) {
+        mcmc_result_inference_t results;
+        results.batch = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, initial.size() );
+        results.llikelihoods = Eigen::VectorXd( nbatch );
+        results.contact_ids = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, polymod_data.rows() );
+        if (temperatures <= 1)
         {
-            // Add results
-            results.llikelihoods[sampleCount] = curr_llikelihood;
-            results.batch.row( sampleCount ) = curr_parameters;
-            for( size_t i = 0; i < curr_c.contacts.size(); ++i )
-                results.contact_ids( sampleCount, i ) =
-                    curr_c.contacts[i].id;
-
-            ++sampleCount;
+            // All random draws go through this chain's own stream
+            run_rung( base_rng.stream( chain ), nullptr, 0, results, results );
+            return results;
         }
-    }
-    return results;
+
+        // Parallel tempering: every rung runs on its own thread with its own
+        // stream, and the ladder draws the swaps from a separate stream
+        const size_t first_stream = chain*(temperatures + 1);
+        ladder_t ladder( temperatures, initial_blocks, 
+                base_rng.stream( first_stream + temperatures ) );
+        auto rungs = run_chains<mcmc_result_inference_t>( temperatures,
+                temperatures, [&]( size_t rung ) {
+                    mcmc_result_inference_t rung_results;
+                    try {
+                        run_rung( base_rng.stream( first_stream + rung ),
+                                &ladder, rung, rung_results, results );
+                    } catch (...) {
+                        ladder.stop();
+                        throw;
+                    }
+                    return rung_results;
+                } );
+
+        // Statistics are averaged over the rungs
+        results.speedup = 0;
+        for (auto &rung_results : rungs)
+        {
+            results.ode_steps += rung_results.ode_steps/temperatures;
+            results.delayed_acceptance = rung_results.delayed_acceptance;
+            results.stage1_rejection_rate += 
+                rung_results.stage1_rejection_rate/temperatures;
+            results.speedup += rung_results.speedup/temperatures;
+            results.early_rejection = rung_results.early_rejection;
+            results.early_rejection_rate += 
+                rung_results.early_rejection_rate/temperatures;
+            results.prefetch = rung_results.prefetch;
+            results.prefetch_usage += 
+                rung_results.prefetch_usage/temperatures;
+        }
+        auto temps = ladder.temperatures();
+        results.temperatures = Eigen::Map<Eigen::VectorXd>( temps.data(), 
+                temps.size() );
+        auto rates = ladder.swap_rates();
+        results.swap_rates = Eigen::Map<Eigen::VectorXd>( rates.data(), 
+                rates.size() );
+        return results;
+    };
+
+    return combine_chains( run_chains<mcmc_result_inference_t>( chains, 
+            threads, run_chain ) );
 }
 
 double dmultinomial( const Eigen::VectorXi &x, int size, 
@@ -373,10 +1104,10 @@ double dmultinomial( const Eigen::VectorXi &x, int size,
 {
     double loglik = 0.0;
 
-    loglik = R::lgammafn(size+1);
+    loglik = density::lgammafn(size+1);
 
     for (size_t i=0; i < x.size(); ++i)
-        loglik += x[i]*log(prob[i]) - R::lgammafn(x[i]+1);
+        loglik += x[i]*log(prob[i]) - density::lgammafn(x[i]+1);
     if (use_log)
         return loglik;
     return exp(loglik);
@@ -411,8 +1142,10 @@ double dmultinomialCPP( Eigen::VectorXi x, int size, Eigen::VectorXd prob,
 //' @param nburn Number of iterations of burn in
 //' @param nbatch Number of batches to run (number of samples to return)
 //' @param blen Length of each batch
+//' @param chains Number of independent chains to run. Each chain has its own proposal distribution and random number stream, seeded from R. Multiple chains use a counter based random number generator, so the samples differ from a single chain run with the same seed
+//' @param threads Number of threads used to run the chains in parallel
 //' 
-//' @return Returns a list with the accepted samples and the corresponding llikelihood values and a matrix (contact.ids) containing the ids (row number) of the contacts data used to build the contact matrix.
+//' @return Returns a list with the accepted samples and the corresponding llikelihood values and a matrix (contact.ids) containing the ids (row number) of the contacts data used to build the contact matrix. With multiple chains the samples of all chains are stacked, and chain gives the chain of each sample.
 //'
 // [[Rcpp::export]]
 mcmc_result_inference_t inference_multistrains( 
@@ -423,12 +1156,11 @@ mcmc_result_inference_t inference_multistrains(
         Eigen::MatrixXi polymod_data,
         Eigen::VectorXd initial, 
         size_t nburn = 0,
-        size_t nbatch = 1000, size_t blen = 1 )
+        size_t nbatch = 1000, size_t blen = 1,
+        size_t chains = 1, size_t threads = 1 )
 {
-    mcmc_result_inference_t results;
-    results.batch = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, initial.size() );
-    results.llikelihoods = Eigen::VectorXd( nbatch );
-    results.contact_ids = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, polymod_data.rows() );
+    if (chains < 1 || threads < 1)
+        ::Rf_error("Need at least one chain and one thread");
 
     //create vaccine_calendars flu::vaccine::vaccine_t
     std::vector<flu::vaccine::vaccine_t> vaccine_calendars;
@@ -444,11 +1176,8 @@ mcmc_result_inference_t inference_multistrains(
     auto nag = 7;
     auto no_strains = n_pos.size();
 
-    int step_mat;
     double pop_RCGP[5];
 
-    double my_acceptance_rate;
-
     std::vector<size_t> age_group_limits = {1,5,15,25,45,65};
 
     flu::data::age_data_t age_data;
@@ -480,15 +1209,14 @@ mcmc_result_inference_t inference_multistrains(
     for (size_t i = 0; i < (size_t)polymod_data.rows(); ++i)
         contact_ids.push_back(i+1);
 
-    auto curr_parameters = initial;
     auto polymod = flu::contacts::table_to_contacts( polymod_data, 
             age_group_limits ); 
 
-    auto curr_c = contacts::shuffle_by_id( polymod, 
+    const auto initial_c = contacts::shuffle_by_id( polymod, 
             contact_ids );
 
-    auto current_contact_regular = 
-        contacts::to_symmetric_matrix( curr_c, age_data );
+    const auto initial_contact_regular = 
+        contacts::to_symmetric_matrix( initial_c, age_data );
 
     auto time_latent = 0.8;
     auto time_infectious = 1.8;
@@ -518,15 +1246,15 @@ mcmc_result_inference_t inference_multistrains(
             /*Prior for the transmissibility; year other than 2003/04*/
             /*correction for a normal prior with mu=0.1653183 and sd=0.02773053*/
             /*prior on q*/
-            lprob += R::dnorm(sub_pars[3],0.1653183,0.02773053,1);
+            lprob += density::dnorm(sub_pars[3],0.1653183,0.02773053,1);
             /*Prior for the ascertainment probabilities*/
 
             /*correct for the prior from serology season (lognormal):"0-14" lm=-4.493789, ls=0.2860455*/
-            lprob += R::dlnorm(sub_pars[0], -4.493789,0.2860455, 1);
+            lprob += density::dlnorm(sub_pars[0], -4.493789,0.2860455, 1);
             /*correct for the prior from serology season (lognormal):"15-64" lm=-4.117028, ls=0.4751615*/
-            lprob += R::dlnorm(sub_pars[1], -4.117028,0.4751615, 1);
+            lprob += density::dlnorm(sub_pars[1], -4.117028,0.4751615, 1);
             /*correct for the prior from serology season (lognormal):"65+" lm=-2.977965, ls=1.331832*/
-            lprob += R::dlnorm(sub_pars[2], -2.977965,1.331832, 1);
+            lprob += density::dlnorm(sub_pars[2], -2.977965,1.331832, 1);
         }
 
         return lprob;
@@ -561,28 +1289,31 @@ mcmc_result_inference_t inference_multistrains(
             week_result.push_back(week);
         }
 
+        // Ascertainment probability by strain and age group
+        Eigen::MatrixXd eps( no_strains, 5 );
+        for (int st = 0; st < no_strains; ++st)
+            eps.row(st) << pars[st*8], pars[st*8],
+                pars[st*8+1], pars[st*8+1],
+                pars[st*8+2];
+
         auto lprob = 0.0;
+        std::vector<double> e_ps( no_strains );
         for (int w = 0; w < week_result[0].rows(); ++w) {
             for (int ag = 0; ag < week_result[0].cols(); ++ag) {
-                std::vector<double> e_ps;
                 double sum_e_ps = 0.0;
                 for (int st = 0; st < no_strains; ++st) {
-                    Eigen::VectorXd eps(5);
-                    eps << pars[st*8], pars[st*8],
-                        pars[st*8+1], pars[st*8+1],
-                        pars[st*8+2];
-                    e_ps.push_back(eps[ag]*week_result[st](w,ag)
-                            /pop_RCGP[ag]);
+                    e_ps[st] = eps(st,ag)*week_result[st](w,ag)
+                            /pop_RCGP[ag];
                     sum_e_ps += e_ps[st];
                 }
                 sum_e_ps *= 1+pars[no_strains*8];
                 if (sum_e_ps > 1)
                     lprob += -1e10;
                 else {
-                    lprob += R::dbinom(ili(w,ag), mon_pop(w,ag), sum_e_ps, 1);
+                    lprob += density::dbinom(ili(w,ag), mon_pop(w,ag), sum_e_ps, true);
                     for (int st = 0; st < no_strains; ++st)
                     {
-                        lprob += R::dbinom(positives[st](w,ag), n_samples(w,ag), e_ps[st]/sum_e_ps, 1);
+                        lprob += density::dbinom(positives[st](w,ag), n_samples(w,ag), e_ps[st]/sum_e_ps, true);
                     }
                 }
             }
@@ -590,123 +1321,160 @@ mcmc_result_inference_t inference_multistrains(
         return lprob;
     };
 
-    auto curr_lprior = lprior_function(curr_parameters);
+    // Each chain has its own state, proposal distribution and random 
+    // stream, but shares the data. A single chain draws from R's random 
+    // number generator, multiple chains use streams of the counter based 
+    // generator seeded from R
+    const auto base_rng = (chains > 1) ? 
+        rng::rng_t( rng::seed_from_r(), 0 ) : rng::rng_t();
+    if (base_rng.uses_r())
+        threads = 1;
 
-    auto curr_llikelihood = llikelihood_function( curr_parameters,
-            current_contact_regular );
+    auto run_chain = [&]( size_t chain ) {
+        mcmc_result_inference_t results;
+        results.batch = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, initial.size() );
+        results.llikelihoods = Eigen::VectorXd( nbatch );
+        results.contact_ids = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, polymod_data.rows() );
 
-    auto proposal_state = proposal::initialize( curr_parameters.size() );
+        int step_mat;
+        double my_acceptance_rate;
 
-    /**************************************************************************************************************************************************************
-    Start of the MCMC
-    **************************************************************************************************************************************************************/
+        auto curr_parameters = initial;
+        auto curr_c = initial_c;
+        auto current_contact_regular = initial_contact_regular;
+        contacts::contact_matrix_t curr_matrix( curr_c, age_data );
+        contacts::swap_journal_t prop_swaps;
 
-    step_mat=1;            /*number of contacts exchanged*/
-    double p_ac_mat=0.10;          /*prob to redraw matrices*/
+        auto curr_lprior = lprior_function(curr_parameters);
 
-    size_t sampleCount = 0;
-    int k = 0;
-    while(sampleCount<nbatch)
-    {
-        ++k;
-
-        /*update of the variance-covariance matrix and the mean vector*/
-        proposal_state = proposal::update( std::move( proposal_state ),
-                curr_parameters, k );
-
-        /*
-        auto prop_parameters = proposal::haario_adapt_scale(
-                curr_parameters,
-                proposal_state.chol_emp_cov,
-                proposal_state.chol_ini,0.05, 
-                proposal_state.adaptive_scaling );
-        */
-        /*
-        auto epsilon = 0.001;
-        if (k>10000)
-            epsilon = 0;
-        auto prop_parameters = proposal::haario( k,
-                curr_parameters,
-                proposal_state.chol_emp_cov, epsilon );*/
-
-        auto prop_parameters = proposal::sherlock( k,
-                curr_parameters,
-                proposal_state );
-
-        auto prop_lprior = lprior_function(prop_parameters);
-        auto prior_ratio = prop_lprior - curr_lprior;
-
-        if (!std::isfinite(prior_ratio))
+        auto curr_llikelihood = llikelihood_function( curr_parameters,
+                current_contact_regular );
+
+        auto proposal_state = proposal::initialize( curr_parameters.size() );
+
+        /**************************************************************************************************************************************************************
+        Start of the MCMC
+        **************************************************************************************************************************************************************/
+
+        step_mat=1;            /*number of contacts exchanged*/
+        double p_ac_mat=0.10;          /*prob to redraw matrices*/
+
+        // All random draws go through this chain's own stream
+        auto rng = base_rng.stream( chain );
+
+        size_t sampleCount = 0;
+        int k = 0;
+        while(sampleCount<nbatch)
         {
-            //Rcpp::Rcout << "Invalid proposed par" << std::endl;
-            // TODO: code duplication with failure of acceptance
-            proposal_state = proposal::accepted( 
-                    std::move(proposal_state), false, k );
-        } else {
-            auto prop_c = curr_c;
-
-            /*do swap of contacts step_mat times (reduce or increase to change 'distance' of new matrix from current)*/
-            // TODO/WARN Need to draw this before hand and pass it as data to
-            // likelihood function... Even when doing that we still need to know k,
-            // so might as well make the likelihood function increase k when called
-            if(R::runif(0,1) < p_ac_mat)
-                prop_c = contacts::bootstrap_contacts( std::move(prop_c),
-                        polymod, step_mat );
-
-            auto prop_contact_regular = 
-                contacts::to_symmetric_matrix( prop_c, age_data );
-
-            /*computes the associated likelihood with the proposed values*/
-            auto prop_llikelihood = llikelihood_function( prop_parameters,
-                   prop_contact_regular );
-
-
-            /*Acceptance rate include the likelihood and the prior but no correction for the proposal as we use a symmetrical RW*/
-            // Make sure accept works with -inf prior
-            // MCMC-R alternative prior?
-            if (std::isinf(prop_llikelihood) && std::isinf(curr_llikelihood) )
-                my_acceptance_rate = exp(prior_ratio); // We want to explore and find a non infinite likelihood
-            else 
-                my_acceptance_rate=
-                    exp(prop_llikelihood-curr_llikelihood+
-                    prior_ratio);
-
-            if(R::runif(0,1)<my_acceptance_rate &&
-                     std::isfinite(my_acceptance_rate)) /*with prior*/
+            ++k;
+
+            /*update of the variance-covariance matrix and the mean vector*/
+            proposal_state = proposal::update( std::move( proposal_state ),
+                    curr_parameters, k );
+
+            /*
+            auto prop_parameters = proposal::haario_adapt_scale(
+                    curr_parameters,
+                    proposal_state.chol_emp_cov,
+                    proposal_state.chol_ini,0.05, 
+                    proposal_state.adaptive_scaling );
+            */
+            /*
+            auto epsilon = 0.001;
+            if (k>10000)
+                epsilon = 0;
+            auto prop_parameters = proposal::haario( k,
+                    curr_parameters,
+                    proposal_state.chol_emp_cov, epsilon );*/
+
+            auto prop_parameters = proposal::sherlock( k,
+                    curr_parameters,
+                    proposal_state, rng );
+
+            auto prop_lprior = lprior_function(prop_parameters);
+            auto prior_ratio = prop_lprior - curr_lprior;
+
+            if (!std::isfinite(prior_ratio))
             {
-                /*update the acceptance rate*/
+                //Rcpp::Rcout << "Invalid proposed par" << std::endl;
+                // TODO: code duplication with failure of acceptance
                 proposal_state = proposal::accepted( 
-                        std::move(proposal_state), true, k );
+                        std::move(proposal_state), false, k );
+            } else {
+                /*do swap of contacts step_mat times (reduce or increase to change 'distance' of new matrix from current)*/
+                // TODO/WARN Need to draw this before hand and pass it as data to
+                // likelihood function... Even when doing that we still need to know k,
+                // so might as well make the likelihood function increase k when called
+                contacts::contact_matrix_t prop_matrix;
+                auto prop_contact_regular = current_contact_regular;
+                prop_swaps.rollback();
+                if(rng.uniform() < p_ac_mat)
+                {
+                    prop_swaps.propose( curr_c, polymod, step_mat, rng );
+                    prop_matrix = curr_matrix;
+                    prop_swaps.apply( prop_matrix, curr_c, polymod );
+                    prop_contact_regular = prop_matrix.symmetric_matrix();
+                }
 
-                curr_parameters = prop_parameters;
+                /*computes the associated likelihood with the proposed values*/
+                auto prop_llikelihood = llikelihood_function( prop_parameters,
+                       prop_contact_regular );
 
-                /*update current likelihood*/
-                curr_llikelihood=prop_llikelihood;
-                curr_lprior = prop_lprior;
 
-                /*new proposed contact matrix*/
-                /*update*/
-                curr_c = prop_c;
-                current_contact_regular=prop_contact_regular;
+                /*Acceptance rate include the likelihood and the prior but no correction for the proposal as we use a symmetrical RW*/
+                // Make sure accept works with -inf prior
+                // MCMC-R alternative prior?
+                if (std::isinf(prop_llikelihood) && std::isinf(curr_llikelihood) )
+                    my_acceptance_rate = exp(prior_ratio); // We want to explore and find a non infinite likelihood
+                else 
+                    my_acceptance_rate=
+                        exp(prop_llikelihood-curr_llikelihood+
+                        prior_ratio);
+
+                if(rng.uniform()<my_acceptance_rate &&
+                         std::isfinite(my_acceptance_rate)) /*with prior*/
+                {
+                    /*update the acceptance rate*/
+                    proposal_state = proposal::accepted( 
+                            std::move(proposal_state), true, k );
+
+                    curr_parameters = prop_parameters;
+
+                    /*update current likelihood*/
+                    curr_llikelihood=prop_llikelihood;
+                    curr_lprior = prop_lprior;
+
+                    /*new proposed contact matrix*/
+                    /*update*/
+                    if (!prop_swaps.empty())
+                    {
+                        prop_swaps.commit( curr_c, polymod );
+                        curr_matrix = std::move(prop_matrix);
+                    }
+                    current_contact_regular=prop_contact_regular;
+                }
+                else /*if reject*/
+                {
+                    proposal_state = proposal::accepted( 
+                            std::move(proposal_state), false, k );
+                }
             }
-            else /*if reject*/
+
+            if(k%blen==0 && k>=(int)nburn)
             {
-                proposal_state = proposal::accepted( 
-                        std::move(proposal_state), false, k );
+                // Add results
+                results.llikelihoods[sampleCount] = curr_llikelihood;
+                results.batch.row( sampleCount ) = curr_parameters;
+                for( size_t i = 0; i < curr_c.size(); ++i )
+                    results.contact_ids( sampleCount, i ) =
+                        curr_c.id[i];
+
+                ++sampleCount;
             }
         }
+        return results;
+    };
 
-        if(k%blen==0 && k>=(int)nburn)
-        {
-            // Add results
-            results.llikelihoods[sampleCount] = curr_llikelihood;
-            results.batch.row( sampleCount ) = curr_parameters;
-            for( size_t i = 0; i < curr_c.contacts.size(); ++i )
-                results.contact_ids( sampleCount, i ) =
-                    curr_c.contacts[i].id;
-
-            ++sampleCount;
-        }
-    }
-    return results;
+    return combine_chains( run_chains<mcmc_result_inference_t>( chains, 
+            threads, run_chain ) );
 }
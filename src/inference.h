@@ -1,6 +1,8 @@
 #ifndef INFERENCE_HH
 #define INFERENCE_HH
 
+#include<vector>
+
 #include "rcppwrap.h"
 
 namespace flu {
@@ -12,6 +14,85 @@ namespace flu {
         Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, 
             Eigen::RowMajor>
             contact_ids;
+
+        /// Average number of ode integration steps per model run
+        double ode_steps = 0;
+
+        /// Statistics of delayed acceptance (if used)
+        bool delayed_acceptance = false;
+        double stage1_rejection_rate = 0;
+        double speedup = 1;
+
+        /// Fraction of model runs stopped early (if early rejection is used)
+        bool early_rejection = false;
+        double early_rejection_rate = 0;
+
+        /// Fraction of the prefetched model runs that were used by the chain
+        bool prefetch = false;
+        double prefetch_usage = 0;
+
+        /// Chain of each sample (only when running multiple chains)
+        Eigen::VectorXi chain;
+
+        /// Final temperatures of the ladder and the fraction of accepted 
+        /// swaps between neighbouring temperatures (parallel tempering only)
+        Eigen::VectorXd temperatures;
+        Eigen::VectorXd swap_rates;
     };
+
+    /**
+     * \brief Combine the results of independent chains
+     *
+     * The samples are stacked in chain order, with the chain of each sample 
+     * stored in chain. The statistics are averaged over the chains.
+     */
+    inline mcmc_result_inference_t combine_chains( 
+            const std::vector<mcmc_result_inference_t> &chains )
+    {
+        if (chains.size() == 1)
+            return chains[0];
+
+        mcmc_result_inference_t combined;
+        size_t no_samples = 0;
+        for (auto &result : chains)
+            no_samples += result.llikelihoods.size();
+        combined.batch.resize( no_samples, chains[0].batch.cols() );
+        combined.llikelihoods.resize( no_samples );
+        combined.contact_ids.resize( no_samples, 
+                chains[0].contact_ids.cols() );
+        combined.chain.resize( no_samples );
+
+        combined.delayed_acceptance = chains[0].delayed_acceptance;
+        combined.early_rejection = chains[0].early_rejection;
+        combined.prefetch = chains[0].prefetch;
+        combined.speedup = 0;
+        combined.temperatures = Eigen::VectorXd::Zero( 
+                chains[0].temperatures.size() );
+        combined.swap_rates = Eigen::VectorXd::Zero( 
+                chains[0].swap_rates.size() );
+
+        size_t row = 0;
+        for (size_t i = 0; i < chains.size(); ++i)
+        {
+            auto &result = chains[i];
+            const size_t n = result.llikelihoods.size();
+            combined.batch.middleRows( row, n ) = result.batch;
+            combined.llikelihoods.segment( row, n ) = result.llikelihoods;
+            combined.contact_ids.middleRows( row, n ) = result.contact_ids;
+            combined.chain.segment( row, n ).setConstant( i + 1 );
+            row += n;
+
+            combined.ode_steps += result.ode_steps/chains.size();
+            combined.stage1_rejection_rate += 
+                result.stage1_rejection_rate/chains.size();
+            combined.speedup += result.speedup/chains.size();
+            combined.early_rejection_rate += 
+                result.early_rejection_rate/chains.size();
+            combined.prefetch_usage += result.prefetch_usage/chains.size();
+            combined.temperatures += result.temperatures/chains.size();
+            combined.swap_rates += result.swap_rates/chains.size();
+        }
+        return combined;
+    }
 }
 #endif
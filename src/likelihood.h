@@ -0,0 +1,170 @@
+#ifndef FLU_LIKELIHOOD_HH
+#define FLU_LIKELIHOOD_HH
+
+#include<algorithm>
+#include<cmath>
+#include<vector>
+
+#include<Eigen/Core>
+
+namespace flu {
+
+/**
+ * \brief Building blocks for fast evaluation of the log likelihood
+ *
+ * The log likelihood of each week and age group is a sum over a two
+ * dimensional recurrence, which needs the log of many small integers and
+ * accumulates the terms in log space.
+ */
+namespace likelihood {
+
+    /// How the terms of the likelihood recurrence are summed
+    enum summation_t
+    {
+        /// Pairwise log sums in long double (the reference)
+        LONG_DOUBLE,
+        /// Streaming log-sum-exp with compensated summation (double)
+        COMPENSATED
+    };
+
+    /**
+     * \brief Table of log(i) for the non negative integers up to a maximum
+     *
+     * Gives the same values as log(i). Values outside the table are computed
+     * directly.
+     */
+    class log_table_t
+    {
+        public:
+            log_table_t() {}
+
+            explicit log_table_t( size_t max ) : values( max + 1 )
+            {
+                for (size_t i = 0; i <= max; ++i)
+                    values[i] = log( (double)i );
+            }
+
+            double operator()( int i ) const
+            {
+                if (i >= 0 && (size_t)i < values.size())
+                    return values[i];
+                return log( (double)i );
+            }
+
+        private:
+            std::vector<double> values;
+    };
+
+    /**
+     * \brief Log table large enough for the likelihood of the given data
+     *
+     * The arguments of the log in the recurrence are bounded by the number
+     * of ILI cases, samples and the monitored population (plus the depth).
+     * Very large monitored populations fall back to computing the log.
+     */
+    inline log_table_t log_table_for_data( const Eigen::MatrixXi &ili,
+            const Eigen::MatrixXi &mon_pop, const Eigen::MatrixXi &n_samples,
+            int depth )
+    {
+        int max = 0;
+        if (ili.size() > 0)
+            max = std::max( max, ili.maxCoeff() );
+        if (mon_pop.size() > 0)
+            max = std::max( max, mon_pop.maxCoeff() );
+        if (n_samples.size() > 0)
+            max = std::max( max, n_samples.maxCoeff() );
+        return log_table_t( std::min( max + std::max( depth, 0 ) + 2,
+                    1 << 20 ) );
+    }
+
+    /**
+     * \brief Terms of the likelihood of one week and age group that only 
+     * depend on the data
+     */
+    struct cell_terms_t
+    {
+        int ili_cases = 0, ili_monitored = 0;
+        int confirmed_positive = 0, confirmed_samples = 0;
+
+        /// Sum of log(ili_cases - g) for confirmed_positive <= g < 
+        /// confirmed_samples
+        long double log_unconfirmed = 0;
+
+        /// log(confirmed_positive!)
+        long double log_factorial_positive = 0;
+
+        double log_monitored = 0;
+
+        /// Largest possible number of influenza cases among the ILI cases
+        int max_positive = 0;
+    };
+
+    template<typename LOG>
+    cell_terms_t cell_terms( const LOG &log_int,
+            int ili_cases, int ili_monitored,
+            int confirmed_positive, int confirmed_samples )
+    {
+        cell_terms_t terms;
+        terms.ili_cases = ili_cases;
+        terms.ili_monitored = ili_monitored;
+        terms.confirmed_positive = confirmed_positive;
+        terms.confirmed_samples = confirmed_samples;
+        for (int g = confirmed_positive; g < confirmed_samples; ++g)
+            terms.log_unconfirmed += log_int( ili_cases - g );
+        for (int g = 1; g <= confirmed_positive; ++g)
+            terms.log_factorial_positive += log_int( g );
+        terms.log_monitored = log_int( ili_monitored );
+        terms.max_positive = ili_cases - confirmed_samples + 
+            confirmed_positive;
+        return terms;
+    }
+
+    /**
+     * \brief Streaming log(sum(exp(x))) in double precision
+     *
+     * Keeps the running maximum and the sum of exp(x - maximum), using
+     * compensated (Kahan) summation. Each term needs a single exp, instead of
+     * the log and exp (in long double) of pairwise log sums.
+     */
+    class log_sum_exp_t
+    {
+        public:
+            explicit log_sum_exp_t( double log_value )
+                : max( log_value ), sum( 1 ) {}
+
+            void add( double log_value )
+            {
+                if (log_value > max)
+                {
+                    // Rescale to the new maximum
+                    const double scale = exp( max - log_value );
+                    sum *= scale;
+                    compensation *= scale;
+                    max = log_value;
+                    add_scaled( 1 );
+                } else {
+                    add_scaled( exp( log_value - max ) );
+                }
+            }
+
+            double value() const
+            {
+                return max + log( sum );
+            }
+
+        private:
+            void add_scaled( double term )
+            {
+                const double y = term - compensation;
+                const double t = sum + y;
+                compensation = (t - sum) - y;
+                sum = t;
+            }
+
+            double max;
+            double sum;
+            double compensation = 0;
+    };
+}
+}
+#endif
@@ -2,25 +2,167 @@
 #define FLU_MCMC_HH
 
 #include<chrono>
+#include<vector>
+#include<algorithm>
 
 #include "proposal.h"
 
 namespace flu {
 
+/**
+ * \brief Keeps track of the two stages of delayed acceptance MCMC
+ *
+ * With delayed acceptance a proposal is first screened with a cheap 
+ * surrogate of the likelihood. Only proposals that pass this first stage
+ * are evaluated with the full likelihood, after which a second stage 
+ * corrects for the difference between the two, so that the chain still
+ * samples from the exact posterior (Christen and Fox, 2005).
+ */
+struct delayed_acceptance_t
+{
+    //! Number of proposals screened with the surrogate
+    size_t no_proposals = 0;
+    //! Number of proposals rejected in the first stage
+    size_t no_stage1_rejected = 0;
+    //! Time spent evaluating the surrogate and full likelihood (seconds)
+    double surrogate_time = 0, full_time = 0;
+
+    /**
+     * \brief Log ratio of the surrogate likelihoods used in the first stage
+     *
+     * This is zero when either surrogate value is not finite, which 
+     * keeps the ratio antisymmetric, so the second stage stays exact.
+     */
+    static double log_ratio( double proposed, double current )
+    {
+        if (!std::isfinite(proposed) || !std::isfinite(current))
+            return 0;
+        return proposed - current;
+    }
+
+    double stage1_rejection_rate() const
+    {
+        if (no_proposals == 0)
+            return 0;
+        return ((double)no_stage1_rejected)/no_proposals;
+    }
+
+    /// Estimated speed up compared to evaluating every proposal in full
+    double speedup() const
+    {
+        auto no_full = no_proposals - no_stage1_rejected;
+        if (no_full == 0 || full_time + surrogate_time <= 0)
+            return 1;
+        return no_proposals*(full_time/no_full)/(full_time+surrogate_time);
+    }
+
+    /// Call func and add the time it took to the given total
+    template<typename Func>
+    static auto timed( double &total, const Func &func ) -> decltype(func())
+    {
+        auto start_time = std::chrono::steady_clock::now();
+        auto value = func();
+        total += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start_time ).count();
+        return value;
+    }
+};
+
+/**
+ * \brief Selection and acceptance of multiple-try Metropolis
+ *
+ * Several candidates are drawn around the current state and one is 
+ * selected with probability proportional to its weight (its posterior 
+ * density). The selected candidate is accepted based on a reference set 
+ * drawn around it, plus the current state (Liu, Liang and Wong 2000). With
+ * symmetric proposals the chain samples from the exact posterior.
+ */
+struct multiple_try_t
+{
+    /**
+     * \brief Target acceptance rate of the proposal scaling
+     *
+     * The optimal acceptance rate increases with the number of tries 
+     * (roughly following Bédard, Douc and Moulines 2012)
+     */
+    static double target_acceptance( size_t tries )
+    {
+        const std::vector<double> mtm_acceptance = 
+            { 0.234, 0.32, 0.36, 0.39 };
+        return (tries >= 1 && tries <= mtm_acceptance.size()) ?
+            mtm_acceptance[tries - 1] : 0.40;
+    }
+
+    static double log_sum_exp( const std::vector<double> &log_values )
+    {
+        const double max = *std::max_element( log_values.begin(), 
+                log_values.end() );
+        if (!std::isfinite( max ))
+            return max;
+        double sum = 0;
+        for (auto &value : log_values)
+            sum += exp( value - max );
+        return max + log( sum );
+    }
+
+    /// Select a candidate with probability proportional to its weight
+    static size_t select( const std::vector<double> &log_weights,
+            double log_total, rng::rng_t &rng )
+    {
+        size_t selected = 0;
+        const double u = rng.uniform();
+        double cumulative = 0;
+        for (size_t i = 0; i < log_weights.size(); ++i)
+        {
+            if (!std::isfinite( log_weights[i] ))
+                continue;
+            selected = i;
+            cumulative += exp( log_weights[i] - log_total );
+            if (u < cumulative)
+                break;
+        }
+        return selected;
+    }
+
+    /// Log of the acceptance probability of the selected candidate
+    static double log_acceptance( double log_total, 
+            const std::vector<double> &reference_weights )
+    {
+        return log_total - log_sum_exp( reference_weights );
+    }
+};
+
 struct mcmc_result_t
 {
     Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
         batch;
     Eigen::VectorXd llikelihoods;
+
+    /// Statistics of the delayed acceptance stages (if used)
+    delayed_acceptance_t delayed_acceptance;
 };
 
-template<typename Func1, typename Func2, typename Func3, typename Func4>
+/**
+ * \brief Adaptive MCMC with optional delayed acceptance or multiple tries
+ *
+ * When delayed_acceptance is true, proposals are first screened with
+ * surrogate_llikelihood, a cheap approximation of llikelihood. With more 
+ * than one try each step uses multiple-try Metropolis (multiple_try_t). All
+ * random draws of the sampler itself come from rng.
+ */
+template<typename Func1, typename Func2, typename Func3, typename Func4,
+    typename Func5>
 mcmc_result_t adaptiveMCMC( const Func1 &lprior, const Func2 &llikelihood, 
+        const Func5 &surrogate_llikelihood, bool delayed_acceptance,
         const Func3 &outfun, const Func4 &acceptfun,
         size_t nburn,
         const Eigen::VectorXd &initial, 
-        size_t nbatch, size_t blen = 1, bool verbose = false )
+        size_t nbatch, size_t blen = 1, bool verbose = false,
+        size_t tries = 1, rng::rng_t &rng = rng::default_rng() )
 {
+    if (tries > 1 && delayed_acceptance)
+        ::Rf_error("Multiple-try Metropolis can not be used with delayed acceptance");
+
     mcmc_result_t result;
     result.batch = Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>( nbatch, initial.size() );
     result.llikelihoods = Eigen::VectorXd( nbatch );
@@ -28,8 +170,39 @@ mcmc_result_t adaptiveMCMC( const Func1 &lprior, const Func2 &llikelihood,
     auto curr_parameters = initial;
     auto curr_lprior = lprior( curr_parameters );
     auto curr_llikelihood = llikelihood( curr_parameters );
+    auto curr_surrogate = 0.0;
+    if (delayed_acceptance)
+        curr_surrogate = surrogate_llikelihood( curr_parameters );
+    auto &da = result.delayed_acceptance;
     auto proposal_state = proposal::initialize( initial.size() );
+    if (tries > 1)
+        proposal::set_target_acceptance( proposal_state, 
+                multiple_try_t::target_acceptance( tries ) );
+
+    // Candidates of multiple-try Metropolis, drawn around the given state
+    struct candidate_t
+    {
+        Eigen::VectorXd parameters;
+        bool adaptive_step = false;
+        double lprior = log(0);
+        double llikelihood = log(0);
 
+        double log_weight() const { return lprior + llikelihood; }
+    };
+    auto draw_candidates = [&]( size_t no_candidates, int k, 
+            const Eigen::VectorXd &from ) {
+        std::vector<candidate_t> candidates( no_candidates );
+        for (auto &candidate : candidates)
+        {
+            candidate.parameters = proposal::sherlock( k, from, 
+                    proposal_state, rng );
+            candidate.adaptive_step = proposal_state.adaptive_step;
+            candidate.lprior = lprior( candidate.parameters );
+            if (!std::isinf( candidate.lprior ))
+                candidate.llikelihood = llikelihood( candidate.parameters );
+        }
+        return candidates;
+    };
 
     if (verbose) {
         Rcpp::Rcout << "Initial LPrior\t" << curr_lprior  << std::endl;
@@ -61,51 +234,118 @@ mcmc_result_t adaptiveMCMC( const Func1 &lprior, const Func2 &llikelihood,
                 curr_parameters,
                 proposal_state.chol_emp_cov, epsilon );
                 */
-        auto prop_parameters = proposal::sherlock( k,
-                curr_parameters,
-                proposal_state );
-        if (verbose) {
-            Rcpp::Rcout << "Proposed parameters\t" << prop_parameters.transpose() <<
-                std::endl;
-            Rcpp::Rcout << "Var\tvalue\ttime (ns)" << std::endl;
-        }
-        std::chrono::high_resolution_clock::time_point start_time; 
-
-        if (verbose)
-            start_time = std::chrono::high_resolution_clock::now();
-        auto prop_lprior = 
-            lprior(prop_parameters);
-        if (verbose)
-            Rcpp::Rcout << "LPrior\t" << prop_lprior << "\t" <<
-                std::chrono::duration_cast<std::chrono::nanoseconds>(
-                        std::chrono::high_resolution_clock::now() -
-                        start_time).count() << std::endl;
+        Eigen::VectorXd prop_parameters;
+        auto prop_lprior = log(0);
         auto prop_llikelihood = log(0);
-
+        auto prop_surrogate = 0.0;
         auto my_acceptance_rate = 0.0;
-        if (!std::isinf(prop_lprior)) 
+        std::chrono::high_resolution_clock::time_point start_time; 
+        if (tries > 1)
         {
+            // Multiple-try Metropolis replaces the single proposal
+            auto candidates = draw_candidates( tries, k, curr_parameters );
+            std::vector<double> log_weights;
+            for (auto &candidate : candidates)
+                log_weights.push_back( candidate.log_weight() );
+            const double log_total = 
+                multiple_try_t::log_sum_exp( log_weights );
+
+            size_t selected = 0;
+            if (std::isfinite( log_total ))
+            {
+                selected = multiple_try_t::select( log_weights, log_total, 
+                        rng );
+                // Reference set: drawn around the selected candidate, plus 
+                // the current state
+                auto references = draw_candidates( tries - 1, k, 
+                        candidates[selected].parameters );
+                std::vector<double> reference_weights( 1, 
+                        curr_lprior + curr_llikelihood );
+                for (auto &reference : references)
+                    reference_weights.push_back( reference.log_weight() );
+                my_acceptance_rate = exp( multiple_try_t::log_acceptance( 
+                            log_total, reference_weights ) );
+            } else if (std::isinf(curr_llikelihood)) {
+                // No candidate with a finite likelihood. As with a single
+                // proposal, use the prior to move towards finite likelihoods
+                my_acceptance_rate = exp( candidates[selected].lprior
+                        - curr_lprior );
+            } else
+                my_acceptance_rate = -1.0;
+
+            const auto &candidate = candidates[selected];
+            proposal_state.adaptive_step = candidate.adaptive_step;
+            prop_parameters = candidate.parameters;
+            prop_lprior = candidate.lprior;
+            prop_llikelihood = candidate.llikelihood;
+        } else {
+            prop_parameters = proposal::sherlock( k,
+                    curr_parameters,
+                    proposal_state, rng );
+            if (verbose) {
+                Rcpp::Rcout << "Proposed parameters\t" << prop_parameters.transpose() <<
+                    std::endl;
+                Rcpp::Rcout << "Var\tvalue\ttime (ns)" << std::endl;
+            }
+
             if (verbose)
                 start_time = std::chrono::high_resolution_clock::now();
-            prop_llikelihood = llikelihood( prop_parameters );
+            prop_lprior = 
+                lprior(prop_parameters);
             if (verbose)
-                Rcpp::Rcout << "Llikeli\t" << prop_llikelihood << "\t" <<
+                Rcpp::Rcout << "LPrior\t" << prop_lprior << "\t" <<
                     std::chrono::duration_cast<std::chrono::nanoseconds>(
                             std::chrono::high_resolution_clock::now() -
                             start_time).count() << std::endl;
 
-            if (std::isinf(prop_llikelihood) && std::isinf(curr_llikelihood) )
-                my_acceptance_rate = exp(prop_lprior-curr_lprior); // We want to explore and find a non infinite likelihood
-            else
-                my_acceptance_rate=
-                    exp(prop_llikelihood-curr_llikelihood+
-                            prop_lprior - curr_lprior);
-        } else {
-            if (std::isinf(curr_lprior))
-                ::Rf_error("Algorithm stuck on infinite prior");
-            my_acceptance_rate = -1.0;
+            auto stage1_log_ratio = 0.0;
+
+            if (!std::isinf(prop_lprior) && delayed_acceptance)
+            {
+                // First stage: screen the proposal with the surrogate
+                ++da.no_proposals;
+                prop_surrogate = da.timed( da.surrogate_time, [&]() {
+                        return surrogate_llikelihood( prop_parameters ); } );
+                stage1_log_ratio = da.log_ratio( prop_surrogate, curr_surrogate )
+                    + prop_lprior - curr_lprior;
+                if (rng.uniform() >= exp(stage1_log_ratio))
+                {
+                    ++da.no_stage1_rejected;
+                    my_acceptance_rate = -1.0;
+                }
+            }
+
+            if (!std::isinf(prop_lprior) && my_acceptance_rate >= 0) 
+            {
+                if (verbose)
+                    start_time = std::chrono::high_resolution_clock::now();
+                if (delayed_acceptance)
+                    prop_llikelihood = da.timed( da.full_time, [&]() {
+                            return llikelihood( prop_parameters ); } );
+                else
+                    prop_llikelihood = llikelihood( prop_parameters );
+                if (verbose)
+                    Rcpp::Rcout << "Llikeli\t" << prop_llikelihood << "\t" <<
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::high_resolution_clock::now() -
+                                start_time).count() << std::endl;
+
+                // With delayed acceptance the second stage corrects for the 
+                // ratio already used in the first stage (zero otherwise)
+                if (std::isinf(prop_llikelihood) && std::isinf(curr_llikelihood) )
+                    my_acceptance_rate = exp(prop_lprior-curr_lprior
+                            -stage1_log_ratio); // We want to explore and find a non infinite likelihood
+                else
+                    my_acceptance_rate=
+                        exp(prop_llikelihood-curr_llikelihood+
+                                prop_lprior - curr_lprior - stage1_log_ratio);
+            } else if (std::isinf(prop_lprior)) {
+                if (std::isinf(curr_lprior))
+                    ::Rf_error("Algorithm stuck on infinite prior");
+                my_acceptance_rate = -1.0;
+            }
         }
-        auto rnd = R::runif(0.0, 1.0);
+        auto rnd = rng.uniform();
         if (verbose)
             Rcpp::Rcout << "RND: " << rnd << " rate " << my_acceptance_rate << std::endl;
         if(rnd < my_acceptance_rate) //with prior
@@ -119,6 +359,7 @@ mcmc_result_t adaptiveMCMC( const Func1 &lprior, const Func2 &llikelihood,
             //update current likelihood
             curr_llikelihood=prop_llikelihood;
             curr_lprior=prop_lprior;
+            curr_surrogate=prop_surrogate;
             // Call the accept function
             if (verbose)
                 start_time = std::chrono::high_resolution_clock::now();
@@ -159,5 +400,17 @@ mcmc_result_t adaptiveMCMC( const Func1 &lprior, const Func2 &llikelihood,
     }
     return result;
 }
+
+template<typename Func1, typename Func2, typename Func3, typename Func4>
+mcmc_result_t adaptiveMCMC( const Func1 &lprior, const Func2 &llikelihood, 
+        const Func3 &outfun, const Func4 &acceptfun,
+        size_t nburn,
+        const Eigen::VectorXd &initial, 
+        size_t nbatch, size_t blen = 1, bool verbose = false )
+{
+    return adaptiveMCMC( lprior, llikelihood, 
+            []( const Eigen::VectorXd &pars ) { return 0.0; }, false,
+            outfun, acceptfun, nburn, initial, nbatch, blen, verbose );
+}
 }
 #endif
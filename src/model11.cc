@@ -1,6 +1,7 @@
 #include "model.h"
 
 #include "ode.h"
+#include "density.h"
 
 inline long double safe_sum_log(long double a, long double b) {
   // The general algorithm
@@ -53,157 +54,564 @@ namespace flu
         + st*nag + i;
     }
 
-    inline Eigen::VectorXd flu_ode( Eigen::VectorXd &deltas,
-            const Eigen::VectorXd &densities,
-            const Eigen::VectorXd &Npop,
-            const Eigen::MatrixXd &vaccine_rates, // If empty, rate of zero is assumed
-            const Eigen::VectorXd &vaccine_efficacy,
-            const Eigen::MatrixXd &transmission_regular,
-            double a1, double a2, double g1, double g2 )
+    /**
+     * \brief SEIR model specialised on the number of age groups
+     *
+     * When NAG is known at compile time all the vectors and matrices used
+     * during integration have a fixed size, so that no heap allocations are
+     * needed and loops over the age groups are of fixed length. With 
+     * NAG = Eigen::Dynamic the same code handles any number of age groups.
+     *
+     * The state always holds the three risk groups and their vaccinated 
+     * counterparts (see group_type_t), so the number of risk groups is not
+     * a template parameter. Callers pad missing risk groups with zeros.
+     */
+    template<int NAG>
+    class SEIRModel
     {
-        const size_t nag = transmission_regular.cols();
-        
-        for(size_t i=0;i<nag;i++)
-        {
-            /*rate of depletion of susceptible*/
-            deltas[ode_id(nag,VACC_LOW,S,i)]=0;
-            for(size_t j=0;j<nag;j++)
-                deltas[ode_id(nag,VACC_LOW,S,i)]+=transmission_regular(i,j)*(densities[ode_id(nag,VACC_LOW,I1,j)]+densities[ode_id(nag,VACC_LOW,I2,j)]+densities[ode_id(nag,VACC_HIGH,I1,j)]+densities[ode_id(nag,VACC_HIGH,I2,j)]+densities[ode_id(nag,VACC_PREG,I1,j)]+densities[ode_id(nag,VACC_PREG,I2,j)]+densities[ode_id(nag,LOW,I1,j)]+densities[ode_id(nag,LOW,I2,j)]+densities[ode_id(nag,HIGH,I1,j)]+densities[ode_id(nag,HIGH,I2,j)]+densities[ode_id(nag,PREG,I1,j)]+densities[ode_id(nag,PREG,I2,j)]);
-
-            deltas[ode_id(nag,VACC_HIGH,S,i)]=deltas[ode_id(nag,VACC_LOW,S,i)];
-            deltas[ode_id(nag,VACC_PREG,S,i)]=deltas[ode_id(nag,VACC_LOW,S,i)];
-            deltas[ode_id(nag,LOW,S,i)]=deltas[ode_id(nag,VACC_LOW,S,i)];
-            deltas[ode_id(nag,HIGH,S,i)]=deltas[ode_id(nag,VACC_LOW,S,i)];
-            deltas[ode_id(nag,PREG,S,i)]=deltas[ode_id(nag,VACC_LOW,S,i)];
-
-            deltas[ode_id(nag,VACC_LOW,S,i)]*=-densities[ode_id(nag,VACC_LOW,S,i)];
-            deltas[ode_id(nag,VACC_HIGH,S,i)]*=-densities[ode_id(nag,VACC_HIGH,S,i)];
-            deltas[ode_id(nag,VACC_PREG,S,i)]*=-densities[ode_id(nag,VACC_PREG,S,i)];
-            deltas[ode_id(nag,LOW,S,i)]*=-densities[ode_id(nag,LOW,S,i)];
-            deltas[ode_id(nag,HIGH,S,i)]*=-densities[ode_id(nag,HIGH,S,i)];
-            deltas[ode_id(nag,PREG,S,i)]*=-densities[ode_id(nag,PREG,S,i)];
-        }
+        public:
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+            static const int no_states = (NAG == Eigen::Dynamic) ? 
+                Eigen::Dynamic : NAG*6*6;
+            static const int no_groups = (NAG == Eigen::Dynamic) ? 
+                Eigen::Dynamic : NAG*3;
+
+            typedef Eigen::Matrix<double, NAG, 1> age_vector_t;
+            typedef Eigen::Matrix<double, no_groups, 1> group_vector_t;
+            typedef Eigen::Matrix<double, no_states, 1> state_t;
+            typedef Eigen::Matrix<double, NAG, NAG> transmission_t;
+
+            SEIRModel( const Eigen::VectorXd &Npop,
+                    const Eigen::VectorXd &vaccine_efficacy,
+                    const Eigen::MatrixXd &transmission_regular,
+                    double a1, double a2, double g1, double g2 )
+                : dynamic_nag( transmission_regular.cols() ),
+                Npop( Npop ), vaccine_efficacy( vaccine_efficacy ),
+                transmission_regular( transmission_regular ),
+                a1( a1 ), a2( a2 ), g1( g1 ), g2( g2 )
+            {
+                const size_t nag = no_age_groups();
+                deltas.resize( nag*group_types.size()*seir_types.size() );
+                vaccine_rates.resize( 3*nag );
+                results.resize( 3*nag );
+                e2_start.resize( 3*nag );
+                e2_end.resize( 3*nag );
+                de2_start.resize( 3*nag );
+                de2_end.resize( 3*nag );
+                infectious.resize( nag );
+                foi.resize( nag );
+            }
 
-        /*rate of passing between states of infection*/
-        for ( auto &gt : group_types)
-        {
-            deltas.segment(ode_id(nag,gt,E1),nag)=-deltas.segment(ode_id(nag,gt,S),nag)-a1*densities.segment(ode_id(nag,gt,E1),nag);
-            deltas.segment(ode_id(nag,gt,E2),nag)=a1*densities.segment(ode_id(nag,gt,E1),nag)-a2*densities.segment(ode_id(nag,gt,E2),nag);
+            inline size_t no_age_groups() const
+            {
+                return (NAG == Eigen::Dynamic) ? dynamic_nag : NAG;
+            }
 
-            deltas.segment(ode_id(nag,gt,I1),nag)=a2*densities.segment(ode_id(nag,gt,E2),nag)-g1*densities.segment(ode_id(nag,gt,I1),nag);
-            deltas.segment(ode_id(nag,gt,I2),nag)=g1*densities.segment(ode_id(nag,gt,I1),nag)-g2*densities.segment(ode_id(nag,gt,I2),nag);
-            deltas.segment(ode_id(nag,gt,R),nag)=g2*densities.segment(ode_id(nag,gt,I2),nag);
-        }
+            /// Vaccination rates to use from now on (empty for no vaccination)
+            template<typename Derived>
+            void set_vaccine_rates( const Eigen::MatrixBase<Derived> &rates )
+            {
+                vaccinate = rates.size() > 0;
+                if (vaccinate)
+                    vaccine_rates = rates;
+            }
 
-        /*Vaccine bit*/
+            void set_vaccine_rates()
+            {
+                vaccinate = false;
+            }
 
-        if ( vaccine_rates.size() > 0 )
-        {
-            for(size_t i=0;i<nag;i++)
+            inline const state_t &flu_ode( const state_t &densities )
             {
-                double vacc_prov = 0;
-                if (Npop[i]>0) // If zero then densities also zero -> 0/0
-                    vacc_prov=Npop[i]*vaccine_rates(i)/(densities[ode_id(nag,LOW,S,i)]+densities[ode_id(nag,LOW,E1,i)]+densities[ode_id(nag,LOW,E2,i)]+densities[ode_id(nag,LOW,I1,i)]+densities[ode_id(nag,LOW,I2,i)]+densities[ode_id(nag,LOW,R,i)]);
-                double vacc_prov_r = 0;
-                if (Npop[i+nag]>0)
-                    vacc_prov_r=Npop[i+nag]*vaccine_rates(i+nag)/(densities[ode_id(nag,HIGH,S,i)]+densities[ode_id(nag,HIGH,E1,i)]+densities[ode_id(nag,HIGH,E2,i)]+densities[ode_id(nag,HIGH,I1,i)]+densities[ode_id(nag,HIGH,I2,i)]+densities[ode_id(nag,HIGH,R,i)]);
-                double vacc_prov_p = 0;
-                if (Npop[i+2*nag]>0)
-                    vacc_prov_p=Npop[i+2*nag]*vaccine_rates(i+2*nag)/(densities[ode_id(nag,PREG,S,i)]+densities[ode_id(nag,PREG,E1,i)]+densities[ode_id(nag,PREG,E2,i)]+densities[ode_id(nag,PREG,I1,i)]+densities[ode_id(nag,PREG,I2,i)]+densities[ode_id(nag,PREG,R,i)]);
-
-                deltas[ode_id(nag,VACC_LOW,S,i)]+=densities[ode_id(nag,LOW,S,i)]*vacc_prov*(1-vaccine_efficacy[nag*LOW+i]);
-                deltas[ode_id(nag,VACC_HIGH,S,i)]+=densities[ode_id(nag,HIGH,S,i)]*vacc_prov_r*(1-vaccine_efficacy[nag*HIGH+i]);
-                deltas[ode_id(nag,VACC_PREG,S,i)]+=densities[ode_id(nag,PREG,S,i)]*vacc_prov_p*(1-vaccine_efficacy[nag*PREG+i]);
-                deltas[ode_id(nag,LOW,S,i)]-=densities[ode_id(nag,LOW,S,i)]*vacc_prov;
-                deltas[ode_id(nag,HIGH,S,i)]-=densities[ode_id(nag,HIGH,S,i)]*vacc_prov_r;
-                deltas[ode_id(nag,PREG,S,i)]-=densities[ode_id(nag,PREG,S,i)]*vacc_prov_p;
-
-                deltas[ode_id(nag,VACC_LOW,E1,i)]+=densities[ode_id(nag,LOW,E1,i)]*vacc_prov;
-                deltas[ode_id(nag,VACC_HIGH,E1,i)]+=densities[ode_id(nag,HIGH,E1,i)]*vacc_prov_r;
-                deltas[ode_id(nag,VACC_PREG,E1,i)]+=densities[ode_id(nag,PREG,E1,i)]*vacc_prov_p;
-                deltas[ode_id(nag,LOW,E1,i)]-=densities[ode_id(nag,LOW,E1,i)]*vacc_prov;
-                deltas[ode_id(nag,HIGH,E1,i)]-=densities[ode_id(nag,HIGH,E1,i)]*vacc_prov_r;
-                deltas[ode_id(nag,PREG,E1,i)]-=densities[ode_id(nag,PREG,E1,i)]*vacc_prov_p;
-
-                deltas[ode_id(nag,VACC_LOW,E2,i)]+=densities[ode_id(nag,LOW,E2,i)]*vacc_prov;
-                deltas[ode_id(nag,VACC_HIGH,E2,i)]+=densities[ode_id(nag,HIGH,E2,i)]*vacc_prov_r;
-                deltas[ode_id(nag,VACC_PREG,E2,i)]+=densities[ode_id(nag,PREG,E2,i)]*vacc_prov_p;
-                deltas[ode_id(nag,LOW,E2,i)]-=densities[ode_id(nag,LOW,E2,i)]*vacc_prov;
-                deltas[ode_id(nag,HIGH,E2,i)]-=densities[ode_id(nag,HIGH,E2,i)]*vacc_prov_r;
-                deltas[ode_id(nag,PREG,E2,i)]-=densities[ode_id(nag,PREG,E2,i)]*vacc_prov_p;
-
-                deltas[ode_id(nag,VACC_LOW,I1,i)]+=densities[ode_id(nag,LOW,I1,i)]*vacc_prov;
-                deltas[ode_id(nag,VACC_HIGH,I1,i)]+=densities[ode_id(nag,HIGH,I1,i)]*vacc_prov_r;
-                deltas[ode_id(nag,VACC_PREG,I1,i)]+=densities[ode_id(nag,PREG,I1,i)]*vacc_prov_p;
-                deltas[ode_id(nag,LOW,I1,i)]-=densities[ode_id(nag,LOW,I1,i)]*vacc_prov;
-                deltas[ode_id(nag,HIGH,I1,i)]-=densities[ode_id(nag,HIGH,I1,i)]*vacc_prov_r;
-                deltas[ode_id(nag,PREG,I1,i)]-=densities[ode_id(nag,PREG,I1,i)]*vacc_prov_p;
-
-                deltas[ode_id(nag,VACC_LOW,I2,i)]+=densities[ode_id(nag,LOW,I2,i)]*vacc_prov;
-                deltas[ode_id(nag,VACC_HIGH,I2,i)]+=densities[ode_id(nag,HIGH,I2,i)]*vacc_prov_r;
-                deltas[ode_id(nag,VACC_PREG,I2,i)]+=densities[ode_id(nag,PREG,I2,i)]*vacc_prov_p;
-                deltas[ode_id(nag,LOW,I2,i)]-=densities[ode_id(nag,LOW,I2,i)]*vacc_prov;
-                deltas[ode_id(nag,HIGH,I2,i)]-=densities[ode_id(nag,HIGH,I2,i)]*vacc_prov_r;
-                deltas[ode_id(nag,PREG,I2,i)]-=densities[ode_id(nag,PREG,I2,i)]*vacc_prov_p;
-
-                deltas[ode_id(nag,VACC_LOW,R,i)]+=densities[ode_id(nag,LOW,R,i)]*vacc_prov+densities[ode_id(nag,LOW,S,i)]*vacc_prov*vaccine_efficacy[nag*LOW+i];
-                deltas[ode_id(nag,VACC_HIGH,R,i)]+=densities[ode_id(nag,HIGH,R,i)]*vacc_prov_r+densities[ode_id(nag,HIGH,S,i)]*vacc_prov_r*vaccine_efficacy[nag*HIGH+i];
-                deltas[ode_id(nag,VACC_PREG,R,i)]+=densities[ode_id(nag,PREG,R,i)]*vacc_prov_p+densities[ode_id(nag,PREG,S,i)]*vacc_prov_p*vaccine_efficacy[nag*HIGH+i];
-                deltas[ode_id(nag,LOW,R,i)]-=densities[ode_id(nag,LOW,R,i)]*vacc_prov;
-                deltas[ode_id(nag,HIGH,R,i)]-=densities[ode_id(nag,HIGH,R,i)]*vacc_prov_r;
-                deltas[ode_id(nag,PREG,R,i)]-=densities[ode_id(nag,PREG,R,i)]*vacc_prov_p;
+                const size_t nag = no_age_groups();
+
+                /*total number of infectious in each age group*/
+                infectious.setZero();
+                for ( auto &gt : group_types)
+                    infectious += segment(densities,gt,I1)
+                        + segment(densities,gt,I2);
+
+                /*force of infection*/
+                foi.noalias() = transmission_regular*infectious;
+
+                /*rate of depletion of susceptible*/
+                for ( auto &gt : group_types)
+                    segment(deltas,gt,S) = 
+                        -foi.cwiseProduct(segment(densities,gt,S));
+
+                /*rate of passing between states of infection*/
+                for ( auto &gt : group_types)
+                {
+                    segment(deltas,gt,E1)=-segment(deltas,gt,S)-a1*segment(densities,gt,E1);
+                    segment(deltas,gt,E2)=a1*segment(densities,gt,E1)-a2*segment(densities,gt,E2);
+
+                    segment(deltas,gt,I1)=a2*segment(densities,gt,E2)-g1*segment(densities,gt,I1);
+                    segment(deltas,gt,I2)=g1*segment(densities,gt,I1)-g2*segment(densities,gt,I2);
+                    segment(deltas,gt,R)=g2*segment(densities,gt,I2);
+                }
+
+                /*Vaccine bit*/
+
+                if ( vaccinate )
+                {
+                    for(size_t i=0;i<nag;i++)
+                    {
+                        double vacc_prov = 0;
+                        if (Npop[i]>0) // If zero then densities also zero -> 0/0
+                            vacc_prov=Npop[i]*vaccine_rates(i)/(densities[ode_id(nag,LOW,S,i)]+densities[ode_id(nag,LOW,E1,i)]+densities[ode_id(nag,LOW,E2,i)]+densities[ode_id(nag,LOW,I1,i)]+densities[ode_id(nag,LOW,I2,i)]+densities[ode_id(nag,LOW,R,i)]);
+                        double vacc_prov_r = 0;
+                        if (Npop[i+nag]>0)
+                            vacc_prov_r=Npop[i+nag]*vaccine_rates(i+nag)/(densities[ode_id(nag,HIGH,S,i)]+densities[ode_id(nag,HIGH,E1,i)]+densities[ode_id(nag,HIGH,E2,i)]+densities[ode_id(nag,HIGH,I1,i)]+densities[ode_id(nag,HIGH,I2,i)]+densities[ode_id(nag,HIGH,R,i)]);
+                        double vacc_prov_p = 0;
+                        if (Npop[i+2*nag]>0)
+                            vacc_prov_p=Npop[i+2*nag]*vaccine_rates(i+2*nag)/(densities[ode_id(nag,PREG,S,i)]+densities[ode_id(nag,PREG,E1,i)]+densities[ode_id(nag,PREG,E2,i)]+densities[ode_id(nag,PREG,I1,i)]+densities[ode_id(nag,PREG,I2,i)]+densities[ode_id(nag,PREG,R,i)]);
+
+                        deltas[ode_id(nag,VACC_LOW,S,i)]+=densities[ode_id(nag,LOW,S,i)]*vacc_prov*(1-vaccine_efficacy[nag*LOW+i]);
+                        deltas[ode_id(nag,VACC_HIGH,S,i)]+=densities[ode_id(nag,HIGH,S,i)]*vacc_prov_r*(1-vaccine_efficacy[nag*HIGH+i]);
+                        deltas[ode_id(nag,VACC_PREG,S,i)]+=densities[ode_id(nag,PREG,S,i)]*vacc_prov_p*(1-vaccine_efficacy[nag*PREG+i]);
+                        deltas[ode_id(nag,LOW,S,i)]-=densities[ode_id(nag,LOW,S,i)]*vacc_prov;
+                        deltas[ode_id(nag,HIGH,S,i)]-=densities[ode_id(nag,HIGH,S,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,PREG,S,i)]-=densities[ode_id(nag,PREG,S,i)]*vacc_prov_p;
+
+                        deltas[ode_id(nag,VACC_LOW,E1,i)]+=densities[ode_id(nag,LOW,E1,i)]*vacc_prov;
+                        deltas[ode_id(nag,VACC_HIGH,E1,i)]+=densities[ode_id(nag,HIGH,E1,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,VACC_PREG,E1,i)]+=densities[ode_id(nag,PREG,E1,i)]*vacc_prov_p;
+                        deltas[ode_id(nag,LOW,E1,i)]-=densities[ode_id(nag,LOW,E1,i)]*vacc_prov;
+                        deltas[ode_id(nag,HIGH,E1,i)]-=densities[ode_id(nag,HIGH,E1,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,PREG,E1,i)]-=densities[ode_id(nag,PREG,E1,i)]*vacc_prov_p;
+
+                        deltas[ode_id(nag,VACC_LOW,E2,i)]+=densities[ode_id(nag,LOW,E2,i)]*vacc_prov;
+                        deltas[ode_id(nag,VACC_HIGH,E2,i)]+=densities[ode_id(nag,HIGH,E2,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,VACC_PREG,E2,i)]+=densities[ode_id(nag,PREG,E2,i)]*vacc_prov_p;
+                        deltas[ode_id(nag,LOW,E2,i)]-=densities[ode_id(nag,LOW,E2,i)]*vacc_prov;
+                        deltas[ode_id(nag,HIGH,E2,i)]-=densities[ode_id(nag,HIGH,E2,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,PREG,E2,i)]-=densities[ode_id(nag,PREG,E2,i)]*vacc_prov_p;
+
+                        deltas[ode_id(nag,VACC_LOW,I1,i)]+=densities[ode_id(nag,LOW,I1,i)]*vacc_prov;
+                        deltas[ode_id(nag,VACC_HIGH,I1,i)]+=densities[ode_id(nag,HIGH,I1,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,VACC_PREG,I1,i)]+=densities[ode_id(nag,PREG,I1,i)]*vacc_prov_p;
+                        deltas[ode_id(nag,LOW,I1,i)]-=densities[ode_id(nag,LOW,I1,i)]*vacc_prov;
+                        deltas[ode_id(nag,HIGH,I1,i)]-=densities[ode_id(nag,HIGH,I1,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,PREG,I1,i)]-=densities[ode_id(nag,PREG,I1,i)]*vacc_prov_p;
+
+                        deltas[ode_id(nag,VACC_LOW,I2,i)]+=densities[ode_id(nag,LOW,I2,i)]*vacc_prov;
+                        deltas[ode_id(nag,VACC_HIGH,I2,i)]+=densities[ode_id(nag,HIGH,I2,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,VACC_PREG,I2,i)]+=densities[ode_id(nag,PREG,I2,i)]*vacc_prov_p;
+                        deltas[ode_id(nag,LOW,I2,i)]-=densities[ode_id(nag,LOW,I2,i)]*vacc_prov;
+                        deltas[ode_id(nag,HIGH,I2,i)]-=densities[ode_id(nag,HIGH,I2,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,PREG,I2,i)]-=densities[ode_id(nag,PREG,I2,i)]*vacc_prov_p;
+
+                        deltas[ode_id(nag,VACC_LOW,R,i)]+=densities[ode_id(nag,LOW,R,i)]*vacc_prov+densities[ode_id(nag,LOW,S,i)]*vacc_prov*vaccine_efficacy[nag*LOW+i];
+                        deltas[ode_id(nag,VACC_HIGH,R,i)]+=densities[ode_id(nag,HIGH,R,i)]*vacc_prov_r+densities[ode_id(nag,HIGH,S,i)]*vacc_prov_r*vaccine_efficacy[nag*HIGH+i];
+                        deltas[ode_id(nag,VACC_PREG,R,i)]+=densities[ode_id(nag,PREG,R,i)]*vacc_prov_p+densities[ode_id(nag,PREG,S,i)]*vacc_prov_p*vaccine_efficacy[nag*HIGH+i];
+                        deltas[ode_id(nag,LOW,R,i)]-=densities[ode_id(nag,LOW,R,i)]*vacc_prov;
+                        deltas[ode_id(nag,HIGH,R,i)]-=densities[ode_id(nag,HIGH,R,i)]*vacc_prov_r;
+                        deltas[ode_id(nag,PREG,R,i)]-=densities[ode_id(nag,PREG,R,i)]*vacc_prov_p;
+                    }
+                }
+                return deltas;
+            }
+
+            /**
+             * \brief Integrate the model for duration days and return the number of new cases in each age and risk group
+             *
+             * The integration method, step size and any scratch buffers are
+             * taken from the passed work space. The fixed step Euler method
+             * counts new cases at the end of each step. The adaptive methods
+             * take large steps, so they integrate the new cases with cubic
+             * Hermite quadrature, using the derivative at both ends of each
+             * step. Their totals are clamped at zero, because the densities
+             * can dip slightly below zero within the tolerance. This biases
+             * the number of cases (slightly) upward.
+             */
+            template<typename WORKSPACE>
+            const group_vector_t &new_cases( state_t &densities,
+                    const double duration, WORKSPACE &workspace )
+            {
+                results.setZero();
+
+                auto t = 0.0;
+                const auto time_left = duration;
+
+                auto ode_func = [this]( const state_t &y, const double dummy ) 
+                    -> const state_t &
+                {
+                    return flu_ode( y );
+                };
+
+                if (workspace.method == ode::EULER)
+                {
+                    const size_t nag = no_age_groups();
+                    while (t < time_left)
+                    {
+                        auto prev_t = t;
+                        densities = ode::step( std::move(densities), ode_func,
+                                workspace.step_size, t, time_left );
+                        ++workspace.no_steps;
+
+                        results.template segment<NAG>( 0, nag ) += a2*(segment(densities,VACC_LOW,E2)+segment(densities,LOW,E2))*(t-prev_t);
+                        results.template segment<NAG>( nag, nag ) += a2*(segment(densities,VACC_HIGH,E2)+segment(densities,HIGH,E2))*(t-prev_t);
+                        results.template segment<NAG>( 2*nag, nag ) += a2*(segment(densities,VACC_PREG,E2)+segment(densities,PREG,E2))*(t-prev_t);
+                    }
+                    return results;
+                }
+
+                // The vaccination rates can change between calls, so 
+                // the derivative stored for FSAL is recomputed
+                infected_E2( densities, e2_start );
+                const auto &derivative = flu_ode( densities );
+                infected_E2( derivative, de2_start );
+                workspace.fsal = false;
+                if (workspace.method == ode::DOPRI5)
+                {
+                    workspace.resize( densities.size() );
+                    workspace.k1 = derivative;
+                    workspace.fsal = true;
+                }
+                while (t < time_left)
+                {
+                    auto prev_t = t;
+                    if (workspace.method == ode::DOPRI5)
+                        densities = ode::dopri5_astep( std::move(densities), 
+                                ode_func, workspace, t, time_left, 
+                                workspace.tolerance );
+                    else
+                        densities = ode::rkf45_astep( std::move(densities), 
+                                ode_func, workspace, t, time_left, 
+                                workspace.tolerance );
+
+                    // Cubic Hermite quadrature of the new cases
+                    const auto dt = t - prev_t;
+                    infected_E2( densities, e2_end );
+                    // DOPRI5 leaves the derivative at the end of the step 
+                    // in k1 (first same as last)
+                    if (workspace.fsal)
+                        infected_E2( workspace.k1, de2_end );
+                    else
+                        infected_E2( flu_ode( densities ), de2_end );
+                    results += a2*dt*(0.5*(e2_start+e2_end)
+                            + dt/12.0*(de2_start-de2_end));
+                    e2_start.swap( e2_end );
+                    de2_start.swap( de2_end );
+                }
+                // The densities can dip slightly below zero within the
+                // tolerance, which should not give negative cases
+                results = results.cwiseMax( 0.0 );
+                return results;
+            }
+
+        private:
+            /// Population in the second exposed class (vaccinated and unvaccinated) of each age and risk group
+            void infected_E2( const state_t &densities, 
+                    group_vector_t &e2 ) const
+            {
+                const size_t nag = no_age_groups();
+                e2.template segment<NAG>( 0, nag ) = segment(densities,VACC_LOW,E2)+segment(densities,LOW,E2);
+                e2.template segment<NAG>( nag, nag ) = segment(densities,VACC_HIGH,E2)+segment(densities,HIGH,E2);
+                e2.template segment<NAG>( 2*nag, nag ) = segment(densities,VACC_PREG,E2)+segment(densities,PREG,E2);
             }
-        }
-        return deltas;
-    }
 
-    inline Eigen::VectorXd new_cases( 
-            Eigen::VectorXd &densities,
-            const boost::posix_time::ptime &start_time,
-            const boost::posix_time::ptime &end_time, 
-            boost::posix_time::time_duration &dt,
-            const Eigen::VectorXd &Npop,
-            const Eigen::MatrixXd &vaccine_rates, // If empty, rate of zero is assumed
-            const Eigen::VectorXd &vaccine_efficacy,
-            const Eigen::MatrixXd &transmission_regular,
-            double a1, double a2, double g1, double g2
-            )
+            /// Segment of state vector holding all age groups of the given group and state type
+            template<typename V>
+            inline Eigen::VectorBlock<V, NAG> segment( V &v, 
+                    const group_type_t gt, const seir_type_t st ) const
+            {
+                return v.template segment<NAG>( 
+                        ode_id( no_age_groups(), gt, st ), no_age_groups() );
+            }
+
+            const size_t dynamic_nag;
+
+            group_vector_t Npop;
+            group_vector_t vaccine_efficacy;
+            transmission_t transmission_regular;
+            double a1, a2, g1, g2;
+
+            bool vaccinate = false;
+            group_vector_t vaccine_rates;
+
+            // Work space, reused between calls
+            state_t deltas;
+            group_vector_t results, e2_start, e2_end, de2_start, de2_end;
+            age_vector_t infectious, foi;
+    };
+
+    /**
+     * \brief SEIR model that integrates multiple parameter sets at once
+     *
+     * Each parameter set (lane) has its own transmission matrix and 
+     * initial state, while the population, vaccination calendar and 
+     * infection delays are shared. The state is stored structure of arrays:
+     * a flat vector holding for each state the values of all lanes 
+     * consecutively (state major, lane minor). All arithmetic in flu_ode is 
+     * therefore done on rows of lanes, which the compiler can vectorise.
+     *
+     * The flat state vector can be passed directly to the solvers in ode.h.
+     * The adaptive solvers use one step size for all lanes.
+     */
+    class SEIRBatchModel
     {
-        namespace bt = boost::posix_time;
+        public:
+            typedef Eigen::VectorXd state_t;
+            typedef Eigen::Array<double, Eigen::Dynamic, Eigen::Dynamic, 
+                    Eigen::RowMajor> lanes_t;
+            typedef Eigen::Array<double, 1, Eigen::Dynamic> lane_row_t;
+
+            /**
+             * \brief Construct the model
+             *
+             * @transmission_regular Transmission matrix for each lane 
+             */
+            SEIRBatchModel( const Eigen::VectorXd &Npop,
+                    const Eigen::VectorXd &vaccine_efficacy,
+                    const std::vector<Eigen::MatrixXd> &transmission_regular,
+                    double a1, double a2, double g1, double g2 )
+                : nag( transmission_regular[0].cols() ),
+                no_lanes( transmission_regular.size() ),
+                Npop( Npop ), vaccine_efficacy( vaccine_efficacy ),
+                a1( a1 ), a2( a2 ), g1( g1 ), g2( g2 )
+            {
+                transmission = lanes_t( nag*nag, no_lanes );
+                for (size_t l = 0; l < no_lanes; ++l)
+                    for (size_t i = 0; i < nag; ++i)
+                        for (size_t j = 0; j < nag; ++j)
+                            transmission( i*nag+j, l ) = 
+                                transmission_regular[l](i,j);
+
+                deltas.resize( no_states()*no_lanes );
+                results = lanes_t::Zero( 3*nag, no_lanes );
+                e2_start = results;
+                e2_end = results;
+                de2_start = results;
+                de2_end = results;
+                infectious.resize( nag, no_lanes );
+                foi.resize( nag, no_lanes );
+                vacc_prov.resize( no_lanes );
+            }
 
-        double h_step = dt.hours()/24.0;
+            inline size_t no_age_groups() const
+            {
+                return nag;
+            }
 
-        const size_t nag = transmission_regular.cols();
-        Eigen::VectorXd results = Eigen::VectorXd::Zero(nag*3);
+            inline size_t no_states() const
+            {
+                return nag*group_types.size()*seir_types.size();
+            }
 
-        Eigen::VectorXd deltas( nag*group_types.size()*
-                seir_types.size() );
+            /// Vaccination rates to use from now on (empty for no vaccination)
+            template<typename Derived>
+            void set_vaccine_rates( const Eigen::MatrixBase<Derived> &rates )
+            {
+                vaccinate = rates.size() > 0;
+                if (vaccinate)
+                    vaccine_rates = rates;
+            }
 
-        auto t = 0.0;
-        auto time_left = (end_time-start_time).hours()/24.0;
+            void set_vaccine_rates()
+            {
+                vaccinate = false;
+            }
 
-        auto ode_func = [&]( const Eigen::VectorXd &y, const double dummy )
-        {
-            return flu_ode( deltas, y, 
-                    Npop, vaccine_rates, vaccine_efficacy,
-                    transmission_regular, a1, a2, g1, g2 );
-        };
+            const state_t &flu_ode( const state_t &densities )
+            {
+                auto y = as_lanes( densities );
+                auto d = as_lanes( deltas );
 
-        while (t < time_left)
-        {
-            auto prev_t = t;
-            /*densities = ode::rkf45_astep( std::move(densities), ode_func,
-                        h_step, t, time_left, 5 );*/
-            densities = ode::step( std::move(densities), ode_func,
-                        h_step, t, time_left );
-            //Rcpp::Rcout << h_step << " " << t << " " << time_left << std::endl;
-
-            results.block( 0, 0, nag, 1 ) += a2*(densities.segment(ode_id(nag,VACC_LOW,E2),nag)+densities.segment(ode_id(nag,LOW,E2),nag))*(t-prev_t);
-            results.block( nag, 0, nag, 1 ) += a2*(densities.segment(ode_id(nag,VACC_HIGH,E2),nag)+densities.segment(ode_id(nag,HIGH,E2),nag))*(t-prev_t);
-            results.block( 2*nag, 0, nag, 1 ) += a2*(densities.segment(ode_id(nag,VACC_PREG,E2),nag)+densities.segment(ode_id(nag,PREG,E2),nag))*(t-prev_t);
-        }
-        return results;
-    }
+                /*total number of infectious in each age group*/
+                infectious.setZero();
+                for ( auto &gt : group_types)
+                    infectious += block(y,gt,I1) + block(y,gt,I2);
+
+                /*force of infection*/
+                for (size_t i = 0; i < nag; ++i)
+                {
+                    foi.row(i) = transmission.row(i*nag)*infectious.row(0);
+                    for (size_t j = 1; j < nag; ++j)
+                        foi.row(i) += transmission.row(i*nag+j)*
+                            infectious.row(j);
+                }
+
+                /*rate of depletion of susceptible*/
+                for ( auto &gt : group_types)
+                    block(d,gt,S) = -foi*block(y,gt,S);
+
+                /*rate of passing between states of infection*/
+                for ( auto &gt : group_types)
+                {
+                    block(d,gt,E1)=-block(d,gt,S)-a1*block(y,gt,E1);
+                    block(d,gt,E2)=a1*block(y,gt,E1)-a2*block(y,gt,E2);
+
+                    block(d,gt,I1)=a2*block(y,gt,E2)-g1*block(y,gt,I1);
+                    block(d,gt,I2)=g1*block(y,gt,I1)-g2*block(y,gt,I2);
+                    block(d,gt,R)=g2*block(y,gt,I2);
+                }
+
+                /*Vaccine bit*/
+                if ( vaccinate )
+                {
+                    const std::array<group_type_t, 3> risk_groups = 
+                        { LOW, HIGH, PREG };
+                    for (auto &gt : risk_groups)
+                    {
+                        auto vgt = (group_type_t)(gt + VACC_LOW);
+                        // Same as SEIRModel: pregnant women use the 
+                        // efficacy of the high risk group for R
+                        auto eff_r = (gt == PREG) ? HIGH : gt;
+                        for(size_t i=0;i<nag;i++)
+                        {
+                            if (Npop[i+gt*nag] <= 0) // Densities also zero
+                                continue;
+                            vacc_prov = y.row(ode_id(nag,gt,S,i));
+                            for (size_t st = E1; st <= R; ++st)
+                                vacc_prov += y.row(ode_id(nag,gt,(seir_type_t)st,i));
+                            vacc_prov = Npop[i+gt*nag]*vaccine_rates(i+gt*nag)/vacc_prov;
+
+                            d.row(ode_id(nag,vgt,S,i))+=y.row(ode_id(nag,gt,S,i))*vacc_prov*(1-vaccine_efficacy[nag*gt+i]);
+                            d.row(ode_id(nag,gt,S,i))-=y.row(ode_id(nag,gt,S,i))*vacc_prov;
+                            for (size_t st = E1; st < R; ++st)
+                            {
+                                auto id = ode_id(nag,gt,(seir_type_t)st,i);
+                                d.row(ode_id(nag,vgt,(seir_type_t)st,i))+=y.row(id)*vacc_prov;
+                                d.row(id)-=y.row(id)*vacc_prov;
+                            }
+                            d.row(ode_id(nag,vgt,R,i))+=y.row(ode_id(nag,gt,R,i))*vacc_prov+y.row(ode_id(nag,gt,S,i))*vacc_prov*vaccine_efficacy[nag*eff_r+i];
+                            d.row(ode_id(nag,gt,R,i))-=y.row(ode_id(nag,gt,R,i))*vacc_prov;
+                        }
+                    }
+                }
+                return deltas;
+            }
+
+            /**
+             * \brief Integrate all lanes for duration days and return the number of new cases in each age and risk group (rows) and lane (columns)
+             *
+             * Cases are counted in the same way as in SEIRModel::new_cases
+             */
+            template<typename WORKSPACE>
+            const lanes_t &new_cases( state_t &densities,
+                    const double duration, WORKSPACE &workspace )
+            {
+                results.setZero();
+
+                auto t = 0.0;
+                const auto time_left = duration;
+
+                auto ode_func = [this]( const state_t &y, const double dummy ) 
+                    -> const state_t &
+                {
+                    return flu_ode( y );
+                };
+
+                if (workspace.method == ode::EULER)
+                {
+                    while (t < time_left)
+                    {
+                        auto prev_t = t;
+                        densities = ode::step( std::move(densities), ode_func,
+                                workspace.step_size, t, time_left );
+                        ++workspace.no_steps;
+
+                        infected_E2( densities, e2_end );
+                        results += a2*e2_end*(t-prev_t);
+                    }
+                    return results;
+                }
+
+                // The vaccination rates can change between calls, so 
+                // the derivative stored for FSAL is recomputed
+                infected_E2( densities, e2_start );
+                const auto &derivative = flu_ode( densities );
+                infected_E2( derivative, de2_start );
+                workspace.fsal = false;
+                if (workspace.method == ode::DOPRI5)
+                {
+                    workspace.resize( densities.size() );
+                    workspace.k1 = derivative;
+                    workspace.fsal = true;
+                }
+                while (t < time_left)
+                {
+                    auto prev_t = t;
+                    if (workspace.method == ode::DOPRI5)
+                        densities = ode::dopri5_astep( std::move(densities), 
+                                ode_func, workspace, t, time_left, 
+                                workspace.tolerance );
+                    else
+                        densities = ode::rkf45_astep( std::move(densities), 
+                                ode_func, workspace, t, time_left, 
+                                workspace.tolerance );
+
+                    // Cubic Hermite quadrature of the new cases
+                    const auto dt = t - prev_t;
+                    infected_E2( densities, e2_end );
+                    // DOPRI5 leaves the derivative at the end of the step 
+                    // in k1 (first same as last)
+                    if (workspace.fsal)
+                        infected_E2( workspace.k1, de2_end );
+                    else
+                        infected_E2( flu_ode( densities ), de2_end );
+                    results += a2*dt*(0.5*(e2_start+e2_end)
+                            + dt/12.0*(de2_start-de2_end));
+                    e2_start.swap( e2_end );
+                    de2_start.swap( de2_end );
+                }
+                // The densities can dip slightly below zero within the
+                // tolerance, which should not give negative cases
+                results = results.cwiseMax( 0.0 );
+                return results;
+            }
+
+        private:
+            typedef Eigen::Map<lanes_t> lanes_map_t;
+            typedef Eigen::Map<const lanes_t> const_lanes_map_t;
+
+            inline lanes_map_t as_lanes( state_t &v ) const
+            {
+                return lanes_map_t( v.data(), no_states(), no_lanes );
+            }
+
+            inline const_lanes_map_t as_lanes( const state_t &v ) const
+            {
+                return const_lanes_map_t( v.data(), no_states(), no_lanes );
+            }
+
+            /// Rows holding all age groups of the given group and state type
+            template<typename MAP>
+            inline Eigen::Block<MAP, Eigen::Dynamic, Eigen::Dynamic, true> 
+                block( MAP &m, 
+                    const group_type_t gt, const seir_type_t st ) const
+            {
+                return m.middleRows( ode_id( nag, gt, st ), nag );
+            }
+
+            /// Population in the second exposed class (vaccinated and unvaccinated) of each age and risk group
+            void infected_E2( const state_t &densities, lanes_t &e2 ) const
+            {
+                auto y = as_lanes( densities );
+                e2.middleRows( 0, nag ) = block(y,VACC_LOW,E2)+block(y,LOW,E2);
+                e2.middleRows( nag, nag ) = block(y,VACC_HIGH,E2)+block(y,HIGH,E2);
+                e2.middleRows( 2*nag, nag ) = block(y,VACC_PREG,E2)+block(y,PREG,E2);
+            }
+
+            const size_t nag, no_lanes;
+
+            Eigen::VectorXd Npop;
+            Eigen::VectorXd vaccine_efficacy;
+            /// Transmission rate from age j to i in row i*nag+j
+            lanes_t transmission;
+            double a1, a2, g1, g2;
+
+            bool vaccinate = false;
+            Eigen::VectorXd vaccine_rates;
+
+            // Work space, reused between calls
+            state_t deltas;
+            lanes_t results, e2_start, e2_end, de2_start, de2_end;
+            lanes_t infectious, foi;
+            lane_row_t vacc_prov;
+    };
 
     cases_t one_year_SEIR_with_vaccination(
             const Eigen::VectorXd &Npop,  
@@ -237,7 +645,81 @@ namespace flu
             starting_time );
     }
 
-    cases_t infectionODE(
+    /// Work space to use for the given model; fixed size models get their own (stack allocated) work space
+    template<typename WORKSPACE>
+    inline WORKSPACE &select_workspace( WORKSPACE &model_workspace,
+            ode::workspace_t<Eigen::VectorXd> &/*workspace*/ )
+    {
+        return model_workspace;
+    }
+
+    inline ode::workspace_t<Eigen::VectorXd> &select_workspace( 
+            ode::workspace_t<Eigen::VectorXd> &/*model_workspace*/,
+            ode::workspace_t<Eigen::VectorXd> &workspace )
+    {
+        return workspace;
+    }
+
+    /**
+     * \brief Integrate the model over the given times, switching vaccination rates according to the compiled schedule
+     *
+     * Calls add_cases( i, new_cases ) with the new cases between times[i] and times[i+1]. This can be called multiple times for the same interval, when the vaccination rates change within it.
+     *
+     * Once interval i is complete interval_done( i ) is called. The integration stops early when that returns false.
+     */
+    template<typename MODEL, typename STATE, typename WORKSPACE, 
+        typename ADD_CASES, typename INTERVAL_DONE>
+    void integrate_timeline( MODEL &model, STATE &densities,
+            const vaccine::vaccine_t &vaccine_programme,
+            const vaccine::schedule_t &schedule,
+            const timeline_t &times,
+            WORKSPACE &ws, ADD_CASES add_cases, 
+            INTERVAL_DONE interval_done )
+    {
+        const auto &hours = times.hours;
+        size_t piece = schedule.piece( hours[0] );
+        long current_hour = hours[0];
+        for (size_t step_count = 0; step_count < times.size()-1; ++step_count)
+        {
+            while (current_hour < hours[step_count+1])
+            {
+                while (piece + 1 < schedule.breakpoints.size() &&
+                        schedule.breakpoints[piece+1] <= current_hour)
+                    ++piece;
+
+                auto next_hour = hours[step_count+1];
+                if (piece + 1 < schedule.breakpoints.size())
+                    next_hour = std::min( next_hour, 
+                            schedule.breakpoints[piece+1] );
+
+                const auto row = schedule.rows[piece];
+                if (row >= 0)
+                    model.set_vaccine_rates( 
+                            vaccine_programme.calendar.row(row).transpose() );
+                else
+                    model.set_vaccine_rates();
+
+                auto &n_cases = model.new_cases( densities, 
+                        (next_hour - current_hour)/24.0, ws );
+
+                /* DEBUG This is a good sanity check if run into problems
+                for( size_t i=0; i < densities.size(); ++i)
+                {
+                    if (densities[i]<0)
+                        ::Rf_error( "Some densities below zero" );
+                }
+                */
+
+                current_hour = next_hour;
+                add_cases( step_count, n_cases );
+            }
+            if (!interval_done( step_count ))
+                return;
+        }
+    }
+
+    template<int NAG>
+    cases_t run_infectionODE(
             const Eigen::VectorXd &Npop,  
             const Eigen::VectorXd &seed_vec, 
             const double tlatent, const double tinfectious, 
@@ -245,16 +727,17 @@ namespace flu
             const Eigen::MatrixXd &contact_regular, 
             double transmissibility,
             const vaccine::vaccine_t &vaccine_programme,
-            const std::vector<boost::posix_time::ptime> &times )
+            const vaccine::schedule_t &schedule,
+            const timeline_t &times,
+            ode::workspace_t<Eigen::VectorXd> &workspace,
+            const interval_callback_t &interval_done )
     {
-        namespace bt = boost::posix_time;
- 
         assert( s_profile.size() == contact_regular.rows() );
 
         const size_t nag = contact_regular.rows(); // No. of age groups
 
-        Eigen::VectorXd densities = Eigen::VectorXd::Zero( 
-                nag*group_types.size()*
+        typename SEIRModel<NAG>::state_t densities = 
+            SEIRModel<NAG>::state_t::Zero( nag*group_types.size()*
                 seir_types.size() );
 
 
@@ -264,8 +747,6 @@ namespace flu
         g1=2/tinfectious;
         g2=g1;
 
-        int date_id = -1;
-
         /*initialisation, transmission matrix*/
         Eigen::MatrixXd transmission_regular(contact_regular);
         for(int i=0;i<transmission_regular.rows();i++)
@@ -275,6 +756,14 @@ namespace flu
             }
         }
 
+        SEIRModel<NAG> model( Npop, vaccine_programme.efficacy,
+                transmission_regular, a1, a2, g1, g2 );
+
+        ode::workspace_t<typename SEIRModel<NAG>::state_t> model_workspace( 
+                static_cast<const ode::solver_state_t&>( workspace ) );
+        auto &ws = select_workspace( model_workspace, workspace );
+        const double initial_step_size = workspace.step_size;
+
         /*initialisation, densities.segment(ode_id(nag,VACC_LOW,S),nag),E,I,densities.segment(ode_id(nag,VACC_LOW,R),nag)*/
         for(size_t i=0;i<nag;i++)
         {
@@ -287,88 +776,203 @@ namespace flu
             densities[ode_id(nag,PREG,S,i)]=Npop[i+2*nag]-densities[ode_id(nag,PREG,E1,i)];
         }
 
-        auto current_time = times[0];
-
         cases_t cases;
         cases.cases = Eigen::MatrixXd::Zero( times.size()-1, 
                 contact_regular.cols()*group_types.size()/2);
         cases.times = times;
-        cases.times.erase( cases.times.begin() );
-
-        size_t step_count = 0;
-        static bt::time_duration dt = bt::hours( 6 );
-        bool time_changed_for_vacc = false;
-        auto next_time = current_time;
-        auto start_time = current_time;
-        while (step_count<cases.times.size())
+        cases.times.hours.erase( cases.times.hours.begin() );
+
+        integrate_timeline( model, densities, vaccine_programme, schedule, 
+                times, ws,
+                [&cases]( size_t step_count, 
+                    const typename SEIRModel<NAG>::group_vector_t &n_cases )
+                {
+                    assert(step_count < cases.cases.rows());
+                    cases.cases.row(step_count) += n_cases;
+                },
+                [&cases, &interval_done]( size_t step_count )
+                {
+                    return !interval_done || 
+                        interval_done( step_count, cases.cases );
+                } );
+
+        // Copy back the statistics. Every run starts from the same step size,
+        // so that a run does not depend on earlier (possibly stopped) runs
+        static_cast<ode::solver_state_t&>( workspace ) = ws;
+        workspace.step_size = initial_step_size;
+        return cases;
+    } 
+
+    cases_t infectionODE(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::VectorXd &seed_vec, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::VectorXd &s_profile, 
+            const Eigen::MatrixXd &contact_regular, 
+            double transmissibility,
+            const vaccine::vaccine_t &vaccine_programme,
+            const vaccine::schedule_t &schedule,
+            const timeline_t &times,
+            ode::workspace_t<Eigen::VectorXd> &workspace,
+            const interval_callback_t &interval_done )
+    {
+        // Use a model with fixed size storage for the common numbers
+        // of age groups and fall back on the dynamic version otherwise
+        switch (contact_regular.rows())
         {
-            next_time = cases.times[step_count];
-            if (time_changed_for_vacc) 
-            {
-                // Previous iteration time was changed, now need to
-                // go back to old situation
-                time_changed_for_vacc = false;
-            }
+            case 7:
+                return run_infectionODE<7>( Npop, seed_vec, 
+                        tlatent, tinfectious, s_profile, contact_regular,
+                        transmissibility, vaccine_programme, schedule, times, 
+                        workspace, interval_done );
+            case 5:
+                return run_infectionODE<5>( Npop, seed_vec, 
+                        tlatent, tinfectious, s_profile, contact_regular,
+                        transmissibility, vaccine_programme, schedule, times, 
+                        workspace, interval_done );
+            default:
+                return run_infectionODE<Eigen::Dynamic>( Npop, seed_vec, 
+                        tlatent, tinfectious, s_profile, contact_regular,
+                        transmissibility, vaccine_programme, schedule, times, 
+                        workspace, interval_done );
+        }
+    }
 
-            
-            //Rcpp::Rcout << "cTime: " << current_time << std::endl;
-            //Rcpp::Rcout << "Time: " << next_time << std::endl;
+    cases_t infectionODE(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::VectorXd &seed_vec, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::VectorXd &s_profile, 
+            const Eigen::MatrixXd &contact_regular, 
+            double transmissibility,
+            const vaccine::vaccine_t &vaccine_programme,
+            const std::vector<boost::posix_time::ptime> &times,
+            ode::workspace_t<Eigen::VectorXd> &workspace )
+    {
+        const timeline_t timeline( times );
+        return infectionODE( Npop, seed_vec, tlatent, tinfectious,
+                s_profile, contact_regular, transmissibility, 
+                vaccine_programme, vaccine::schedule_t( vaccine_programme,
+                    timeline ), timeline, workspace );
+    }
+
+    cases_t infectionODE(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::VectorXd &seed_vec, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::VectorXd &s_profile, 
+            const Eigen::MatrixXd &contact_regular, 
+            double transmissibility,
+            const vaccine::vaccine_t &vaccine_programme,
+            const std::vector<boost::posix_time::ptime> &times )
+    {
+        ode::workspace_t<Eigen::VectorXd> workspace( 0.25 ); // 6 hours
+        return infectionODE( Npop, seed_vec, tlatent, tinfectious,
+                s_profile, contact_regular, transmissibility, 
+                vaccine_programme, times, workspace );
+    }
 
-            Eigen::VectorXd vacc_rates;
-            if (vaccine_programme.dates.size() > 0)
+    batch_cases_t infectionODE_batch(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::MatrixXd &seed_vecs, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::MatrixXd &s_profiles, 
+            const std::vector<Eigen::MatrixXd> &contact_regulars, 
+            const Eigen::VectorXd &transmissibilities,
+            const vaccine::vaccine_t &vaccine_programme,
+            const std::vector<boost::posix_time::ptime> &times,
+            ode::workspace_t<Eigen::VectorXd> &workspace,
+            size_t lanes_per_batch )
+    {
+        const size_t no_samples = contact_regulars.size();
+        assert( seed_vecs.cols() == no_samples );
+        assert( s_profiles.cols() == no_samples );
+        assert( transmissibilities.size() == no_samples );
+
+        double a1, a2, g1, g2;
+        a1=2/tlatent;
+        a2=a1;
+        g1=2/tinfectious;
+        g2=g1;
+
+        const timeline_t timeline( times );
+        const vaccine::schedule_t schedule( vaccine_programme, timeline );
+
+        batch_cases_t cases;
+        cases.times = timeline;
+        cases.times.hours.erase( cases.times.hours.begin() );
+
+        ode::solver_state_t solver_state = workspace;
+        solver_state.no_steps = 0;
+        solver_state.no_rejected = 0;
+
+        // Zero lanes would never finish
+        lanes_per_batch = std::max<size_t>( lanes_per_batch, 1 );
+        for (size_t first = 0; first < no_samples; first += lanes_per_batch)
+        {
+            const size_t no_lanes = std::min( lanes_per_batch, 
+                    no_samples - first );
+            const size_t nag = contact_regulars[first].rows();
+
+            std::vector<Eigen::MatrixXd> transmission_regular;
+            for (size_t l = first; l < first + no_lanes; ++l)
             {
-                while (date_id < ((int)vaccine_programme.dates.size())-1 && 
-                        current_time == vaccine_programme.dates[date_id+1] )
+                assert( contact_regulars[l].rows() == nag );
+                Eigen::MatrixXd transmission(contact_regulars[l]);
+                for(int i=0;i<transmission.rows();i++)
                 {
-                    ++date_id;
+                    for(int j=0;j<transmission.cols();j++) {
+                        transmission(i,j)*=
+                            transmissibilities[l]*s_profiles(i,l);
+                    }
                 }
-            } else {
-                // Legacy mode
-                date_id=floor((current_time-start_time).hours()/24.0-44);
+                transmission_regular.push_back( transmission );
             }
 
-            if (date_id < ((int)vaccine_programme.dates.size())-1 && 
-                        date_id >= -1 && 
-                    next_time > vaccine_programme.dates[date_id+1] )
-            {
-                next_time = 
-                    vaccine_programme.dates[date_id+1];
-                time_changed_for_vacc = true;
-            }
-
-            if (date_id >= 0 &&
-                    date_id < vaccine_programme.calendar.rows() )
-                vacc_rates = vaccine_programme.calendar.row(date_id); 
-            //Rcpp::Rcout << "Densities " << densities << std::endl;
-            auto n_cases = new_cases( densities, current_time,
-                    next_time, dt,
-                    Npop,
-                    vacc_rates,
-                    vaccine_programme.efficacy,
-                    transmission_regular,
-                    a1, a2, g1, g2 );
-
-            /* DEBUG This is a good sanity check if run into problems
-            for( size_t i=0; i < densities.size(); ++i)
+            SEIRBatchModel model( Npop, vaccine_programme.efficacy,
+                    transmission_regular, a1, a2, g1, g2 );
+            // Each batch starts with the initial solver settings
+            ode::workspace_t<Eigen::VectorXd> ws( 
+                    static_cast<const ode::solver_state_t&>( workspace ) );
+            ws.no_steps = 0;
+            ws.no_rejected = 0;
+
+            SEIRBatchModel::state_t densities = 
+                SEIRBatchModel::state_t::Zero( model.no_states()*no_lanes );
+            for(size_t i=0;i<nag;i++)
             {
-                if (densities[i]<0)
-                    ::Rf_error( "Some densities below zero" );
+                for (size_t l = 0; l < no_lanes; ++l)
+                {
+                    for (auto &gt : { LOW, HIGH, PREG })
+                    {
+                        const auto e1 = seed_vecs(i+gt*nag, first + l);
+                        densities[ode_id(nag,gt,E1,i)*no_lanes + l] = e1;
+                        densities[ode_id(nag,gt,S,i)*no_lanes + l] = 
+                            Npop[i+gt*nag]-e1;
+                    }
+                }
             }
-            */
 
-            current_time = next_time;
-            //Rcpp::Rcout << "N cases" << n_cases << std::endl;
+            for (size_t l = 0; l < no_lanes; ++l)
+                cases.cases.push_back( Eigen::MatrixXd::Zero( 
+                            times.size()-1, 3*nag ) );
 
-            assert(step_count < cases.cases.rows());
+            integrate_timeline( model, densities, vaccine_programme, schedule,
+                    timeline, ws, [&cases, first, no_lanes]( size_t step_count, 
+                        const SEIRBatchModel::lanes_t &n_cases )
+                    {
+                        for (size_t l = 0; l < no_lanes; ++l)
+                            cases.cases[first + l].row(step_count) += 
+                                n_cases.col(l).matrix().transpose();
+                    }, []( size_t ) { return true; } );
 
-            cases.cases.row(step_count) += n_cases;
-            if (!time_changed_for_vacc) 
-            {
-                ++step_count;
-            }
+            solver_state.no_steps += ws.no_steps;
+            solver_state.no_rejected += ws.no_rejected;
         }
+
+        static_cast<ode::solver_state_t&>( workspace ) = solver_state;
         return cases;
-    } 
+    }
 
     cases_t infectionODE(
             const Eigen::VectorXd &Npop,  
@@ -380,39 +984,63 @@ namespace flu
             size_t minimal_resolution, 
             const boost::posix_time::ptime &starting_time )
     {
- 
-        namespace bt = boost::posix_time;
-        auto current_time = starting_time;
-        if (to_tm(current_time).tm_year==70 && 
+        ode::workspace_t<Eigen::VectorXd> workspace( 0.25 ); // 6 hours
+        return infectionODE( Npop, seed_vec, tlatent, tinfectious,
+                s_profile, contact_regular, transmissibility, 
+                vaccine_programme, minimal_resolution, starting_time, 
+                workspace );
+    }
+
+    cases_t infectionODE(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::VectorXd &seed_vec, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::VectorXd &s_profile, 
+            const Eigen::MatrixXd &contact_regular, double transmissibility,
+            const vaccine::vaccine_t &vaccine_programme,
+            size_t minimal_resolution, 
+            const boost::posix_time::ptime &starting_time,
+            ode::workspace_t<Eigen::VectorXd> &workspace )
+    {
+        const auto times = model_times( vaccine_programme, 
+                minimal_resolution, starting_time );
+        return infectionODE( Npop, seed_vec, tlatent, tinfectious,
+                s_profile, contact_regular,
+                transmissibility, vaccine_programme,
+                vaccine::schedule_t( vaccine_programme, times ), times, 
+                workspace );
+    }
+
+    timeline_t model_times(
+            const vaccine::vaccine_t &vaccine_programme,
+            size_t minimal_resolution,
+            const boost::posix_time::ptime &starting_time )
+    {
+        timeline_t times;
+        times.start_time = starting_time;
+        if (to_tm(starting_time).tm_year==70 && 
                 vaccine_programme.dates.size()!=0)
         {
-            current_time = getTimeFromWeekYear( 35, 
+            times.start_time = getTimeFromWeekYear( 35, 
                 vaccine_programme.dates[0].date().year() );
         }
 
-        auto start_time = current_time;
-        auto end_time = current_time + bt::hours(364*24);
-
-        auto next_time = current_time;
-
-        std::vector<boost::posix_time::ptime> times;
-        times.push_back(start_time);
-        while(next_time < end_time)
+        const long end_hour = 364*24;
+        long next_hour = 0;
+        times.hours.push_back( next_hour );
+        while(next_hour < end_hour)
         {
-            next_time += bt::hours(minimal_resolution);
-            times.push_back( next_time );
+            next_hour += minimal_resolution;
+            times.hours.push_back( next_hour );
         }
-        return infectionODE( Npop, seed_vec, tlatent, tinfectious,
-                s_profile, contact_regular,
-                transmissibility, vaccine_programme,
-                times );
+        return times;
     }
 
     Eigen::MatrixXd days_to_weeks_11AG(const cases_t &simulation)
     {
 
-        size_t weeks =  (simulation.times.back() - simulation.times.front())
-            .hours()/(24*7) + 1;
+        const auto &hours = simulation.times.hours;
+        size_t weeks =  (hours.back() - hours.front())/(24*7) + 1;
         auto result_days = simulation.cases;
         /*initialisation*/
         Eigen::MatrixXd result_weeks = 
@@ -421,9 +1049,8 @@ namespace flu
         size_t j = 0;
         for(size_t i=0; i<weeks; i++)
         {
-            auto startWeek = simulation.times[j];
-            while( j < simulation.times.size() &&
-                    (simulation.times[j]-startWeek).hours()/(24.0)<7.0 )
+            auto startWeek = hours[j];
+            while( j < hours.size() && (hours[j]-startWeek)/(24.0)<7.0 )
             {
                 result_weeks(i,0)+=result_days(j,0)+result_days(j,10);
                 result_weeks(i,1)+=result_days(j,1)+result_days(j,11);
@@ -447,8 +1074,8 @@ namespace flu
         const Eigen::MatrixXd &mapping, size_t no_data)
     {
 
-        size_t weeks =  (simulation.times.back() - simulation.times.front())
-            .hours()/(24*7) + 1;
+        const auto &hours = simulation.times.hours;
+        size_t weeks =  (hours.back() - hours.front())/(24*7) + 1;
         auto result_days = simulation.cases;
         /*initialisation*/
         Eigen::MatrixXd result_weeks = 
@@ -457,9 +1084,8 @@ namespace flu
         size_t j = 0;
         for(size_t i=0; i<weeks; i++)
         {
-            auto startWeek = simulation.times[j];
-            while( j < simulation.times.size() &&
-                    (simulation.times[j]-startWeek).hours()/(24.0)<7.0 )
+            auto startWeek = hours[j];
+            while( j < hours.size() && (hours[j]-startWeek)/(24.0)<7.0 )
             {
               for(size_t k = 0; k < mapping.rows(); ++k)
                 result_weeks(i,(size_t) mapping(k,1)) += mapping(k,2)*result_days(j,(size_t) mapping(k,0));
@@ -470,31 +1096,110 @@ namespace flu
         return result_weeks;
     }
 
+    /**
+     * \brief Log of the ratio of the term mplus + 1 and the term mplus in 
+     * binomial_log_likelihood
+     *
+     * The ratio of the first binomial is (m - mplus)/(mplus + 1)*pf/(1 - pf),
+     * the ratio of the second ((mplus + 1)/mplus)^n_plus*
+     * ((m - mplus - 1)/(m - mplus))^(n - n_plus).
+     */
+    static double binomial_log_ratio( int mplus, int ili_cases, 
+            double log_odds, int confirmed_positive, int confirmed_samples )
+    {
+        double ratio = log( ((double)(ili_cases - mplus))/(mplus + 1) ) + 
+            log_odds;
+        if (confirmed_positive > 0)
+            ratio += confirmed_positive*log1p( 1.0/mplus );
+        if (confirmed_samples > confirmed_positive)
+            ratio += (confirmed_samples - confirmed_positive)*
+                log1p( -1.0/(ili_cases - mplus) );
+        return ratio;
+    }
+
     long double binomial_log_likelihood( double epsilon, 
             size_t predicted, double population_size, 
             int ili_cases, int ili_monitored,
-            int confirmed_positive, int confirmed_samples
-             )
+            int confirmed_positive, int confirmed_samples,
+            double relative_threshold )
     {
+        const double no_likelihood = log(1e-100);
         auto pf = (1.0/epsilon)*((double) predicted)/population_size;
-        long double prob = 0;
-        for (size_t mplus = 0; mplus <= (size_t)ili_cases; ++mplus)
+        if (!(pf >= 0 && pf <= 1) || ili_cases <= 0 || 
+                confirmed_positive < 0 || 
+                confirmed_positive > confirmed_samples)
+            return no_likelihood;
+
+        // Range of mplus for which the terms are non zero
+        int lower = (confirmed_positive > 0) ? 1 : 0;
+        int upper = (confirmed_samples > confirmed_positive) ? 
+            ili_cases - 1 : ili_cases;
+        if (pf == 0)
+            upper = std::min( upper, 0 );
+        if (pf == 1)
+            lower = std::max( lower, ili_cases );
+        if (lower > upper)
+            return no_likelihood;
+
+        auto log_term = [&]( int mplus ) {
+            return density::dbinom( mplus, ili_cases, pf, true ) +
+                density::dbinom( confirmed_positive, confirmed_samples,
+                        ((double)mplus)/ili_cases, true );
+        };
+        const double log_odds = log( pf ) - log1p( -pf );
+        auto log_ratio = [&]( int mplus ) {
+            return binomial_log_ratio( mplus, ili_cases, log_odds, 
+                    confirmed_positive, confirmed_samples );
+        };
+
+        // The terms are log concave in mplus, find the mode by bisection on
+        // the sign of the ratio
+        int mode = lower;
+        int right = upper;
+        while (mode < right)
         {
-            auto pn = ((double)mplus)/ili_cases;
-            prob += R::dbinom( mplus, ili_cases, pf, 0 )*
-                R::dbinom( confirmed_positive, confirmed_samples,
-                        pn, 0 );
+            const int middle = mode + (right - mode)/2;
+            if (log_ratio( middle ) > 0)
+                mode = middle + 1;
+            else
+                right = middle;
         }
-        if (prob == 0 || !std::isfinite(prob))
-        {
-            /*Rcpp::cout << epsilon << ", " << predicted << ", " <<
-                population_size << ", " << ili_cases << ", " << 
-                confirmed_positive << ", " confirmed_samples <<
-                std::endl;*/
 
-            return log(1e-100);
+        // Walk away from the mode in both directions. The ratio of 
+        // subsequent terms keeps decreasing, so the remaining terms are 
+        // bounded by a geometric series. Stop when that bound is smaller 
+        // than relative_threshold times the largest term
+        const double log_mode = log_term( mode );
+        const double cutoff = log_mode + log( relative_threshold );
+        auto negligible = [&]( double log_value, double log_ratio ) {
+            return log_value < cutoff && log_ratio < 0 &&
+                log_value + log_ratio - log( -expm1( log_ratio ) ) < cutoff;
+        };
+
+        likelihood::log_sum_exp_t llikelihood( log_mode );
+        double log_value = log_mode;
+        for (int mplus = mode; mplus < upper; ++mplus)
+        {
+            const double ratio = log_ratio( mplus );
+            if (negligible( log_value, ratio ))
+                break;
+            log_value += ratio;
+            llikelihood.add( log_value );
+        }
+        log_value = log_mode;
+        for (int mplus = mode; mplus > lower; --mplus)
+        {
+            const double ratio = -log_ratio( mplus - 1 );
+            if (negligible( log_value, ratio ))
+                break;
+            log_value += ratio;
+            llikelihood.add( log_value );
         }
-        return log(prob);
+
+        const double result = llikelihood.value();
+        if (!std::isfinite( result ))
+            return no_likelihood;
+        return result;
     }
 
     double binomial_log_likelihood_year(const std::vector<double> &eps, 
@@ -520,15 +1225,65 @@ namespace flu
     }
 
 
-    long double log_likelihood( double epsilon, double psi, 
-            size_t predicted, double population_size, 
-            int ili_cases, int ili_monitored,
-            int confirmed_positive, int confirmed_samples, 
-            int depth )
+    /// log of an integer, computed directly
+    struct direct_log_t
     {
-        int Z_in_mon=(int)round(predicted*ili_monitored/population_size);
-        int n=confirmed_samples;
-        int m=ili_cases;
+        double operator()( int i ) const
+        {
+            return log( (double)i );
+        }
+    };
+
+    /// Pairwise sum of log values in long double
+    struct long_double_log_sum_t
+    {
+        typedef long double real_t;
+
+        explicit long_double_log_sum_t( long double log_value )
+            : sum( log_value ) {}
+
+        void add( long double log_value )
+        {
+            sum = safe_sum_log( log_value, sum );
+        }
+
+        long double value() const
+        {
+            return sum;
+        }
+
+        long double sum;
+    };
+
+    /// Compensated sum of log values in double precision
+    struct compensated_log_sum_t : likelihood::log_sum_exp_t
+    {
+        typedef double real_t;
+
+        explicit compensated_log_sum_t( double log_value )
+            : likelihood::log_sum_exp_t( log_value ) {}
+    };
+
+    /**
+     * \brief Log likelihood given the predicted number of cases in the monitored population
+     *
+     * LOG gives the log of the (integer) counts, LOG_SUM accumulates the 
+     * terms of the recurrence (and determines its precision). The terms 
+     * that only depend on the data, and the logs of epsilon and psi, are 
+     * computed by the caller.
+     */
+    template<typename LOG, typename LOG_SUM>
+    long double log_likelihood_monitored( const LOG &log_int,
+            const likelihood::cell_terms_t &terms,
+            double epsilon, double psi, 
+            double log_epsilon, double log_1m_epsilon, double log_psi,
+            int Z_in_mon, int depth )
+    {
+        typedef typename LOG_SUM::real_t real_t;
+        const int n=terms.confirmed_samples;
+        const int m=terms.ili_cases;
+        const int ili_monitored=terms.ili_monitored;
+        const int confirmed_positive=terms.confirmed_positive;
 
         /*h.init=max(n.plus-Z.in.mon,0)*/
         int h_init;
@@ -544,26 +1299,22 @@ namespace flu
         }
 
         /*define the first aij*/
-        long double laij=log(epsilon)*confirmed_positive-psi*ili_monitored*epsilon;
+        real_t laij=log_epsilon*confirmed_positive-psi*ili_monitored*epsilon;
 
         if(confirmed_positive<n)
-            for(int g=confirmed_positive; g<n; g++) {
-                laij += log(m-g);
-            }
+            laij += terms.log_unconfirmed;
 
         if((Z_in_mon==confirmed_positive)&&(Z_in_mon>0))
-            for(int g=1; g<=confirmed_positive;g++) {
-                laij += log(g);
-            }
+            laij += terms.log_factorial_positive;
 
         if((confirmed_positive>0)&&(confirmed_positive<Z_in_mon))
             for(int g=0;g<confirmed_positive;g++) {
-                laij+=log(Z_in_mon-g);
+                laij+=log_int(Z_in_mon-g);
             }
 
         if((Z_in_mon>0)&&(confirmed_positive>Z_in_mon))
             for(int g=0; g<Z_in_mon;g++) {
-                laij+=log(confirmed_positive-g);
+                laij+=log_int(confirmed_positive-g);
             }
 
         if(confirmed_positive>Z_in_mon) {
@@ -571,35 +1322,35 @@ namespace flu
         }
 
         if(confirmed_positive<Z_in_mon)
-            laij+=log(1-epsilon)*(Z_in_mon-confirmed_positive);
+            laij+=log_1m_epsilon*(Z_in_mon-confirmed_positive);
 
         /*store the values of the first aij on the current line*/
-        long double laij_seed=laij;
+        real_t laij_seed=laij;
         int k_seed=confirmed_positive;
 
-        auto llikelihood_AG_week=laij;
+        LOG_SUM llikelihood_AG_week( laij );
 
         /*Calculation of the first line*/
         int max_m_plus;
-        if(Z_in_mon+h_init>m-n+confirmed_positive)
-            max_m_plus=m-n+confirmed_positive;
+        if(Z_in_mon+h_init>terms.max_positive)
+            max_m_plus=terms.max_positive;
         else
             max_m_plus=Z_in_mon+h_init;
 
         if(max_m_plus>confirmed_positive)
             for(int k=confirmed_positive+1;k<=max_m_plus;k++)
             {
-                laij+=log(k) + log(epsilon) + log(m-k-n+confirmed_positive+1)+log(Z_in_mon-k+h_init+1)-log(m-k+1)- 
-                  log(k-confirmed_positive) - log(k-h_init) - log(1-epsilon);
-                llikelihood_AG_week = safe_sum_log(laij, llikelihood_AG_week);
+                laij+=log_int(k) + log_epsilon + log_int(m-k-n+confirmed_positive+1)+log_int(Z_in_mon-k+h_init+1)-log_int(m-k+1)- 
+                  log_int(k-confirmed_positive) - log_int(k-h_init) - log_1m_epsilon;
+                llikelihood_AG_week.add(laij);
             }
 
         /*top_sum=min(depth,m-n+confirmed_positive)*/
         int top_sum;
-        if(depth<m-n+confirmed_positive)
+        if(depth<terms.max_positive)
             top_sum=depth;
         else
-            top_sum=m-n+confirmed_positive;
+            top_sum=terms.max_positive;
 
         if(h_init<top_sum)
             for(int h=h_init+1;h<=top_sum;h++)
@@ -607,37 +1358,37 @@ namespace flu
                 if(h>confirmed_positive) /*diagonal increment*/
                 {
                     k_seed++;
-                    laij_seed+=log(k_seed)+log(m-k_seed-n+confirmed_positive+1) + log(psi) +
-                      log(epsilon) + log(ili_monitored)- log(m-k_seed+1) - 
-                      log(k_seed-confirmed_positive) - log(h);
+                    laij_seed+=log_int(k_seed)+log_int(m-k_seed-n+confirmed_positive+1) + log_psi +
+                      log_epsilon + terms.log_monitored- log_int(m-k_seed+1) - 
+                      log_int(k_seed-confirmed_positive) - log_int(h);
                 }
 
                 if(h<=confirmed_positive) /*vertical increment*/ {
-                    laij_seed+=log(k_seed-h+1) + log(psi) + log(ili_monitored) + log(1-epsilon) -
-                      log(Z_in_mon-k_seed+h) - log(h);
+                    laij_seed+=log_int(k_seed-h+1) + log_psi + terms.log_monitored + log_1m_epsilon -
+                      log_int(Z_in_mon-k_seed+h) - log_int(h);
                 }
 
                 laij=laij_seed;
-                llikelihood_AG_week = safe_sum_log(laij, llikelihood_AG_week);
+                llikelihood_AG_week.add(laij);
 
                 /*calculation of the line*/
-                if(Z_in_mon+h>m-n+confirmed_positive)
-                    max_m_plus=m-n+confirmed_positive;
+                if(Z_in_mon+h>terms.max_positive)
+                    max_m_plus=terms.max_positive;
                 else
                     max_m_plus=Z_in_mon+h;
 
                 if(max_m_plus>k_seed)
                     for(int k=k_seed+1;k<=max_m_plus;k++)
                     {
-                        laij+=log(k) + log(m-k-n+confirmed_positive+1) + log(Z_in_mon-k+h+1) +
-                          log(epsilon) - log(m-k+1) - log(k-confirmed_positive) -log(k-h) -
-                          log(1-epsilon);
-                        llikelihood_AG_week = safe_sum_log(laij, llikelihood_AG_week);
+                        laij+=log_int(k) + log_int(m-k-n+confirmed_positive+1) + log_int(Z_in_mon-k+h+1) +
+                          log_epsilon - log_int(m-k+1) - log_int(k-confirmed_positive) -log_int(k-h) -
+                          log_1m_epsilon;
+                        llikelihood_AG_week.add(laij);
                     }
             }
 
         //auto ll = log(likelihood_AG_week);
-        auto ll = llikelihood_AG_week;
+        long double ll = llikelihood_AG_week.value();
         if (!std::isfinite(ll))
         {
             /*Rcpp::Rcerr << "Numerical error detected for week " 
@@ -649,6 +1400,92 @@ namespace flu
         return ll;
     }
 
+    /// Log likelihood given the predicted number of cases in the monitored population
+    long double log_likelihood_monitored( double epsilon, double psi, 
+            int Z_in_mon, int ili_cases, int ili_monitored,
+            int confirmed_positive, int confirmed_samples, 
+            int depth )
+    {
+        const direct_log_t log_int;
+        return log_likelihood_monitored<direct_log_t, long_double_log_sum_t>(
+                log_int, likelihood::cell_terms( log_int, ili_cases, 
+                    ili_monitored, confirmed_positive, confirmed_samples ),
+                epsilon, psi, log(epsilon), log(1-epsilon), log(psi), 
+                Z_in_mon, depth );
+    }
+
+    long double log_likelihood( double epsilon, double psi, 
+            size_t predicted, double population_size, 
+            int ili_cases, int ili_monitored,
+            int confirmed_positive, int confirmed_samples, 
+            int depth )
+    {
+        int Z_in_mon=(int)round(predicted*ili_monitored/population_size);
+        return log_likelihood_monitored( epsilon, psi, Z_in_mon, 
+                ili_cases, ili_monitored, confirmed_positive, 
+                confirmed_samples, depth );
+    }
+
+    /**
+     * \brief Maximum of the log likelihood over Z_in_mon
+     *
+     * The likelihood is unimodal in Z = Z_in_mon, so the mode can be found by
+     * ternary search. The recurrence in log_likelihood_monitored sums the 
+     * terms Bin(k - h; Z, epsilon)*P(h)*H(k) over h <= depth and k, with 
+     * P(h) = (psi*ili_monitored)^h/h! (times a constant) and H(k) the 
+     * probability of the confirmed samples given k influenza cases among 
+     * the ILI cases. The limits of the sums are the supports of the terms, 
+     * except for h <= depth, which does not depend on Z. So the likelihood 
+     * is L(Z) = sum_j Bin(j; Z, epsilon)*g(j), with 
+     * g(j) = sum_{h <= depth} P(h)*H(j + h).
+     * - H(k) is proportional to choose(k, n_plus)*choose(m - k, n - n_plus),
+     *   a product of log concave sequences in k, and P(h) is log concave on
+     *   0..depth. Their convolution g is log concave, so unimodal.
+     * - The binomial kernel Bin(j; Z, epsilon) is totally positive in 
+     *   (Z, j) and sums to one over j, so L(Z) - c changes sign at most as 
+     *   often as g(j) - c, and in the same order (variation diminishing 
+     *   property, Karlin 1968). For every c, g - c has the signs -, +, - 
+     *   (or fewer changes), so every upper level set of L is an interval.
+     * Values of Z for which all terms are zero (h_init > depth) return a 
+     * penalty that shrinks as Z grows, which keeps the function unimodal.
+     *
+     * A small margin is added for rounding errors in the summation.
+     */
+    template<typename LL>
+    static long double upper_bound( const LL &ll, int ili_monitored )
+    {
+        // The number of cases in the monitored population can not be 
+        // larger than the monitored population. Narrow down the mode by 
+        // ternary search and check the remaining values one by one
+        int lower = 0;
+        int upper = std::max( ili_monitored, 0 );
+        while (upper - lower > 8)
+        {
+            int m1 = lower + (upper - lower)/3;
+            int m2 = upper - (upper - lower)/3;
+            if (ll( m1 ) < ll( m2 ))
+                lower = m1 + 1;
+            else
+                upper = m2;
+        }
+
+        auto bound = ll( lower );
+        for (int z = lower + 1; z <= upper; ++z)
+            bound = std::max( bound, ll( z ) );
+        return bound + 1e-9*(1 + std::fabs( bound ));
+    }
+
+    long double log_likelihood_upper_bound( double epsilon, double psi, 
+            int ili_cases, int ili_monitored,
+            int confirmed_positive, int confirmed_samples, 
+            int depth )
+    {
+        return upper_bound( [&]( int Z_in_mon ) {
+            return log_likelihood_monitored( epsilon, psi, Z_in_mon, 
+                    ili_cases, ili_monitored, confirmed_positive, 
+                    confirmed_samples, depth ); }, ili_monitored );
+    }
+
     double log_likelihood_hyper_poisson(const Eigen::VectorXd &eps, 
             double psi, const Eigen::MatrixXd &result_by_week,
             const Eigen::MatrixXi &ili, const Eigen::MatrixXi &mon_pop, 
@@ -672,6 +1509,113 @@ namespace flu
         return(result);
     }
 
+    compiled_likelihood_t::compiled_likelihood_t( const Eigen::MatrixXi &ili, 
+            const Eigen::MatrixXi &mon_pop, 
+            const Eigen::MatrixXi &n_pos, const Eigen::MatrixXi &n_samples, 
+            const Eigen::VectorXd &pop_RCGP, int depth, 
+            likelihood::summation_t summation )
+        : no_weeks( ili.rows() ), population_sizes( pop_RCGP ),
+        depth( depth ), summation( summation ),
+        logs( likelihood::log_table_for_data( ili, mon_pop, n_samples, 
+                    depth ) )
+    {
+        // Stored by age group, in the order in which the cells are summed
+        for (int i = 0; i < pop_RCGP.size(); ++i)
+        {
+            for (size_t week = 0; week < no_weeks; ++week)
+            {
+                cell_t cell;
+                cell.terms = likelihood::cell_terms( logs, ili(week,i), 
+                        mon_pop(week,i), n_pos(week,i), n_samples(week,i) );
+                // Without a monitored population the predicted number of 
+                // cases in the monitored population is always zero
+                cell.constant = (mon_pop(week,i) == 0);
+                if (cell.constant)
+                    cell.value = log_likelihood_monitored( cell.terms, 
+                            observation_logs_t( 0.5, 0.5 ), 0.5, 0.5, 0 );
+                cells.push_back( cell );
+            }
+        }
+    }
+
+    compiled_likelihood_t::observation_logs_t::observation_logs_t( 
+            double epsilon, double psi )
+        : epsilon( log(epsilon) ), one_minus_epsilon( log(1-epsilon) ),
+        psi( log(psi) ) {}
+
+    long double compiled_likelihood_t::log_likelihood_monitored( 
+            const likelihood::cell_terms_t &terms, 
+            const observation_logs_t &observation_logs,
+            double epsilon, double psi, int Z_in_mon ) const
+    {
+        switch (summation)
+        {
+            case likelihood::COMPENSATED:
+                return flu::log_likelihood_monitored<likelihood::log_table_t, 
+                       compensated_log_sum_t>( logs, terms, epsilon, psi, 
+                        observation_logs.epsilon, 
+                        observation_logs.one_minus_epsilon, 
+                        observation_logs.psi, Z_in_mon, depth );
+            default:
+                return flu::log_likelihood_monitored<likelihood::log_table_t, 
+                       long_double_log_sum_t>( logs, terms, epsilon, psi, 
+                        observation_logs.epsilon, 
+                        observation_logs.one_minus_epsilon, 
+                        observation_logs.psi, Z_in_mon, depth );
+        }
+    }
+
+    long double compiled_likelihood_t::cell_log_likelihood( 
+            const cell_t &cell, double population_size,
+            const observation_logs_t &observation_logs,
+            double epsilon, double psi, size_t predicted ) const
+    {
+        if (cell.constant)
+            return cell.value;
+        int Z_in_mon=(int)round(predicted*cell.terms.ili_monitored/
+                population_size);
+        return log_likelihood_monitored( cell.terms, observation_logs, 
+                epsilon, psi, Z_in_mon );
+    }
+
+    long double compiled_likelihood_t::operator()( size_t week, size_t group,
+            double epsilon, double psi, size_t predicted ) const
+    {
+        return cell_log_likelihood( cells[group*no_weeks + week], 
+                population_sizes[group], observation_logs_t( epsilon, psi ),
+                epsilon, psi, predicted );
+    }
+
+    long double compiled_likelihood_t::upper_bound( size_t week, 
+            size_t group, double epsilon, double psi ) const
+    {
+        const auto &cell = cells[group*no_weeks + week];
+        if (cell.constant)
+            return cell.value;
+        const observation_logs_t observation_logs( epsilon, psi );
+        return flu::upper_bound( [&]( int Z_in_mon ) {
+            return log_likelihood_monitored( cell.terms, observation_logs,
+                    epsilon, psi, Z_in_mon ); }, cell.terms.ili_monitored );
+    }
+
+    double compiled_likelihood_t::operator()( const Eigen::VectorXd &eps, 
+            double psi, const Eigen::MatrixXd &result_by_week ) const
+    {
+        long double result=0.0;
+        for(int i=0;i<population_sizes.size();i++)
+        {
+            auto epsilon=eps(i);
+            const observation_logs_t observation_logs( epsilon, psi );
+            for(int week=0;week<result_by_week.rows();week++)
+            {
+                result += cell_log_likelihood( cells[i*no_weeks + week],
+                        population_sizes(i), observation_logs, epsilon, psi,
+                        result_by_week(week,i) );
+            }
+        }
+        return(result);
+    }
+
     /// Return the log prior probability of the proposed parameters - current parameters
     //
     // \param susceptibility whether to use the prior based on 2003/04
@@ -6,11 +6,15 @@
 #include<cmath>
 
 #include<vector>
+#include<functional>
 
 #include <boost/date_time.hpp>
 
 #include "state.h"
 #include "vaccine.h"
+#include "ode.h"
+#include "timeline.h"
+#include "likelihood.h"
 
 #include "rcppwrap.h"
 #include<RcppEigen.h>
@@ -25,7 +29,16 @@ namespace flu
         Eigen::MatrixXd cases;
 
         //! Times corresponding to number of cases
-        std::vector<boost::posix_time::ptime> times;
+        timeline_t times;
+    };
+
+    struct batch_cases_t 
+    {
+        //! Number of new cases (time x group) for each parameter set
+        std::vector<Eigen::MatrixXd> cases;
+
+        //! Times corresponding to number of cases
+        timeline_t times;
     };
 
     /**
@@ -72,6 +85,100 @@ namespace flu
             const vaccine::vaccine_t &vaccine_programme,
             const std::vector<boost::posix_time::ptime> &times );
 
+    /**
+     * \brief Run the model using the passed solver work space
+     *
+     * The work space holds the integration method, step size and all scratch 
+     * buffers of the solver, and counts the number of steps taken. Use one 
+     * work space per thread to run the model concurrently.
+     */
+    cases_t infectionODE(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::VectorXd &seed_vec, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::VectorXd &s_profile, 
+            const Eigen::MatrixXd &contact_regular, 
+            double transmissibility,
+            const vaccine::vaccine_t &vaccine_programme,
+            const std::vector<boost::posix_time::ptime> &times,
+            ode::workspace_t<Eigen::VectorXd> &workspace );
+
+    /**
+     * \brief Called after each output interval with its index and the cases so far
+     *
+     * Returning false stops the integration. Later intervals are left at zero.
+     */
+    typedef std::function<bool( size_t, const Eigen::MatrixXd & )> 
+        interval_callback_t;
+
+    /**
+     * \brief Run the model using a precompiled vaccination schedule
+     *
+     * The schedule needs to be compiled for the same vaccine_programme and 
+     * times, but can be reused for any number of runs (see model_times).
+     * An optional interval_done callback can stop the run early.
+     */
+    cases_t infectionODE(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::VectorXd &seed_vec, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::VectorXd &s_profile, 
+            const Eigen::MatrixXd &contact_regular, 
+            double transmissibility,
+            const vaccine::vaccine_t &vaccine_programme,
+            const vaccine::schedule_t &schedule,
+            const timeline_t &times,
+            ode::workspace_t<Eigen::VectorXd> &workspace,
+            const interval_callback_t &interval_done = 
+                interval_callback_t() );
+
+    /**
+     * \brief Output times used when running the model for a year
+     *
+     * @minimal_resolution gives the time between output times (in hours)
+     */
+    timeline_t model_times(
+            const vaccine::vaccine_t &vaccine_programme,
+            size_t minimal_resolution,
+            const boost::posix_time::ptime &starting_time );
+
+    /**
+     * \brief Run the model for a year using the passed solver work space
+     *
+     * @minimal_resolution gives the time resolution (precision) of the returned simulation (in hours)
+     */
+    cases_t infectionODE(
+            const Eigen::VectorXd &pop_vec, 
+            const Eigen::VectorXd &initial_infected, 
+            const double, const double,  
+            const Eigen::VectorXd &, 
+            const Eigen::MatrixXd &contact_regular, double, 
+            const vaccine::vaccine_t &vaccine_programme,
+            size_t minimal_resolution,
+            const boost::posix_time::ptime &starting_time,
+            ode::workspace_t<Eigen::VectorXd> &workspace );
+
+    /**
+     * \brief Run the model for multiple parameter sets at once
+     *
+     * The parameter sets share the population, vaccination programme and 
+     * infection delays. Each column of seed_vecs and s_profiles and each
+     * element of contact_regulars and transmissibilities belongs to one 
+     * parameter set. Parameter sets are integrated together in batches of
+     * lanes_per_batch (at least one).
+     */
+    batch_cases_t infectionODE_batch(
+            const Eigen::VectorXd &Npop,  
+            const Eigen::MatrixXd &seed_vecs, 
+            const double tlatent, const double tinfectious, 
+            const Eigen::MatrixXd &s_profiles, 
+            const std::vector<Eigen::MatrixXd> &contact_regulars, 
+            const Eigen::VectorXd &transmissibilities,
+            const vaccine::vaccine_t &vaccine_programme,
+            const std::vector<boost::posix_time::ptime> &times,
+            ode::workspace_t<Eigen::VectorXd> &workspace,
+            size_t lanes_per_batch = 64 );
+
     void days_to_weeks(double *, double *);
     void days_to_weeks_no_class(double *, double *);
 
@@ -79,12 +186,23 @@ namespace flu
     Eigen::MatrixXd days_to_weeks_11AG(const cases_t &simulation,
         const Eigen::MatrixXd &mapping, size_t no_data);
 
-    /// Returns (simplified) log likelihood of one prediction
+    /**
+     * \brief Returns (simplified) log likelihood of one prediction
+     *
+     * Sums the binomial probability of the number of influenza cases among 
+     * the ILI cases times the binomial probability of the confirmed samples, 
+     * over all possible numbers of influenza cases. The terms are evaluated 
+     * in log space, starting from the largest and updated by their ratios.
+     * Terms are skipped once the remaining terms sum to less than 
+     * relative_threshold times the largest term, so the log likelihood is 
+     * underestimated by at most 2*relative_threshold. With a threshold of 
+     * zero all terms are included.
+     */
     long double binomial_log_likelihood( double epsilon, 
             size_t predicted, double population_size, 
             int ili_cases, int ili_monitored,
             int confirmed_positive, int confirmed_samples, 
-            int depth );
+            double relative_threshold = 1e-12 );
 
     double binomial_log_likelihood_year(const Eigen::VectorXd &eps, 
             const Eigen::MatrixXd &result_by_week,
@@ -100,12 +218,92 @@ namespace flu
             int confirmed_positive, int confirmed_samples, 
             int depth = 2 );
 
+    /**
+     * \brief Upper bound of log_likelihood over all possible predictions
+     *
+     * Used to bound the log likelihood of weeks that have not been 
+     * simulated yet.
+     */
+    long double log_likelihood_upper_bound( double epsilon, double psi, 
+            int ili_cases, int ili_monitored,
+            int confirmed_positive, int confirmed_samples, 
+            int depth = 2 );
+
     double log_likelihood_hyper_poisson(const Eigen::VectorXd &eps, 
             double psi, const Eigen::MatrixXd &result_by_week,
             const Eigen::MatrixXi &ili, const Eigen::MatrixXi &mon_pop, 
             const Eigen::MatrixXi &n_pos, const Eigen::MatrixXi &n_samples, 
             const Eigen::VectorXd &pop_5AG_RCGP, int depth);
 
+    /**
+     * \brief Log likelihood of the ILI and confirmation data, compiled once
+     *
+     * The data is fixed during inference. The terms of each week and age 
+     * group that only depend on the data (and a table of logs of the counts)
+     * are computed once, and weeks and age groups without a monitored 
+     * population, which contribute a constant, are evaluated once. Gives the
+     * same result as log_likelihood_hyper_poisson (up to rounding), unless
+     * the terms are summed in double precision (see likelihood::summation_t), 
+     * which is much faster than pairwise sums in long double.
+     */
+    class compiled_likelihood_t
+    {
+        public:
+            compiled_likelihood_t( const Eigen::MatrixXi &ili, 
+                    const Eigen::MatrixXi &mon_pop, 
+                    const Eigen::MatrixXi &n_pos, 
+                    const Eigen::MatrixXi &n_samples, 
+                    const Eigen::VectorXd &pop_RCGP, int depth, 
+                    likelihood::summation_t summation = 
+                        likelihood::COMPENSATED );
+
+            /// Total log likelihood of the predicted cases by week
+            double operator()( const Eigen::VectorXd &eps, double psi, 
+                    const Eigen::MatrixXd &result_by_week ) const;
+
+            /// Log likelihood of one week and age group
+            long double operator()( size_t week, size_t group, 
+                    double epsilon, double psi, size_t predicted ) const;
+
+            /// Upper bound of the log likelihood of one week and age group
+            long double upper_bound( size_t week, size_t group, 
+                    double epsilon, double psi ) const;
+
+        private:
+            struct cell_t
+            {
+                likelihood::cell_terms_t terms;
+                bool constant = false;
+                long double value = 0;
+            };
+
+            /// Logs of the observation parameters, the same for all weeks
+            struct observation_logs_t
+            {
+                observation_logs_t( double epsilon, double psi );
+
+                double epsilon, one_minus_epsilon, psi;
+            };
+
+            long double log_likelihood_monitored( 
+                    const likelihood::cell_terms_t &terms, 
+                    const observation_logs_t &observation_logs,
+                    double epsilon, double psi, int Z_in_mon ) const;
+
+            long double cell_log_likelihood( const cell_t &cell, 
+                    double population_size,
+                    const observation_logs_t &observation_logs,
+                    double epsilon, double psi, size_t predicted ) const;
+
+            size_t no_weeks;
+            Eigen::VectorXd population_sizes;
+            int depth;
+            likelihood::summation_t summation;
+            likelihood::log_table_t logs;
+            /// By age group, then by week
+            std::vector<cell_t> cells;
+    };
+
     /**
      * \brief Return the log prior probability of the proposed parameters - current parameters
      *
@@ -2,26 +2,113 @@
 #define FLU_ODE_H
 
 #include<array>
+#include<utility>
 
 //#include "rcppwrap.h"
 #include<Eigen/Core>
 
 namespace ode {
-    template<typename ODE_FUNC>
-        inline Eigen::VectorXd step( Eigen::VectorXd &&y, ODE_FUNC &ode_func,
+    /**
+     * \brief Take one (explicit Euler) step
+     *
+     * Works with dynamic as well as fixed size Eigen vectors.
+     */
+    template<typename VECTOR, typename ODE_FUNC>
+        inline VECTOR step( VECTOR &&y, ODE_FUNC &ode_func,
                 double &step_size, double &current_time, 
                 const double max_time )
         {
             auto dt = std::min( step_size, max_time - current_time );
-            y = y + dt*ode_func( y, current_time );
+            y += dt*ode_func( y, current_time );
             current_time += dt;
-            return y;
+            return std::forward<VECTOR>( y );
         }
 
-    template<typename ODE_FUNC>
-        inline Eigen::VectorXd rkf45_astep( Eigen::VectorXd &&y, 
-                ODE_FUNC &ode_func,
-                double &step_size, double &current_time, 
+    /// Available integration methods
+    enum method_t { EULER = 0, RKF45 = 1, DOPRI5 = 2 };
+
+    /**
+     * \brief Solver settings, step size state and statistics
+     *
+     * For the adaptive methods the tolerance is the allowed local error per 
+     * unit of time.
+     */
+    struct solver_state_t
+    {
+        method_t method = EULER;
+        double tolerance = 1.0;
+
+        /// Current (adapted) integration step size
+        double step_size = 0.25;
+
+        /// Number of accepted steps
+        size_t no_steps = 0;
+
+        /// Number of rejected (recomputed) steps of the adaptive methods
+        size_t no_rejected = 0;
+    };
+
+    /**
+     * \brief Scratch buffers and step size state of the solvers
+     *
+     * The solvers keep all their state in the passed work space, so 
+     * multiple solvers can run at the same time as long as each uses its own 
+     * work space (e.g. one per thread). The buffers are sized on first use and
+     * then reused, so that steps do not allocate.
+     */
+    template<typename VECTOR = Eigen::VectorXd>
+        struct workspace_t : public solver_state_t
+        {
+            EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+
+            workspace_t( double step_size = 0.25 ) 
+            {
+                this->step_size = step_size;
+            }
+
+            workspace_t( const solver_state_t &state ) 
+                : solver_state_t( state )
+            {}
+
+            VECTOR k1, k2, k3, k4, k5, k6, k7, y_tmp, err;
+
+            /**
+             * \brief Whether k1 holds the derivative at the current state
+             *
+             * Used by the first same as last (FSAL) property of DOPRI5. Needs 
+             * to be reset whenever the state or ode function changed 
+             * between steps.
+             */
+            bool fsal = false;
+
+            void resize( Eigen::Index size )
+            {
+                if (k1.size() != size)
+                {
+                    k1.resize( size );
+                    k2.resize( size );
+                    k3.resize( size );
+                    k4.resize( size );
+                    k5.resize( size );
+                    k6.resize( size );
+                    k7.resize( size );
+                    y_tmp.resize( size );
+                    err.resize( size );
+                    fsal = false;
+                }
+            }
+        };
+
+    /**
+     * \brief Take one adaptive Runge-Kutta-Fehlberg step
+     *
+     * The step size stored in the work space is adapted to the given 
+     * tolerance and reused for the next step.
+     */
+    template<typename VECTOR, typename ODE_FUNC, typename WORKSPACE>
+        inline VECTOR rkf45_astep( VECTOR &&y, 
+                ODE_FUNC &ode_func, WORKSPACE &ws,
+                double &current_time, 
                 const double max_time, const double tol = 1e-2 )
         {
             static const std::array<double, 4> tscale = 
@@ -36,21 +123,10 @@ namespace ode {
             static const std::array<double, 5> errscale = 
                 { 1.0/360, 128.0/4275, 2197.0/75240, 1.0/50, 2.0/55 };
             static const std::array<double, 4> yscale =
-                {25.0/216, 1408.0/2565, 2197.0/4101, 1.0/5};
+                {25.0/216, 1408.0/2565, 2197.0/4104, 1.0/5};
 
-            static Eigen::VectorXd k1, k2, k3, k4, k5, k6, err, y5;
-
-            if (k1.size() != y.size())
-            {
-                k1 = Eigen::VectorXd( y.size() );
-                k2 = k1;
-                k3 = k1;
-                k4 = k1;
-                k5 = k1;
-                k6 = k1;
-                err = k1;
-                y5 = k1;
-            }
+            ws.resize( y.size() );
+            auto &step_size = ws.step_size;
 
             auto max_step = max_time - current_time;
 
@@ -60,38 +136,41 @@ namespace ode {
             while( adapted )
             {
 
-                k1 = dt*ode_func(y, current_time);
-                k2 = dt*ode_func(
-                        y + tscale[0]*k1, 
+                ws.k1 = dt*ode_func(y, current_time);
+                ws.y_tmp = y + tscale[0]*ws.k1;
+                ws.k2 = dt*ode_func(ws.y_tmp, 
                         current_time + tscale[0]*dt);
-                k3 = dt*ode_func(
-                        y + k3scale[0]*k1+k3scale[1]*k2, 
+                ws.y_tmp = y + k3scale[0]*ws.k1+k3scale[1]*ws.k2;
+                ws.k3 = dt*ode_func(ws.y_tmp, 
                         current_time + tscale[1]*dt);
-                k4 = dt*ode_func(
-                        y + k4scale[0]*k1-k4scale[1]*k2+k4scale[2]*k3, 
+                ws.y_tmp = y + k4scale[0]*ws.k1-k4scale[1]*ws.k2+k4scale[2]*ws.k3;
+                ws.k4 = dt*ode_func(ws.y_tmp,
                         current_time + tscale[2]*dt);
-                k5 = dt*ode_func(
-                        y + k5scale[0]*k1-k5scale[1]*k2+k5scale[2]*k3-
-                        k5scale[3]*k4, 
+                ws.y_tmp = y + k5scale[0]*ws.k1-k5scale[1]*ws.k2+k5scale[2]*ws.k3-
+                        k5scale[3]*ws.k4;
+                ws.k5 = dt*ode_func(ws.y_tmp,
                         current_time + dt);
-                k6 = dt*ode_func(
-                        y - k6scale[0]*k1+k6scale[1]*k2-k6scale[2]*k3+
-                        k6scale[3]*k4-k6scale[4]*k5, 
+                ws.y_tmp = y - k6scale[0]*ws.k1+k6scale[1]*ws.k2-k6scale[2]*ws.k3+
+                        k6scale[3]*ws.k4-k6scale[4]*ws.k5;
+                ws.k6 = dt*ode_func(ws.y_tmp,
                         current_time + tscale[3]*dt);
 
-                err = ( errscale[0]*k1-errscale[1]*k3-errscale[2]*k4
-                        +errscale[3]*k5+errscale[4]*k6 );
+                ws.err = ( errscale[0]*ws.k1-errscale[1]*ws.k3-errscale[2]*ws.k4
+                        +errscale[3]*ws.k5+errscale[4]*ws.k6 );
 
                 auto s = std::min(
                         std::max(
-                            0.84*pow(tol*dt/err.norm(),0.25), 
+                            0.84*pow(tol*dt/ws.err.norm(),0.25), 
                             0.25)
                         , 5.0 );
 
-                if ((s > 1.5 || s < 0.9) && dt < max_step)
+                // Steps cut short at max_time are only redone when the
+                // error is too large
+                if (s < 0.9 || (s > 1.5 && dt < max_step))
                 {
                     step_size = 0.9*s*dt; 
                     dt = std::min( step_size, max_step );
+                    ++ws.no_rejected;
                 } else {
                     adapted = false;
                 }
@@ -105,8 +184,110 @@ namespace ode {
 
             //Rcpp::cout << dt << ", " << step_size << ", " << current_time << std::endl;
 
-            return y + yscale[0]*k1+yscale[1]*k3+yscale[2]*k4-
-                yscale[3]*k5;
+            y = y + yscale[0]*ws.k1+yscale[1]*ws.k3+yscale[2]*ws.k4-
+                yscale[3]*ws.k5;
+            ++ws.no_steps;
+            return std::forward<VECTOR>( y );
+        }
+
+    /**
+     * \brief Take one adaptive Dormand-Prince 5(4) step
+     *
+     * Uses the first same as last property: the derivative at the end of an 
+     * accepted step is reused as the first stage of the next step (see 
+     * workspace_t::fsal). The step size is controlled in the same way as for
+     * rkf45_astep.
+     */
+    template<typename VECTOR, typename ODE_FUNC, typename WORKSPACE>
+        inline VECTOR dopri5_astep( VECTOR &&y, 
+                ODE_FUNC &ode_func, WORKSPACE &ws,
+                double &current_time, 
+                const double max_time, const double tol = 1e-2 )
+        {
+            static const std::array<double, 6> c = 
+                { 1.0/5, 3.0/10, 4.0/5, 8.0/9, 1.0, 1.0 };
+            static const std::array<double, 1> a2 = { 1.0/5 };
+            static const std::array<double, 2> a3 = { 3.0/40, 9.0/40 };
+            static const std::array<double, 3> a4 = 
+                { 44.0/45, -56.0/15, 32.0/9 };
+            static const std::array<double, 4> a5 = 
+                { 19372.0/6561, -25360.0/2187, 64448.0/6561, -212.0/729 };
+            static const std::array<double, 5> a6 = 
+                { 9017.0/3168, -355.0/33, 46732.0/5247, 49.0/176, 
+                    -5103.0/18656 };
+            // Fifth order solution, also used for the last stage
+            static const std::array<double, 6> b = 
+                { 35.0/384, 0.0, 500.0/1113, 125.0/192, -2187.0/6784, 
+                    11.0/84 };
+            // Difference between fifth and fourth order solution
+            static const std::array<double, 7> e = 
+                { 71.0/57600, 0.0, -71.0/16695, 71.0/1920, 
+                    -17253.0/339200, 22.0/525, -1.0/40 };
+
+            ws.resize( y.size() );
+            auto &step_size = ws.step_size;
+
+            auto max_step = max_time - current_time;
+
+            if (!ws.fsal)
+            {
+                ws.k1 = ode_func(y, current_time);
+                ws.fsal = true;
+            }
+
+            while( true )
+            {
+                auto dt = std::min( step_size, max_step );
+
+                ws.y_tmp = y + dt*a2[0]*ws.k1;
+                ws.k2 = ode_func(ws.y_tmp, current_time + c[0]*dt);
+                ws.y_tmp = y + dt*(a3[0]*ws.k1+a3[1]*ws.k2);
+                ws.k3 = ode_func(ws.y_tmp, current_time + c[1]*dt);
+                ws.y_tmp = y + dt*(a4[0]*ws.k1+a4[1]*ws.k2+a4[2]*ws.k3);
+                ws.k4 = ode_func(ws.y_tmp, current_time + c[2]*dt);
+                ws.y_tmp = y + dt*(a5[0]*ws.k1+a5[1]*ws.k2+a5[2]*ws.k3
+                        +a5[3]*ws.k4);
+                ws.k5 = ode_func(ws.y_tmp, current_time + c[3]*dt);
+                ws.y_tmp = y + dt*(a6[0]*ws.k1+a6[1]*ws.k2+a6[2]*ws.k3
+                        +a6[3]*ws.k4+a6[4]*ws.k5);
+                ws.k6 = ode_func(ws.y_tmp, current_time + c[4]*dt);
+                // Fifth order solution
+                ws.y_tmp = y + dt*(b[0]*ws.k1+b[2]*ws.k3+b[3]*ws.k4
+                        +b[4]*ws.k5+b[5]*ws.k6);
+                ws.k7 = ode_func(ws.y_tmp, current_time + c[5]*dt);
+
+                ws.err = dt*(e[0]*ws.k1+e[2]*ws.k3+e[3]*ws.k4
+                        +e[4]*ws.k5+e[5]*ws.k6+e[6]*ws.k7);
+
+                auto s = std::min(
+                        std::max(
+                            0.84*pow(tol*dt/ws.err.norm(),0.25), 
+                            0.25)
+                        , 5.0 );
+
+                if (s < 0.9)
+                {
+                    // Reject step
+                    step_size = 0.9*s*dt; 
+                    ++ws.no_rejected;
+                    continue;
+                }
+
+                // Accept step
+                if (dt == max_step)
+                    current_time = max_time;
+                else {
+                    current_time += dt;
+                    if (s > 1.5)
+                        step_size = 0.9*s*dt;
+                }
+                break;
+            }
+
+            y = ws.y_tmp;
+            ws.k1.swap( ws.k7 );
+            ++ws.no_steps;
+            return std::forward<VECTOR>( y );
         }
 }
 
@@ -1,4 +1,5 @@
 #include "proposal.h"
+#include <cmath>
 #include <boost/numeric/ublas/matrix.hpp>
 
 #define twopi 6.283185
@@ -26,6 +27,23 @@ namespace flu {
             return cov + (1.0/(n-1.0))*((v-means)*((v-means).transpose())) 
                 - (1.0/n)*cov;
         }
+
+        void rankOneUpdate( Eigen::MatrixXd &chol, Eigen::VectorXd &v )
+        {
+            const auto dim = v.size();
+            for (int k = 0; k < dim; ++k)
+            {
+                auto r = std::hypot( chol(k,k), v[k] );
+                auto c = r/chol(k,k);
+                auto s = v[k]/chol(k,k);
+                chol(k,k) = r;
+                for (int i = k+1; i < dim; ++i)
+                {
+                    chol(i,k) = (chol(i,k) + s*v[i])/c;
+                    v[i] = c*v[i] - s*chol(i,k);
+                }
+            }
+        }
         
         proposal_state_t initialize( size_t dim )
         {
@@ -54,6 +72,9 @@ namespace flu {
                     Eigen::MatrixXd::Identity(dim,dim))
                 .matrixL();
 
+            state.deviation = Eigen::VectorXd::Zero( dim );
+            state.llt = Eigen::LLT<Eigen::MatrixXd>( dim );
+
             state.m = 2.38/sqrt(dim);
             state.delta = state.m/100;
             state.lambda = 0.001/sqrt(dim);
@@ -73,9 +94,10 @@ namespace flu {
                 ++state.no_accepted;
                 if (k>=100)
                     state.adaptive_scaling
-                        += 0.766*state.conv_scaling;
+                        += (1 - state.target_acceptance)*state.conv_scaling;
                 if (state.adaptive_step)
-                    state.m += 2.3*state.delta/sqrt(state.no_adaptive);
+                    state.m += state.m_accept_step*
+                        state.delta/sqrt(state.no_adaptive);
             }
             else {
                 if (state.adaptive_step)
@@ -83,7 +105,7 @@ namespace flu {
             
                 if (k>=100)
                     state.adaptive_scaling
-                        -= 0.234*state.conv_scaling;
+                        -= state.target_acceptance*state.conv_scaling;
 
                 // In the beginning we train state.lambda as well
                 // because we need a certain number of accepted
@@ -98,23 +120,54 @@ namespace flu {
             return state;
         }
 
+        void set_target_acceptance( proposal_state_t &state, double rate )
+        {
+            state.target_acceptance = rate;
+            state.m_accept_step = (1 - rate)/rate;
+        }
+
         proposal_state_t update( proposal_state_t&& state,
                 const Eigen::VectorXd &parameters,
                 int k )
         {
             /*update of the variance-covariance matrix and the mean vector*/
-            state.means_parameters = updateMeans( 
-                    state.means_parameters, parameters, k );
-            state.emp_cov_matrix = updateCovariance( state.emp_cov_matrix,
-                    parameters, state.means_parameters, k );
+            // Same as updateMeans and updateCovariance, but in place
+            const double n = k;
+            if (k==1)
+            {
+                state.means_parameters = parameters;
+                state.emp_cov_matrix.setZero();
+            } else {
+                state.means_parameters += 1.0/n*
+                    (parameters - state.means_parameters);
+                state.deviation = parameters - state.means_parameters;
+                state.emp_cov_matrix *= 1.0 - 1.0/n;
+                state.emp_cov_matrix.noalias() += (1.0/(n-1.0))*
+                    state.deviation*state.deviation.transpose();
+            }
+
             /*adjust variance for MCMC parameters*/
-            /*if(k%100==0)
-            {*/
-                state.chol_emp_cov = Eigen::LLT<Eigen::MatrixXd>(
-                        state.emp_cov_matrix).matrixL();
+            // The new covariance is (1-1/n)*old + 1/(n-1)*deviation*deviation^T,
+            // so the Cholesky factor can be found with a rank one update. 
+            // The covariance is singular for the first samples, then we (and 
+            // periodically afterwards) do a full decomposition
+            const auto dim = parameters.size();
+            ++state.no_rank_updates;
+            if (k <= dim + 1 || 
+                    (state.refactorisation_interval > 0 && 
+                     state.no_rank_updates >= state.refactorisation_interval) 
+                    || !(state.chol_emp_cov.diagonal().array() > 0).all())
+            {
+                state.llt.compute( state.emp_cov_matrix );
+                state.chol_emp_cov = state.llt.matrixL();
+                state.no_rank_updates = 0;
+            } else {
+                state.chol_emp_cov *= sqrt(1.0 - 1.0/n);
+                state.deviation *= sqrt(1.0/(n-1.0));
+                rankOneUpdate( state.chol_emp_cov, state.deviation );
+            }
 
-                state.conv_scaling/=1.005;
-            //}
+            state.conv_scaling/=1.005;
             return state;
         }
 
@@ -138,7 +191,7 @@ namespace flu {
         Eigen::VectorXd haario( size_t k,
                 const Eigen::VectorXd &current, 
                 const Eigen::MatrixXd &chol_de, 
-                double epsilon )
+                double epsilon, rng::rng_t &rng )
         {
             auto proposed = Eigen::VectorXd( current.size() );
             auto normal_draw = Eigen::VectorXd( current.size() );
@@ -156,8 +209,8 @@ namespace flu {
             /*drawing of the needed N(0,1) samples using Box-Muller*/
             for(int i=0;i<current.size();i++)
             {
-                unif1=R::runif(0,1);
-                unif2=R::runif(0,1);
+                unif1=rng.uniform();
+                unif2=rng.uniform();
                 normal_draw[i]=sqrt(-2*log(unif1))*sin(twopi*unif2); /*3 = sqrt(9)*/
                 /*drawing of the needed N(0,1) samples using Box-Muller*/
                 normal_add_draw[i]=sqrt(-2*log(unif1))*cos(twopi*unif2);
@@ -182,7 +235,7 @@ namespace flu {
         Eigen::VectorXd haario_adapt_scale( const Eigen::VectorXd &current, 
                 const Eigen::MatrixXd &chol_de, 
                 const Eigen::MatrixXd &chol_ini, 
-                double beta, double adapt_scale )
+                double beta, double adapt_scale, rng::rng_t &rng )
         {
             auto proposed = Eigen::VectorXd( current.size() );
             auto normal_draw = Eigen::VectorXd( current.size() );
@@ -202,8 +255,8 @@ namespace flu {
             /*drawing of the needed N(0,1) samples using Box-Muller*/
             for(int i=0;i<current.size();i++)
             {
-                unif1=R::runif(0,1);
-                unif2=R::runif(0,1);
+                unif1=rng.uniform();
+                unif2=rng.uniform();
                 normal_draw[i]=adapt_scale*2.38/sqrtd*sqrt(-2*log(unif1))*sin(twopi*unif2); /*3 = sqrt(9)*/
                 /*drawing of the needed N(0,1) samples using Box-Muller*/
                 normal_add_draw[i]=sqrt(-2*log(unif1))*cos(twopi*unif2);
@@ -227,16 +280,16 @@ namespace flu {
         /// The sherlock 2010 algorithm 6B
         Eigen::VectorXd sherlock( size_t k, 
                 const Eigen::VectorXd &current, 
-                proposal_state_t &state ) {
+                proposal_state_t &state, rng::rng_t &rng ) {
 
             auto normal_draw = Eigen::VectorXd( current.size() );
  
             for(int i=0;i<current.size();i++)
             {
-                normal_draw[i]=R::rnorm(0,1);
+                normal_draw[i]=rng.normal();
             }
 
-            if (state.no_accepted<100 || R::runif(0,1)<0.05)
+            if (state.no_accepted<100 || rng.uniform()<0.05)
             {
                 state.adaptive_step = false;
 
@@ -250,6 +303,35 @@ namespace flu {
             }
         }
 
+        block_t initialize( const std::vector<size_t> &indices )
+        {
+            block_t block;
+            block.indices = indices;
+            block.state = initialize( indices.size() );
+            return block;
+        }
+
+        Eigen::VectorXd block_parameters( const block_t &block,
+                const Eigen::VectorXd &parameters )
+        {
+            Eigen::VectorXd values( block.indices.size() );
+            for (size_t i = 0; i < block.indices.size(); ++i)
+                values[i] = parameters[block.indices[i]];
+            return values;
+        }
+
+        Eigen::VectorXd sherlock( size_t k, 
+                const Eigen::VectorXd &current, 
+                block_t &block, rng::rng_t &rng )
+        {
+            auto values = sherlock( k, block_parameters( block, current ),
+                    block.state, rng );
+            Eigen::VectorXd proposed = current;
+            for (size_t i = 0; i < block.indices.size(); ++i)
+                proposed[block.indices[i]] = values[i];
+            return proposed;
+        }
+
 
     }
 }
@@ -7,6 +7,7 @@
 #include <boost/numeric/ublas/matrix.hpp>
 
 #include "model.h"
+#include "rng.h"
 namespace flu {
     /**
      * \brief Functions to keep track of proposal distribution
@@ -27,6 +28,15 @@ namespace flu {
                 const Eigen::VectorXd &means, 
                 size_t n );
 
+        /**
+         * \brief Rank one update of a lower triangular Cholesky factor
+         *
+         * Updates chol in place, such that chol*chol^T becomes 
+         * chol*chol^T + v*v^T. The diagonal of chol needs to be positive. 
+         * The passed vector is used as work space and overwritten.
+         */
+        void rankOneUpdate( Eigen::MatrixXd &chol, Eigen::VectorXd &v );
+
         namespace bu = boost::numeric::ublas;
         struct proposal_state_t
         {
@@ -36,6 +46,20 @@ namespace flu {
 
             Eigen::MatrixXd cholesky_I; // Cholesky decomposition of identity matrix
 
+            //! Work space for the online updates
+            Eigen::VectorXd deviation;
+            Eigen::LLT<Eigen::MatrixXd> llt;
+
+            /**
+             * \brief Number of updates after which chol_emp_cov is 
+             * recomputed from emp_cov_matrix (0 for never)
+             *
+             * In between it is updated with rank one updates, this guards 
+             * against accumulating rounding errors.
+             */
+            size_t refactorisation_interval;
+            size_t no_rank_updates;
+
             double adaptive_scaling;
             double conv_scaling;
 
@@ -47,6 +71,18 @@ namespace flu {
             double delta;
             double lambda;
 
+            /**
+             * \brief Acceptance rates targeted by the adaptation
+             *
+             * adaptive_scaling is adapted towards target_acceptance. m grows
+             * by m_accept_step times as much after an accepted adaptive step 
+             * as it shrinks after a rejected one, so it targets an 
+             * acceptance rate of 1/(1 + m_accept_step). The defaults suit 
+             * random walk Metropolis (see set_target_acceptance).
+             */
+            double target_acceptance;
+            double m_accept_step;
+
             proposal_state_t() {
                 adaptive_scaling = 0.3;
                 conv_scaling = 0.001;
@@ -54,6 +90,12 @@ namespace flu {
                 no_accepted = 0;
                 no_adaptive = 0;
                 adaptive_step = false;
+
+                refactorisation_interval = 1000;
+                no_rank_updates = 0;
+
+                target_acceptance = 0.234;
+                m_accept_step = 2.3;
             }
         };
 
@@ -67,6 +109,9 @@ namespace flu {
         proposal_state_t accepted( proposal_state_t&& state, 
                 bool accepted, int k );
 
+        /// Adapt the scaling towards the given acceptance rate instead
+        void set_target_acceptance( proposal_state_t &state, double rate );
+
         proposal_state_t update( proposal_state_t&& state,
                 const parameter_set &parameters,
                 int k );
@@ -75,17 +120,46 @@ namespace flu {
         Eigen::VectorXd haario( size_t k, 
                 const Eigen::VectorXd &current, 
                 const Eigen::MatrixXd &chol_de, 
-                double epsilon );
+                double epsilon, 
+                rng::rng_t &rng = rng::default_rng() );
 
         Eigen::VectorXd haario_adapt_scale( const Eigen::VectorXd &current, 
                 const Eigen::MatrixXd &chol_de, 
                 const Eigen::MatrixXd &chol_ini, 
-                double beta, double adapt_scale );
+                double beta, double adapt_scale, 
+                rng::rng_t &rng = rng::default_rng() );
 
         /// The sherlock 2010 algorithm 6B
         Eigen::VectorXd sherlock( size_t k, 
                 const Eigen::VectorXd &current, 
-                proposal_state_t &state );
+                proposal_state_t &state, 
+                rng::rng_t &rng = rng::default_rng() );
+
+        /**
+         * \brief Block of parameters that are proposed together
+         *
+         * Each block has its own proposal state, so that parameters with
+         * a very different scale or cost can be updated separately
+         * (Metropolis within Gibbs).
+         */
+        struct block_t
+        {
+            //! Indices of the parameters in the block
+            std::vector<size_t> indices;
+            proposal_state_t state;
+        };
+
+        block_t initialize( const std::vector<size_t> &indices );
+
+        /// Values of the parameters in the block
+        Eigen::VectorXd block_parameters( const block_t &block,
+                const Eigen::VectorXd &parameters );
+
+        /// The sherlock algorithm applied to the parameters in the block only
+        Eigen::VectorXd sherlock( size_t k, 
+                const Eigen::VectorXd &current, 
+                block_t &block, 
+                rng::rng_t &rng = rng::default_rng() );
     }
 }
 #endif
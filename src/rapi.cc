@@ -84,6 +84,65 @@ Eigen::MatrixXd updateCovariance( Eigen::MatrixXd cov,
     return flu::proposal::updateCovariance( cov, v, means, n );
 }
 
+//' Update the Cholesky factor of the proposal covariance for each sample, for testing purposes
+//'
+//' The factor is updated as during the mcmc: full decompositions for the first (singular) covariance matrices and every refactorisation_interval samples, with rank one updates in between. After each sample the factor is compared to the full decomposition of the covariance matrix.
+//'
+//' @param samples Matrix with a (posterior) sample in each row
+//' @param refactorisation_interval Number of rank one updates after which the factor is recomputed (0 for never)
+//' @return A list with the final factor (chol) and covariance matrix (cov), and for each sample the largest difference between the factor and the full decomposition, relative to the largest element of the decomposition (differences). The difference is NaN when the covariance matrix can not be decomposed.
+//'
+// [[Rcpp::export(name=".updateCholesky")]]
+Rcpp::List updateCholesky( Eigen::MatrixXd samples, 
+        size_t refactorisation_interval = 1000 )
+{
+    auto state = flu::proposal::initialize( samples.cols() );
+    state.refactorisation_interval = refactorisation_interval;
+
+    Eigen::VectorXd differences( samples.rows() );
+    for (int i = 0; i < samples.rows(); ++i)
+    {
+        state = flu::proposal::update( std::move(state), 
+                samples.row(i).transpose(), i + 1 );
+        Eigen::LLT<Eigen::MatrixXd> llt( state.emp_cov_matrix );
+        if (llt.info() != Eigen::Success)
+        {
+            differences[i] = std::numeric_limits<double>::quiet_NaN();
+            continue;
+        }
+        Eigen::MatrixXd reference = llt.matrixL();
+        differences[i] = (state.chol_emp_cov - reference).cwiseAbs().maxCoeff()/
+            reference.cwiseAbs().maxCoeff();
+    }
+
+    Rcpp::List result;
+    result["chol"] = Rcpp::wrap( state.chol_emp_cov );
+    result["cov"] = Rcpp::wrap( state.emp_cov_matrix );
+    result["differences"] = Rcpp::wrap( differences );
+    return result;
+}
+
+//' Draw uniform numbers from independent streams of the counter based generator
+//'
+//' The generator is seeded once from R's random number generator.
+//' @param n The number of draws per stream
+//' @param no_streams The number of streams
+//' @return A matrix with the draws of each stream in its columns
+//'
+// [[Rcpp::export(name=".counterUniform")]]
+Eigen::MatrixXd counterUniform( size_t n, size_t no_streams = 1 )
+{
+    flu::rng::rng_t rng( flu::rng::seed_from_r(), 0 );
+    Eigen::MatrixXd draws( n, no_streams );
+    for (size_t j = 0; j < no_streams; ++j)
+    {
+        auto stream = rng.stream( j );
+        for (size_t i = 0; i < n; ++i)
+            draws(i,j) = stream.uniform();
+    }
+    return draws;
+}
+
 //' Convert given week in given year into an exact date corresponding to the Monday of that week
 //'
 //' @param week The number of the week we need the date of
@@ -161,7 +220,7 @@ Rcpp::DataFrame runSEIRModel(
     {
         times[i] = 
                 Rcpp::Datetime(
-            bt::to_iso_extended_string( result.times[i] ),
+            bt::to_iso_extended_string( result.times.time(i) ),
             "%Y-%m-%dT%H:%M:%OS");
     }
 
@@ -192,7 +251,9 @@ Rcpp::DataFrame runSEIRModel(
 //' @param transmissibility The transmissibility of the strain
 //' @param infection_delays Vector with the time of latent infection and time infectious
 //' @param dates Dates to return values for.
-//' @return A data frame with number of new cases after each interval during the year
+//' @param method Integration method: "euler" (fixed step), "rkf45" or "dopri5" (adaptive step size)
+//' @param tolerance Tolerance of the adaptive integration methods (allowed local error in number of people per day)
+//' @return A data frame with number of new cases after each interval during the year. The number of integration steps taken is stored in its "steps" attribute.
 //'
 // [[Rcpp::export(name="infectionODEs.cpp")]]
 Rcpp::DataFrame infectionODEs(
@@ -203,7 +264,9 @@ Rcpp::DataFrame infectionODEs(
         Eigen::VectorXd susceptibility, 
         double transmissibility, 
         Eigen::VectorXd infection_delays, 
-        Rcpp::DateVector dates )
+        Rcpp::DateVector dates,
+        std::string method = "euler",
+        double tolerance = 1.0 )
 {
 
     Eigen::VectorXd popv(population.size());
@@ -239,11 +302,15 @@ Rcpp::DataFrame infectionODEs(
         datesC.push_back( date_to_ptime( d ) );
     }
 
+    ode::workspace_t<Eigen::VectorXd> workspace( 0.25 ); // 6 hours
+    workspace.method = ode::as_method( method );
+    workspace.tolerance = tolerance;
+
     auto result = flu::infectionODE(
         popv, initial_infected, 
         infection_delays[0], infection_delays[1],
         susceptibility, contact_matrix, transmissibility,
-        vaccine_calendar, datesC );
+        vaccine_calendar, datesC, workspace );
 
     Rcpp::List resultList( dim + 1 );
     Rcpp::CharacterVector columnNames;
@@ -253,7 +320,7 @@ Rcpp::DataFrame infectionODEs(
     auto times = Rcpp::DateVector(result.times.size());
     for ( size_t i = 0; i < result.times.size(); ++i )
     {
-        times[i] = ptime_to_date( result.times[i] );
+        times[i] = ptime_to_date( result.times.time(i) );
         if (dates[i+1]!=times[i])
         {
             ::Rf_error("Dates do not match");
@@ -277,10 +344,128 @@ Rcpp::DataFrame infectionODEs(
     auto df = Rcpp::DataFrame(resultList);
 
     df.attr("names") = columnNames;
+    df.attr("steps") = (double)workspace.no_steps;
 
     return df;
 }
 
+//' Run the SEIR model for multiple sets of parameters at once
+//'
+//' All parameter sets share the population, vaccine calendar and infection delays.
+//'
+//' @param population The population size of the different age groups, subdivided into risk groups 
+//' @param initial_infected Matrix with the corresponding number of initially infected, one column for each parameter set
+//' @param vaccine_calendar A vaccine calendar valid for that year
+//' @param contact_matrices List with the contact matrix of each parameter set
+//' @param susceptibility Matrix with susceptibilities of each age group, one column for each parameter set
+//' @param transmissibility Vector with the transmissibility of each parameter set
+//' @param infection_delays Vector with the time of latent infection and time infectious
+//' @param dates Dates to return values for.
+//' @param method Integration method: "euler" (fixed step), "rkf45" or "dopri5" (adaptive step size)
+//' @param tolerance Tolerance of the adaptive integration methods (allowed local error in number of people per day)
+//' @return A three dimensional array with the number of new cases by time interval, group and parameter set. The number of integration steps taken is stored in its "steps" attribute.
+//'
+// [[Rcpp::export(name="infectionODEs_batch.cpp")]]
+Rcpp::NumericVector infectionODEs_batch(
+        Rcpp::NumericVector population,
+        Eigen::MatrixXd initial_infected, 
+        flu::vaccine::vaccine_t vaccine_calendar,
+        Rcpp::List contact_matrices,
+        Eigen::MatrixXd susceptibility, 
+        Eigen::VectorXd transmissibility, 
+        Eigen::VectorXd infection_delays, 
+        Rcpp::DateVector dates,
+        std::string method = "euler",
+        double tolerance = 1.0 )
+{
+    Eigen::VectorXd popv(population.size());
+    for (int i = 0; i < population.size(); ++i)
+        popv[i] = population[i];
+
+    std::vector<Eigen::MatrixXd> contacts;
+    for (int i = 0; i < contact_matrices.size(); ++i)
+        contacts.push_back( 
+                Rcpp::as<Eigen::MatrixXd>( contact_matrices[i] ) );
+
+    const size_t no_samples = contacts.size();
+    if (no_samples == 0)
+        ::Rf_error("No contact matrices provided");
+    const size_t nag = contacts[0].cols();
+    for (auto &contact_matrix : contacts) 
+    {
+        if (contact_matrix.cols() != contact_matrix.rows()) 
+            ::Rf_error("Contact matrix should be a square matrix");
+        else if (contact_matrix.cols() != nag)
+            ::Rf_error("All contact matrices should use the same number of age groups.");
+    }
+    if (susceptibility.rows() != nag)
+        ::Rf_error("Contact matrix and susceptibility matrix should use the same number of age groups.");
+    else if (nag*3 < popv.size()) 
+        ::Rf_error("Maximum of three risk groups are expected. Population vector should have the initial popv of each group");
+    else if (popv.size()%nag!=0)
+        ::Rf_error("Population groups and contact_matrix size mismatch");
+    else if (popv.size() != initial_infected.rows())
+        ::Rf_error("Population vector and initial_infected should have the same number of rows");
+    else if (initial_infected.cols() != no_samples ||
+            susceptibility.cols() != no_samples ||
+            transmissibility.size() != no_samples)
+        ::Rf_error("Each parameter set needs a contact matrix, initial_infected, susceptibility and transmissibility");
+
+    auto dim = popv.size();
+    if (nag != popv.size()/3)
+    {
+        popv.conservativeResize(nag*3);
+        initial_infected.conservativeResize(nag*3, no_samples);
+        for( size_t i = dim; i<popv.size(); ++i)
+        {
+            popv[i] = 0;
+            initial_infected.row(i).setZero();
+        }
+    }
+
+    std::vector<boost::posix_time::ptime> datesC;
+    for( auto & d : dates )
+    {
+        datesC.push_back( date_to_ptime( d ) );
+    }
+
+    ode::workspace_t<Eigen::VectorXd> workspace( 0.25 ); // 6 hours
+    workspace.method = ode::as_method( method );
+    workspace.tolerance = tolerance;
+
+    auto result = flu::infectionODE_batch(
+        popv, initial_infected, 
+        infection_delays[0], infection_delays[1],
+        susceptibility, contacts, transmissibility,
+        vaccine_calendar, datesC, workspace );
+
+    const size_t no_times = result.times.size();
+    Rcpp::NumericVector cases( no_times*dim*no_samples );
+    for (size_t k = 0; k < no_samples; ++k)
+        for (size_t j = 0; j < dim; ++j)
+            for (size_t i = 0; i < no_times; ++i)
+                cases[i + no_times*(j + dim*k)] = result.cases[k](i,j);
+    cases.attr("dim") = Rcpp::IntegerVector::create( (int)no_times, 
+            (int)dim, (int)no_samples );
+
+    Rcpp::CharacterVector timeNames;
+    for (size_t i = 0; i < no_times; ++i)
+        timeNames.push_back( boost::gregorian::to_iso_extended_string( 
+                    result.times.time(i).date() ) );
+    Rcpp::CharacterVector columnNames;
+    if (population.hasAttribute("names"))
+        columnNames = population.attr("names");
+    else
+        for (int i=0; i<dim; ++i)
+            columnNames.push_back( 
+                "V" + boost::lexical_cast<std::string>( i+1 ) );
+    cases.attr("dimnames") = Rcpp::List::create( timeNames, columnNames, 
+            R_NilValue );
+    cases.attr("steps") = (double)workspace.no_steps;
+
+    return cases;
+}
+
 //' Returns log likelihood of the predicted number of cases given the data for that week
 //'
 //' The model results in a prediction for the given number of new cases in a certain age group and for a certain week. This function calculates the likelihood of that given the data on reported Influenza Like Illnesses and confirmed samples.
@@ -308,6 +493,30 @@ double log_likelihood( double epsilon, double psi,
             confirmed_positive, confirmed_samples, 2 );
 }
 
+//' Returns the binomial log likelihood of the predicted number of cases given the data for that week
+//'
+//' The simplified (binomial) observation model: the number of Influenza cases among the ILI cases is binomial with probability predicted/(epsilon*population_size), and the confirmed samples are drawn from the ILI cases. Terms that contribute less than relative_threshold (relative to the largest term) are skipped, which underestimates the log likelihood by at most 2*relative_threshold.
+//'
+//' @param epsilon Parameter for the probability distribution
+//' @param predicted Number of cases predicted by your model
+//' @param population_size The total population size in the relevant age group
+//' @param ili_cases The number of Influenza Like Illness cases
+//' @param confirmed_positive The number of samples positive for the Influenza strain
+//' @param confirmed_samples Number of samples tested for the Influenza strain
+//' @param relative_threshold Relative size below which terms are skipped. Zero includes all terms.
+//'
+// [[Rcpp::export(name=".binomial_log_likelihood_cases")]]
+double binomial_log_likelihood( double epsilon, 
+        size_t predicted, double population_size, 
+        int ili_cases, int confirmed_positive, int confirmed_samples,
+        double relative_threshold = 1e-12 )
+{
+    return flu::binomial_log_likelihood( epsilon, 
+            predicted, population_size,
+            ili_cases, 0,
+            confirmed_positive, confirmed_samples, relative_threshold );
+}
+
 //' Returns log likelihood of the predicted number of cases given the data
 //'
 //' The model results in a prediction for the number of new cases in a certain age group and for a certain week. This function sum the log likelihood for the predicted cases for each week and age group given the data on reported Influenza Like Illnesses and confirmed samples.
@@ -342,6 +551,35 @@ double total_log_likelihood(  Eigen::VectorXd epsilon, double psi,
     return ll;
 }
 
+//' Returns log likelihood of the predicted number of cases given the data, evaluated as during inference
+//'
+//' Same as \link{log_likelihood_cases}, but the terms that only depend on the data are computed first (as done once per inference run) and the terms of each week and age group are summed with the given method. Mainly used for testing.
+//'
+//' @param epsilon Parameter for the probability distribution by age group
+//' @param psi Parameter for the probability distribution
+//' @param predicted Number of cases predicted by your model for each week and age group
+//' @param population_size The total population size in the age groups 
+//' @param ili_cases The number of Influenza Like Illness cases by week and age group
+//' @param ili_monitored The size of the population monitored for ILI  by week and age group
+//' @param confirmed_positive The number of samples positive for the Influenza strain  by week and age group
+//' @param confirmed_samples Number of samples tested for the Influenza strain  by week and age group
+//' @param depth Depth/precision of the approximation. In general the a value of 2 is used. Higher is more precise.
+//' @param summation How the terms are summed: "long_double" (the reference) or "compensated"
+//'
+// [[Rcpp::export(name=".compiled_log_likelihood_cases")]]
+double compiled_log_likelihood(  Eigen::VectorXd epsilon, double psi, 
+        Eigen::MatrixXi predicted, Eigen::VectorXi population_size, 
+        Eigen::MatrixXi ili_cases, Eigen::MatrixXi ili_monitored,
+        Eigen::MatrixXi confirmed_positive, Eigen::MatrixXi confirmed_samples, int depth = 2,
+        std::string summation = "compensated" )
+{
+    const flu::compiled_likelihood_t log_likelihood_f( ili_cases, 
+            ili_monitored, confirmed_positive, confirmed_samples,
+            population_size.cast<double>(), depth, 
+            flu::likelihood::as_summation( summation ) );
+    return log_likelihood_f( epsilon, psi, predicted.cast<double>() );
+}
+
 
 //' Run an ODE model with the runge-kutta solver for testing purposes
 //'
@@ -354,6 +592,7 @@ Eigen::MatrixXd runPredatorPrey(double step_size = 0.1, double h_step=0.01)
     Eigen::MatrixXd result(201,3);
     double ct = 0;
     Eigen::VectorXd y(2); y[0] = 10.0; y[1] = 5.0;
+    ode::workspace_t<Eigen::VectorXd> workspace( h_step );
     size_t row_count = 0;
     while( ct <= 20.01 )
     {
@@ -371,7 +610,7 @@ Eigen::MatrixXd runPredatorPrey(double step_size = 0.1, double h_step=0.01)
                 return dy;
             };
             y = ode::rkf45_astep( std::move(y), ode_func,
-                        h_step, t, step_size, 1.0e-12 );
+                        workspace, t, step_size, 1.0e-12 );
         }
         ct += step_size;
         ++row_count;
@@ -429,8 +668,10 @@ Eigen::MatrixXd runPredatorPreySimple(double step_size = 0.1, double h_step=1e-5
 //' @param nbatch Number of batches to run (number of samples to return)
 //' @param blen Length of each batch
 //' @param verbose Output debugging information
+//' @param surrogate_llikelihood Optional function returning a cheap approximation of the log likelihood. If passed, proposals are first screened with this function and only evaluated with llikelihood if they pass (delayed acceptance). The chain still samples from the exact posterior.
+//' @param tries Number of candidates proposed at each step using multiple-try Metropolis (Liu, Liang and Wong 2000). One of the candidates is selected based on its posterior density. Can not be used with a surrogate_llikelihood
 //' 
-//' @return Returns a list with the accepted samples and the corresponding llikelihood values
+//' @return Returns a list with the accepted samples and the corresponding llikelihood values. With a surrogate_llikelihood it also contains the fraction of proposals rejected in the first stage (stage1.rejection.rate) and the estimated speed up of the likelihood evaluations (speedup).
 //'
 //' @seealso \code{\link{adaptive.mcmc}} For a more flexible R frontend to this function.
 //'
@@ -441,7 +682,9 @@ Rcpp::List adaptiveMCMCR(
         Rcpp::Function acceptfun,
         size_t nburn,
         Eigen::VectorXd initial, 
-        size_t nbatch, size_t blen = 1, bool verbose = false )
+        size_t nbatch, size_t blen = 1, bool verbose = false,
+        Rcpp::Nullable<Rcpp::Function> surrogate_llikelihood = R_NilValue,
+        size_t tries = 1 )
 {
     auto cppLprior = [&lprior]( const Eigen::VectorXd &pars ) {
         PutRNGstate();
@@ -457,11 +700,28 @@ Rcpp::List adaptiveMCMCR(
         return ll;
     };
 
-    auto mcmcResult = flu::adaptiveMCMC( cppLprior, cppLlikelihood, outfun, acceptfun,
-            nburn, initial, nbatch, blen, verbose );
+    const bool delayed_acceptance = surrogate_llikelihood.isNotNull();
+    Rcpp::Function surrogate( delayed_acceptance ? 
+            surrogate_llikelihood.get() : (SEXP)llikelihood );
+    auto cppSurrogate = [&surrogate]( const Eigen::VectorXd &pars ) {
+        PutRNGstate();
+        double ll = Rcpp::as<double>(surrogate( pars ));
+        GetRNGstate();
+        return ll;
+    };
+
+    auto mcmcResult = flu::adaptiveMCMC( cppLprior, cppLlikelihood, 
+            cppSurrogate, delayed_acceptance, outfun, acceptfun,
+            nburn, initial, nbatch, blen, verbose, tries );
     Rcpp::List rState;
     rState["batch"] = Rcpp::wrap( mcmcResult.batch );
     rState["llikelihoods"] = Rcpp::wrap( mcmcResult.llikelihoods );
+    if (delayed_acceptance)
+    {
+        rState["stage1.rejection.rate"] = 
+            mcmcResult.delayed_acceptance.stage1_rejection_rate();
+        rState["speedup"] = mcmcResult.delayed_acceptance.speedup();
+    }
     return rState;
 }
 
@@ -496,6 +756,61 @@ Eigen::MatrixXd contact_matrix(
             age_data );
 }
 
+//' Bootstrap the contact data, updating the contact matrix incrementally, for testing purposes
+//'
+//' After each bootstrap step the incrementally updated contact matrix is compared to the matrix calculated from all (bootstrapped) participants, as done by \link{contact_matrix}.
+//'
+//' @param polymod_data Contact data for different age groups
+//' @param demography A vector with the population size by each age {0,1,2,..}
+//' @param no_steps Number of bootstrap steps
+//' @param no_swaps Number of participants swapped back from the original data in each step
+//' @param age_group_limits The upper limits of the different age groups
+//'
+//' @return A list with the largest difference relative to the largest element of the matrix over all steps (max.relative.difference) and the final incrementally updated (incremental) and recalculated (reference) contact matrices
+//'
+// [[Rcpp::export(name=".bootstrap_contact_matrix")]]
+Rcpp::List bootstrap_contact_matrix(
+        Eigen::MatrixXi polymod_data,
+        std::vector<size_t> demography,
+        size_t no_steps, size_t no_swaps,
+        Rcpp::NumericVector age_group_limits = Rcpp::NumericVector::create(
+            1, 5, 15, 25, 45, 65 ) )
+{
+    if (polymod_data.cols() - 2 != age_group_limits.size() + 1)
+        ::Rf_error("Number of age groups should be consistent for the polymod_data and the age_group_limits");
+
+    flu::data::age_data_t age_data;
+    age_data.age_sizes = demography;
+
+    auto agl_v = std::vector<size_t>(
+                age_group_limits.begin(), age_group_limits.end() );
+    age_data.age_group_sizes = flu::data::group_age_data( demography, agl_v );
+
+    const auto polymod = flu::contacts::table_to_contacts(polymod_data,
+            agl_v);
+    auto c = polymod;
+    flu::contacts::contact_matrix_t matrix( c, age_data );
+
+    double max_difference = 0;
+    Eigen::MatrixXd reference = flu::contacts::to_symmetric_matrix( c,
+            age_data );
+    for (size_t i = 0; i < no_steps; ++i)
+    {
+        c = flu::contacts::bootstrap_contacts( std::move(c), polymod,
+                no_swaps, matrix );
+        reference = flu::contacts::to_symmetric_matrix( c, age_data );
+        max_difference = std::max( max_difference,
+                (matrix.symmetric_matrix() - reference).cwiseAbs().maxCoeff()/
+                reference.cwiseAbs().maxCoeff() );
+    }
+
+    Rcpp::List result;
+    result["max.relative.difference"] = max_difference;
+    result["incremental"] = Rcpp::wrap( matrix.symmetric_matrix() );
+    result["reference"] = Rcpp::wrap( reference );
+    return result;
+}
+
 size_t as_age_group_index( size_t age,
         Rcpp::NumericVector limits = Rcpp::NumericVector::create(
             1, 5, 15, 25, 45, 65 ) )
@@ -138,5 +138,47 @@ template <> SEXP Rcpp::wrap( const flu::mcmc_result_inference_t &mcmcResult )
     rState["batch"] = Rcpp::wrap( mcmcResult.batch );
     rState["llikelihoods"] = Rcpp::wrap( mcmcResult.llikelihoods );
     rState["contact.ids"] = Rcpp::wrap( mcmcResult.contact_ids );
+    rState["ode.steps"] = Rcpp::wrap( mcmcResult.ode_steps );
+    if (mcmcResult.delayed_acceptance)
+    {
+        rState["stage1.rejection.rate"] = 
+            Rcpp::wrap( mcmcResult.stage1_rejection_rate );
+        rState["speedup"] = Rcpp::wrap( mcmcResult.speedup );
+    }
+    if (mcmcResult.early_rejection)
+        rState["early.rejection.rate"] = 
+            Rcpp::wrap( mcmcResult.early_rejection_rate );
+    if (mcmcResult.prefetch)
+        rState["prefetch.usage"] = Rcpp::wrap( mcmcResult.prefetch_usage );
+    if (mcmcResult.chain.size() > 0)
+        rState["chain"] = Rcpp::wrap( mcmcResult.chain );
+    if (mcmcResult.temperatures.size() > 0)
+    {
+        rState["temperatures"] = Rcpp::wrap( mcmcResult.temperatures );
+        rState["swap.rates"] = Rcpp::wrap( mcmcResult.swap_rates );
+    }
     return rState;
 }
+
+ode::method_t ode::as_method( const std::string &name )
+{
+    if (name == "euler")
+        return ode::EULER;
+    else if (name == "rkf45")
+        return ode::RKF45;
+    else if (name == "dopri5")
+        return ode::DOPRI5;
+    ::Rf_error( "Unknown ode method, should be one of: euler, rkf45 or dopri5" );
+    return ode::EULER;
+}
+
+flu::likelihood::summation_t flu::likelihood::as_summation( 
+        const std::string &name )
+{
+    if (name == "long_double")
+        return LONG_DOUBLE;
+    else if (name == "compensated")
+        return COMPENSATED;
+    ::Rf_error( "Unknown summation, should be one of: long_double or compensated" );
+    return COMPENSATED;
+}
@@ -6,6 +6,8 @@
 #include "state.h"
 #include "contacts.h"
 #include "inference.h"
+#include "ode.h"
+#include "likelihood.h"
 
 namespace Rcpp {
     using namespace flu;
@@ -43,6 +45,18 @@ namespace Rcpp {
     template <> SEXP wrap( const mcmc_result_inference_t &mcmcResult );
 }
 
+namespace ode {
+    /// Integration method by name ("euler", "rkf45" or "dopri5")
+    method_t as_method( const std::string &name );
+}
+
+namespace flu {
+    namespace likelihood {
+        /// Summation by name ("long_double" or "compensated")
+        summation_t as_summation( const std::string &name );
+    }
+}
+
 // [[Rcpp::plugins(cpp11)]]
 // [[Rcpp::depends(BH)]]
 // [[Rcpp::depends(RcppEigen)]]
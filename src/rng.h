@@ -0,0 +1,150 @@
+#ifndef FLU_RNG_HH
+#define FLU_RNG_HH
+
+#include<array>
+#include<cmath>
+#include<cstdint>
+
+#include <RcppCommon.h>
+
+namespace flu
+{
+    /**
+     * \brief Random number generation for the C++ core
+     *
+     * All random draws go through rng_t. By default (compatibility mode) it
+     * draws from R's random number generator, which gives the same results
+     * as before, but can only be used from the R main thread. Alternatively
+     * it uses a counter based generator (Philox4x32-10, Salmon et al. 2011),
+     * which needs no global state. Each chain or thread should then use its
+     * own stream, all seeded once from R.
+     */
+    namespace rng
+    {
+        /// Philox4x32-10 block function: ten rounds applied to the counter
+        inline std::array<uint32_t, 4> philox4x32(
+                std::array<uint32_t, 4> counter,
+                std::array<uint32_t, 2> key )
+        {
+            for (size_t round = 0; round < 10; ++round)
+            {
+                const uint64_t product0 =
+                    (uint64_t)0xD2511F53 * counter[0];
+                const uint64_t product1 =
+                    (uint64_t)0xCD9E8D57 * counter[2];
+                counter = {{
+                    (uint32_t)(product1 >> 32) ^ counter[1] ^ key[0],
+                    (uint32_t)product1,
+                    (uint32_t)(product0 >> 32) ^ counter[3] ^ key[1],
+                    (uint32_t)product0 }};
+                key[0] += 0x9E3779B9;
+                key[1] += 0xBB67AE85;
+            }
+            return counter;
+        }
+
+        class rng_t
+        {
+            public:
+                /// Compatibility mode: draw from R's random number generator
+                rng_t() : use_r( true ) {}
+
+                /// Counter based generator: given stream of the given seed
+                rng_t( uint64_t seed, uint64_t stream )
+                    : use_r( false ), seed( seed ), stream_id( stream ) {}
+
+                /// Another stream with the same seed (e.g. one per chain)
+                rng_t stream( uint64_t id ) const
+                {
+                    if (use_r)
+                        return rng_t();
+                    return rng_t( seed, id );
+                }
+
+                bool uses_r() const
+                {
+                    return use_r;
+                }
+
+                /// Uniform draw in (0,1)
+                double uniform()
+                {
+                    if (use_r)
+                        return R::runif(0,1);
+                    // Use 53 random bits
+                    const uint64_t high = next32();
+                    const uint64_t low = next32();
+                    const uint64_t bits = (high << 21) ^ (low >> 11);
+                    return (bits + 0.5)/9007199254740992.0; // 2^53
+                }
+
+                double uniform( double a, double b )
+                {
+                    if (use_r)
+                        return R::runif(a,b);
+                    return a + (b - a)*uniform();
+                }
+
+                /// Standard normal draw
+                double normal()
+                {
+                    if (use_r)
+                        return R::rnorm(0,1);
+                    if (has_normal)
+                    {
+                        has_normal = false;
+                        return next_normal;
+                    }
+                    // Box-Muller
+                    const double radius = sqrt(-2*log(uniform()));
+                    const double angle = 2*M_PI*uniform();
+                    next_normal = radius*cos(angle);
+                    has_normal = true;
+                    return radius*sin(angle);
+                }
+
+            private:
+                uint32_t next32()
+                {
+                    if (position == 4)
+                    {
+                        block = philox4x32( {{ (uint32_t)counter,
+                                (uint32_t)(counter >> 32),
+                                (uint32_t)stream_id,
+                                (uint32_t)(stream_id >> 32) }},
+                                {{ (uint32_t)seed, (uint32_t)(seed >> 32) }} );
+                        ++counter;
+                        position = 0;
+                    }
+                    return block[position++];
+                }
+
+                bool use_r;
+                uint64_t seed = 0;
+                uint64_t stream_id = 0;
+                uint64_t counter = 0;
+
+                std::array<uint32_t, 4> block;
+                size_t position = 4;
+
+                bool has_normal = false;
+                double next_normal = 0;
+        };
+
+        /// Draw a seed for the counter based generator from R's generator
+        inline uint64_t seed_from_r()
+        {
+            const uint64_t high = (uint64_t)R::runif(0, 4294967296.0);
+            const uint64_t low = (uint64_t)R::runif(0, 4294967296.0);
+            return (high << 32) | low;
+        }
+
+        /// Shared generator in compatibility mode, used by default
+        inline rng_t &default_rng()
+        {
+            static rng_t rng;
+            return rng;
+        }
+    }
+}
+#endif
@@ -0,0 +1,182 @@
+#ifndef FLU_TEMPERING_HH
+#define FLU_TEMPERING_HH
+
+#include<algorithm>
+#include<cmath>
+#include<condition_variable>
+#include<mutex>
+#include<vector>
+
+#include "rng.h"
+
+namespace flu {
+
+/**
+ * \brief Ladder of tempered chains for parallel tempering (replica exchange)
+ *
+ * Each rung of the ladder runs its own chain on its own thread, targeting the
+ * posterior with the likelihood raised to the power beta (one for the cold
+ * chain, smaller for the hotter chains). Every swap_interval iterations all
+ * rungs wait for each other and swaps between neighbouring temperatures are
+ * proposed, alternating between the even and the odd pairs.
+ *
+ * Instead of exchanging the (large) chain states, the rungs exchange their
+ * position in the ladder. The STATE that belongs to a position (e.g. the
+ * proposal distribution adapted to that temperature) stays with the position.
+ * The cold chain is the rung that is currently at position zero.
+ *
+ * The spacing of the temperatures is adapted towards the target swap rate
+ * (Atchadé, Roberts and Rosenthal 2011), using a decreasing step size.
+ */
+template<typename STATE>
+class tempering_t
+{
+    public:
+        tempering_t( size_t no_rungs, const STATE &state, rng::rng_t rng,
+                double target_swap_rate = 0.234, size_t swap_interval = 10 )
+            : swap_interval( swap_interval ),
+            target_swap_rate( target_swap_rate ), rng( rng ),
+            states( no_rungs, state ), positions( no_rungs ),
+            betas( no_rungs, 1.0 ),
+            log_spacing( no_rungs - 1, log(log(2.0)) ),
+            llikelihoods( no_rungs, 0 ),
+            no_proposed( no_rungs - 1, 0 ), no_accepted( no_rungs - 1, 0 )
+        {
+            for (size_t rung = 0; rung < no_rungs; ++rung)
+                positions[rung] = rung;
+            update_betas();
+        }
+
+        const size_t swap_interval;
+
+        /// Position of the rung in the ladder (0 is the cold chain)
+        size_t position( size_t rung ) const
+        {
+            return positions[rung];
+        }
+
+        /// Power of the likelihood targeted by the rung
+        double beta( size_t rung ) const
+        {
+            return betas[positions[rung]];
+        }
+
+        /// State belonging to the current position of the rung
+        STATE &state( size_t rung )
+        {
+            return states[positions[rung]];
+        }
+
+        /**
+         * \brief Wait for all rungs and propose swaps
+         *
+         * Called by each rung with the (untempered) log likelihood of its
+         * current state. The last rung to arrive proposes the swaps. Returns
+         * false if the ladder was stopped.
+         */
+        bool synchronise( size_t rung, double llikelihood )
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            if (stopped)
+                return false;
+            llikelihoods[rung] = llikelihood;
+            const auto generation = no_rounds;
+            if (++no_waiting == positions.size())
+            {
+                swap();
+                no_waiting = 0;
+                ++no_rounds;
+                all_arrived.notify_all();
+            } else {
+                all_arrived.wait( lock, [&]() {
+                        return stopped || no_rounds != generation; } );
+            }
+            return !stopped;
+        }
+
+        /// Release all waiting rungs (e.g. when one of them failed)
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            stopped = true;
+            all_arrived.notify_all();
+        }
+
+        /// Temperatures (1/beta) by position
+        std::vector<double> temperatures() const
+        {
+            std::vector<double> temps;
+            for (auto &beta : betas)
+                temps.push_back( 1.0/beta );
+            return temps;
+        }
+
+        /// Fraction of accepted swaps between position i and i+1
+        std::vector<double> swap_rates() const
+        {
+            std::vector<double> rates;
+            for (size_t i = 0; i < no_proposed.size(); ++i)
+                rates.push_back( (no_proposed[i] > 0) ?
+                        ((double)no_accepted[i])/no_proposed[i] : 0 );
+            return rates;
+        }
+
+    private:
+        void update_betas()
+        {
+            for (size_t i = 0; i < log_spacing.size(); ++i)
+                betas[i + 1] = betas[i]*exp(-exp(log_spacing[i]));
+        }
+
+        void swap()
+        {
+            std::vector<size_t> rung_at( positions.size() );
+            for (size_t rung = 0; rung < positions.size(); ++rung)
+                rung_at[positions[rung]] = rung;
+
+            const double step = 1.0/pow( no_rounds + 1.0, 0.6 );
+            for (size_t i = no_rounds % 2; i + 1 < positions.size(); i += 2)
+            {
+                const auto cold = rung_at[i];
+                const auto hot = rung_at[i + 1];
+                const double log_ratio = (betas[i] - betas[i + 1])*
+                    (llikelihoods[hot] - llikelihoods[cold]);
+                // NaN when both likelihoods are infinite: never swap
+                const double swap_probability = std::isnan( log_ratio ) ?
+                    0 : std::min( 1.0, exp( log_ratio ) );
+
+                ++no_proposed[i];
+                if (rng.uniform() < swap_probability)
+                {
+                    ++no_accepted[i];
+                    std::swap( positions[cold], positions[hot] );
+                }
+                // Neighbouring temperatures differ at most a factor ten, 
+                // which keeps rungs that are not needed at finite temperatures
+                log_spacing[i] = std::min( log(log(10.0)), log_spacing[i] + 
+                        step*(swap_probability - target_swap_rate) );
+            }
+            update_betas();
+        }
+
+        const double target_swap_rate;
+        rng::rng_t rng;
+
+        std::vector<STATE> states;
+        std::vector<size_t> positions;
+        std::vector<double> betas;
+        /// Log of log(beta_i/beta_{i+1}) for each neighbouring pair
+        std::vector<double> log_spacing;
+        std::vector<double> llikelihoods;
+
+        std::vector<size_t> no_proposed;
+        std::vector<size_t> no_accepted;
+
+        std::mutex mutex;
+        std::condition_variable all_arrived;
+        size_t no_waiting = 0;
+        size_t no_rounds = 0;
+        bool stopped = false;
+};
+}
+#endif
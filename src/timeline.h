@@ -0,0 +1,49 @@
+#ifndef TIMELINE_HH
+#define TIMELINE_HH
+
+#include<vector>
+
+#include <boost/date_time.hpp>
+
+namespace flu
+{
+    /**
+     * \brief Times of a model run in whole hours since a start time
+     *
+     * The model only works with the hours. Calendar times are only needed
+     * when converting to and from R.
+     */
+    struct timeline_t
+    {
+        timeline_t() {}
+
+        /// Time line starting at the first of the given times
+        explicit timeline_t(
+                const std::vector<boost::posix_time::ptime> &times )
+        {
+            if (times.size() > 0)
+                start_time = times[0];
+            for (auto &time : times)
+                hours.push_back( (time - start_time).hours() );
+        }
+
+        //! Calendar time that the hours are relative to
+        boost::posix_time::ptime start_time;
+
+        //! Hours since start_time
+        std::vector<long> hours;
+
+        inline size_t size() const
+        {
+            return hours.size();
+        }
+
+        /// Calendar time of the i-th entry
+        inline boost::posix_time::ptime time( size_t i ) const
+        {
+            return start_time + boost::posix_time::hours( hours[i] );
+        }
+    };
+}
+
+#endif
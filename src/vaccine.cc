@@ -5,11 +5,66 @@
 #include "data.h"
 #include "contacts.h"
 
-/*
 namespace flu {
     namespace vaccine {
-    };
-};*/
+        schedule_t::schedule_t( const vaccine_t &vaccine_programme,
+                const timeline_t &times )
+        {
+            const auto &calendar = vaccine_programme.calendar;
+            auto calendar_row = [&calendar]( int row ) 
+            {
+                if (row < 0 || row >= calendar.rows() || 
+                        (calendar.row(row).array() == 0).all())
+                    return -1;
+                return row;
+            };
+
+            breakpoints.push_back( 0 );
+            rows.push_back( -1 );
+            if (vaccine_programme.dates.size() > 0)
+            {
+                for (size_t i = 0; i < vaccine_programme.dates.size(); ++i)
+                {
+                    breakpoints.push_back( 
+                            (vaccine_programme.dates[i] - 
+                             times.start_time).hours() );
+                    rows.push_back( calendar_row( i ) );
+                }
+            } else {
+                // Legacy mode
+                for (auto &hour : times.hours)
+                {
+                    breakpoints.push_back( hour );
+                    rows.push_back( calendar_row( floor(hour/24.0-44) ) );
+                }
+            }
+
+            // Vaccination dates at or before the first output time only
+            // decide the rates at the start. Later breakpoints are kept, even
+            // when the rates do not change, so that the integration steps are
+            // the same as when splitting at every vaccination date.
+            size_t j = 0;
+            for (size_t i = 1; i < rows.size(); ++i)
+            {
+                if (j > 0 || breakpoints[i] > 0)
+                {
+                    ++j;
+                    breakpoints[j] = std::max( breakpoints[i], 
+                            breakpoints[j-1] );
+                }
+                rows[j] = rows[i];
+            }
+            breakpoints.resize( j+1 );
+            rows.resize( j+1 );
+        }
+
+        size_t schedule_t::piece( long hour ) const
+        {
+            return std::upper_bound( breakpoints.begin(), breakpoints.end(), 
+                    hour ) - breakpoints.begin() - 1;
+        }
+    }
+}
 
 //' Calculate number of influenza cases given a vaccination strategy
 //'
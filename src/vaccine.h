@@ -7,6 +7,8 @@
 
 #include<Eigen/Core>
 
+#include "timeline.h"
+
 namespace flu {
     namespace vaccine {
         /// Details of a vaccine programme
@@ -37,6 +39,38 @@ namespace flu {
              */
             std::vector<boost::posix_time::ptime> dates;
         };
+
+        /**
+         * \brief Vaccine calendar compiled into a piecewise constant schedule
+         *
+         * The schedule is compiled once for a time line and can then be 
+         * reused for every model run over that time line. Piece i starts
+         * at breakpoints[i] (in hours since the start of the time line) 
+         * and lasts till the next breakpoint. Its vaccination rates are 
+         * given by calendar row rows[i], or there is no vaccination when 
+         * rows[i] is negative. Calendar rows with only zero rates are 
+         * marked as no vaccination, so that the model can skip the 
+         * vaccination terms altogether.
+         *
+         * Legacy calendars (no dates, one row per day starting 44 days
+         * after the first output time) are sampled at the start of each 
+         * output interval.
+         */
+        struct schedule_t {
+            schedule_t() {}
+
+            schedule_t( const vaccine_t &vaccine_programme,
+                const timeline_t &times );
+
+            /// Start of each piece in hours since the start of the time line
+            std::vector<long> breakpoints;
+
+            /// Calendar row used in each piece (negative for no vaccination)
+            std::vector<int> rows;
+
+            /// Index of the piece active at the given hour
+            size_t piece( long hour ) const;
+        };
     }
 }
 #endif